@@ -131,6 +131,20 @@ main(int argc, char **argv)
 	/* The legendary Quake II mainloop */
 	while (1)
 	{
+#ifdef __linux__
+		/* a dedicated server blocks in NET_Sleep until a packet
+		   arrives or the next frame is due, packets are processed
+		   right away even if no time has passed. Then the frame
+		   gets 0 msec and the clock stays where it is. */
+		if (dedicated->value)
+		{
+			newtime = Sys_Milliseconds();
+			Qcommon_Frame(newtime - oldtime);
+			oldtime = newtime;
+			continue;
+		}
+#endif
+
 		/* find time spent rendering last frame */
 		do
 		{
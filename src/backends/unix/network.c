@@ -24,6 +24,11 @@
  * =======================================================================
  */
 
+/* For recvmmsg() - must be before sys/socket.h include! */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+ #define _GNU_SOURCE
+#endif
+
 #include "../../common/header/common.h"
 
 #include <unistd.h>
@@ -38,6 +43,12 @@
 #include <arpa/inet.h>
 #include <net/if.h>
 
+#ifdef __linux__
+ #include <stdint.h>
+ #include <sys/epoll.h>
+ #include <sys/timerfd.h>
+#endif
+
 netadr_t net_local_adr;
 
 #define LOOPBACK 0x7f000001
@@ -62,6 +73,12 @@ int ip6_sockets[2];
 int ipx_sockets[2];
 char *multicast_interface = NULL;
 
+#ifdef __linux__
+static int net_epollfd = -1;
+static int net_timerfd = -1;
+static int net_waitfds[4] = {-1, -1, -1, -1}; /* stdin, ip, ip6, ipx */
+#endif
+
 int NET_Socket(char *net_interface, int port, netsrc_t type, int family);
 char *NET_ErrorString(void);
 
@@ -578,6 +595,134 @@ NET_GetPacket(netsrc_t sock, netadr_t *net_from, sizebuf_t *net_message)
 	return false;
 }
 
+/*
+ * Reads up to maxmsgs pending datagrams into net_messages. On
+ * Linux each socket is drained with a single recvmmsg() call,
+ * other platforms fall back to one recvfrom() per datagram.
+ * Returns the number of messages read. A return value smaller
+ * than maxmsgs means that all sockets are drained.
+ */
+int
+NET_GetPackets(netsrc_t sock, netadr_t *net_from, sizebuf_t *net_messages,
+		int maxmsgs)
+{
+	int count;
+#ifdef __linux__
+	struct mmsghdr hdrs[MAX_NET_BATCH];
+	struct iovec iovs[MAX_NET_BATCH];
+	struct sockaddr_storage from[MAX_NET_BATCH];
+	netadr_t adr;
+	int net_socket;
+	int protocol;
+	int want;
+	int ret;
+	int i;
+#endif
+
+	if (maxmsgs > MAX_NET_BATCH)
+	{
+		maxmsgs = MAX_NET_BATCH;
+	}
+
+	count = 0;
+
+	while ((count < maxmsgs) &&
+		   NET_GetLoopPacket(sock, &net_from[count], &net_messages[count]))
+	{
+		count++;
+	}
+
+#ifdef __linux__
+	for (protocol = 0; protocol < 3 && count < maxmsgs; protocol++)
+	{
+		if (protocol == 0)
+		{
+			net_socket = ip_sockets[sock];
+		}
+		else if (protocol == 1)
+		{
+			net_socket = ip6_sockets[sock];
+		}
+		else
+		{
+			net_socket = ipx_sockets[sock];
+		}
+
+		if (!net_socket)
+		{
+			continue;
+		}
+
+		/* keep reading until the socket runs dry or the batch is full */
+		while (count < maxmsgs)
+		{
+			want = maxmsgs - count;
+			memset(hdrs, 0, sizeof(hdrs[0]) * want);
+
+			for (i = 0; i < want; i++)
+			{
+				iovs[i].iov_base = net_messages[count + i].data;
+				iovs[i].iov_len = net_messages[count + i].maxsize;
+				hdrs[i].msg_hdr.msg_name = &from[i];
+				hdrs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+				hdrs[i].msg_hdr.msg_iov = &iovs[i];
+				hdrs[i].msg_hdr.msg_iovlen = 1;
+			}
+
+			ret = recvmmsg(net_socket, hdrs, want, MSG_DONTWAIT, NULL);
+
+			if (ret == -1)
+			{
+				if ((errno != EWOULDBLOCK) && (errno != ECONNREFUSED))
+				{
+					Com_Printf("NET_GetPackets: %s\n", NET_ErrorString());
+				}
+
+				break;
+			}
+
+			/* oversized datagrams are dropped, so the
+			   good ones are moved to the front */
+			for (i = 0; i < ret; i++)
+			{
+				SockadrToNetadr(&from[i], &adr);
+
+				if ((hdrs[i].msg_len >= net_messages[count].maxsize) ||
+					(hdrs[i].msg_hdr.msg_flags & MSG_TRUNC))
+				{
+					Com_Printf("Oversize packet from %s\n",
+							NET_AdrToString(adr));
+					continue;
+				}
+
+				if (iovs[i].iov_base != net_messages[count].data)
+				{
+					memcpy(net_messages[count].data, iovs[i].iov_base,
+							hdrs[i].msg_len);
+				}
+
+				net_messages[count].cursize = hdrs[i].msg_len;
+				net_from[count] = adr;
+				count++;
+			}
+
+			if (ret < want)
+			{
+				break; /* socket is empty */
+			}
+		}
+	}
+#else
+	while ((count < maxmsgs) &&
+		   NET_GetPacket(sock, &net_from[count], &net_messages[count]))
+	{
+		count++;
+	}
+#endif
+
+	return count;
+}
+
 void
 NET_SendPacket(netsrc_t sock, int length, void *data, netadr_t to)
 {
@@ -730,6 +875,122 @@ NET_SendPacket(netsrc_t sock, int length, void *data, netadr_t to)
 	}
 }
 
+#ifdef __linux__
+/*
+ * Hands a batch of datagrams for one socket to sendmmsg().
+ * A failed datagram is reported and skipped, the rest of
+ * the batch is still sent.
+ */
+static void
+NET_FlushSendBatch(int net_socket, struct mmsghdr *hdrs, netadr_t **to,
+		int count)
+{
+	int sent;
+	int ret;
+
+	sent = 0;
+
+	while (sent < count)
+	{
+		ret = sendmmsg(net_socket, hdrs + sent, count - sent, 0);
+
+		if (ret == -1)
+		{
+			Com_Printf("NET_SendPackets ERROR: %s to %s\n", NET_ErrorString(),
+					NET_AdrToString(*to[sent]));
+			ret = 1;
+		}
+
+		sent += ret;
+	}
+}
+#endif
+
+/*
+ * Sends count datagrams. On Linux unicast IP datagrams are
+ * collected per socket and sent with one sendmmsg() call for
+ * each full batch. Everything else, and all datagrams on
+ * other platforms, goes through NET_SendPacket().
+ */
+void
+NET_SendPackets(netsrc_t sock, netadr_t *to, sizebuf_t *msgs, int count)
+{
+#ifdef __linux__
+	struct mmsghdr hdrs[2][MAX_NET_BATCH];
+	struct iovec iovs[2][MAX_NET_BATCH];
+	struct sockaddr_storage addrs[2][MAX_NET_BATCH];
+	netadr_t *dest[2][MAX_NET_BATCH];
+	int num[2];
+	int sockets[2];
+	struct sockaddr_storage addr;
+	int b, i, n;
+
+	sockets[0] = ip_sockets[sock];
+	sockets[1] = ip6_sockets[sock];
+	num[0] = num[1] = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		if ((to[i].type != NA_IP) && (to[i].type != NA_IP6))
+		{
+			NET_SendPacket(sock, msgs[i].cursize, msgs[i].data, to[i]);
+			continue;
+		}
+
+		NetadrToSockadr(&to[i], &addr);
+
+		/* multicast needs the scope lookup in NET_SendPacket */
+		if ((addr.ss_family == AF_INET6) &&
+			IN6_IS_ADDR_MULTICAST(&((struct sockaddr_in6 *)&addr)->sin6_addr))
+		{
+			NET_SendPacket(sock, msgs[i].cursize, msgs[i].data, to[i]);
+			continue;
+		}
+
+		/* v4 mapped IPv6 addresses go out over the IPv4 socket */
+		b = (addr.ss_family == AF_INET6) ? 1 : 0;
+
+		if (!sockets[b])
+		{
+			continue;
+		}
+
+		n = num[b]++;
+		addrs[b][n] = addr;
+		dest[b][n] = &to[i];
+		iovs[b][n].iov_base = msgs[i].data;
+		iovs[b][n].iov_len = msgs[i].cursize;
+		memset(&hdrs[b][n], 0, sizeof(hdrs[b][n]));
+		hdrs[b][n].msg_hdr.msg_name = &addrs[b][n];
+		hdrs[b][n].msg_hdr.msg_namelen = b ? sizeof(struct sockaddr_in6) :
+				sizeof(struct sockaddr_in);
+		hdrs[b][n].msg_hdr.msg_iov = &iovs[b][n];
+		hdrs[b][n].msg_hdr.msg_iovlen = 1;
+
+		if (num[b] == MAX_NET_BATCH)
+		{
+			NET_FlushSendBatch(sockets[b], hdrs[b], dest[b], num[b]);
+			num[b] = 0;
+		}
+	}
+
+	for (b = 0; b < 2; b++)
+	{
+		if (num[b])
+		{
+			NET_FlushSendBatch(sockets[b], hdrs[b], dest[b], num[b]);
+		}
+	}
+#else
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		NET_SendPacket(sock, msgs[i].cursize, msgs[i].data, to[i]);
+	}
+#endif
+}
+
 void
 NET_OpenIP(void)
 {
@@ -794,6 +1055,12 @@ NET_Config(qboolean multiplayer)
 				ipx_sockets[i] = 0;
 			}
 		}
+
+#ifdef __linux__
+		/* closing removed them from the epoll set,
+		   a new socket may get the same descriptor */
+		net_waitfds[1] = net_waitfds[2] = net_waitfds[3] = -1;
+#endif
 	}
 	else
 	{
@@ -978,6 +1245,115 @@ NET_ErrorString(void)
 	return strerror(code);
 }
 
+#ifdef __linux__
+
+/*
+ * Brings the epoll set in line with stdin and the server
+ * sockets, they're closed and reopened by NET_Config.
+ */
+static void
+NET_UpdateWaitSet(void)
+{
+	extern qboolean stdin_active;
+	struct epoll_event ev;
+	int fds[4];
+	int i;
+
+	fds[0] = stdin_active ? 0 : -1;
+	fds[1] = ip_sockets[NS_SERVER] ? ip_sockets[NS_SERVER] : -1;
+	fds[2] = ip6_sockets[NS_SERVER] ? ip6_sockets[NS_SERVER] : -1;
+	fds[3] = ipx_sockets[NS_SERVER] ? ipx_sockets[NS_SERVER] : -1;
+
+	for (i = 0; i < 4; i++)
+	{
+		if (fds[i] == net_waitfds[i])
+		{
+			continue;
+		}
+
+		if (net_waitfds[i] != -1)
+		{
+			epoll_ctl(net_epollfd, EPOLL_CTL_DEL, net_waitfds[i], NULL);
+		}
+
+		net_waitfds[i] = fds[i];
+
+		if (fds[i] != -1)
+		{
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN;
+			ev.data.fd = fds[i];
+
+			/* regular files and /dev/null can't be polled,
+			   reading them never blocks anyway */
+			if (epoll_ctl(net_epollfd, EPOLL_CTL_ADD, fds[i], &ev) == -1)
+			{
+				net_waitfds[i] = -1;
+			}
+		}
+	}
+}
+
+/*
+ * Blocks until a packet or console input arrives or msec
+ * milliseconds have passed. The timer is set on the wall
+ * clock millisecond Sys_Milliseconds() will reach, so the
+ * frame that is due doesn't wake a millisecond too early.
+ */
+void
+NET_Sleep(int msec)
+{
+	struct epoll_event events[5];
+	struct itimerspec deadline;
+	struct timeval now;
+	long long ms;
+	uint64_t expirations;
+
+	if (dedicated && !dedicated->value)
+	{
+		return; /* we're not a server, just run full speed */
+	}
+
+	if (net_epollfd == -1)
+	{
+		struct epoll_event ev;
+
+		net_epollfd = epoll_create1(EPOLL_CLOEXEC);
+		net_timerfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+
+		if ((net_epollfd == -1) || (net_timerfd == -1))
+		{
+			Com_Error(ERR_FATAL, "NET_Sleep: %s", strerror(errno));
+		}
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = net_timerfd;
+		epoll_ctl(net_epollfd, EPOLL_CTL_ADD, net_timerfd, &ev);
+	}
+
+	NET_UpdateWaitSet();
+
+	gettimeofday(&now, NULL);
+	ms = (long long)now.tv_sec * 1000 + now.tv_usec / 1000 + msec;
+
+	memset(&deadline, 0, sizeof(deadline));
+	deadline.it_value.tv_sec = ms / 1000;
+	deadline.it_value.tv_nsec = (ms % 1000) * 1000000;
+	timerfd_settime(net_timerfd, TFD_TIMER_ABSTIME, &deadline, NULL);
+
+	/* EINTR just means an early wakeup */
+	epoll_wait(net_epollfd, events, 5, -1);
+
+	/* fails with EAGAIN if woken by input */
+	if (read(net_timerfd, &expirations, sizeof(expirations)) < 0)
+	{
+		return;
+	}
+}
+
+#else
+
 /*
  * sleeps msec or until net socket is ready
  */
@@ -1010,3 +1386,5 @@ NET_Sleep(int msec)
 					ip6_sockets[NS_SERVER]) + 1, &fdset, NULL, NULL, &timeout);
 }
 
+#endif
+
@@ -29,6 +29,7 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -44,6 +45,7 @@
 #include <errno.h>
 #include <dlfcn.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #include "../../common/header/common.h"
 #include "../../common/header/glob.h"
@@ -99,6 +101,19 @@ Sys_Milliseconds(void)
 	return curtime;
 }
 
+/*
+ * Monotonic time for profiling, unrelated to curtime
+ */
+long long
+Sys_Microseconds(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
 void
 Sys_Sleep(int msec)
 {
@@ -559,3 +574,202 @@ Sys_RedirectStdout(void)
 {
 	return;
 }
+
+/* ================================================================ */
+
+static pthread_t sys_workers[MAX_WORKERS];
+static int sys_numworkers;
+static pthread_mutex_t sys_worklock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sys_workstart = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t sys_workdone = PTHREAD_COND_INITIALIZER;
+static void (*sys_workfunc)(int job);
+static int sys_worknext, sys_workjobs, sys_workfinished;
+static unsigned sys_workbatch;
+static qboolean sys_workquit;
+
+/*
+ * Takes jobs of the current batch until there are none
+ * left. Must be called with sys_worklock held.
+ */
+static void
+Sys_DoWork(void)
+{
+	int job;
+
+	while (sys_worknext < sys_workjobs)
+	{
+		job = sys_worknext++;
+
+		pthread_mutex_unlock(&sys_worklock);
+		sys_workfunc(job);
+		pthread_mutex_lock(&sys_worklock);
+
+		if (++sys_workfinished == sys_workjobs)
+		{
+			pthread_cond_signal(&sys_workdone);
+		}
+	}
+}
+
+static void *
+Sys_WorkerThread(void *arg)
+{
+	unsigned batch;
+
+	pthread_mutex_lock(&sys_worklock);
+
+	batch = sys_workbatch;
+
+	while (true)
+	{
+		while (!sys_workquit && (batch == sys_workbatch))
+		{
+			pthread_cond_wait(&sys_workstart, &sys_worklock);
+		}
+
+		if (sys_workquit)
+		{
+			break;
+		}
+
+		batch = sys_workbatch;
+		Sys_DoWork();
+	}
+
+	pthread_mutex_unlock(&sys_worklock);
+
+	return NULL;
+}
+
+/*
+ * Starts count worker threads, replacing the running
+ * ones. Returns how many could be started.
+ */
+int
+Sys_StartWorkers(int count)
+{
+	int ret;
+
+	Sys_StopWorkers();
+
+	if (count > MAX_WORKERS)
+	{
+		count = MAX_WORKERS;
+	}
+
+	while (sys_numworkers < count)
+	{
+		ret = pthread_create(&sys_workers[sys_numworkers], NULL,
+				Sys_WorkerThread, NULL);
+
+		if (ret)
+		{
+			Com_Printf("Couldn't start worker thread: %s\n", strerror(ret));
+			break;
+		}
+
+		sys_numworkers++;
+	}
+
+	return sys_numworkers;
+}
+
+void
+Sys_StopWorkers(void)
+{
+	int i;
+
+	if (!sys_numworkers)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&sys_worklock);
+	sys_workquit = true;
+	pthread_cond_broadcast(&sys_workstart);
+	pthread_mutex_unlock(&sys_worklock);
+
+	for (i = 0; i < sys_numworkers; i++)
+	{
+		pthread_join(sys_workers[i], NULL);
+	}
+
+	sys_numworkers = 0;
+	sys_workquit = false;
+}
+
+/*
+ * Calls func for every job in 0 to numjobs - 1, spread
+ * over the workers and the calling thread. Returns
+ * when all jobs are finished.
+ */
+void
+Sys_RunWorkers(void (*func)(int job), int numjobs)
+{
+	int i;
+
+	if (!sys_numworkers || (numjobs < 2))
+	{
+		for (i = 0; i < numjobs; i++)
+		{
+			func(i);
+		}
+
+		return;
+	}
+
+	pthread_mutex_lock(&sys_worklock);
+
+	sys_workfunc = func;
+	sys_worknext = 0;
+	sys_workjobs = numjobs;
+	sys_workfinished = 0;
+	sys_workbatch++;
+	pthread_cond_broadcast(&sys_workstart);
+
+	Sys_DoWork();
+
+	while (sys_workfinished < sys_workjobs)
+	{
+		pthread_cond_wait(&sys_workdone, &sys_worklock);
+	}
+
+	pthread_mutex_unlock(&sys_worklock);
+}
+
+void *
+Sys_MapFile(const char *path, int *size)
+{
+	struct stat st;
+	void *base;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+	{
+		return NULL;
+	}
+
+	if ((fstat(fd, &st) == -1) || (st.st_size <= 0) || (st.st_size > INT_MAX))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (base == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	*size = (int)st.st_size;
+
+	return base;
+}
+
+void
+Sys_UnmapFile(void *base, int size)
+{
+	munmap(base, size);
+}
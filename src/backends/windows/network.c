@@ -624,6 +624,29 @@ NET_GetPacket(netsrc_t sock, netadr_t *net_from, sizebuf_t *net_message)
 	return false;
 }
 
+/*
+ * Reads up to maxmsgs pending datagrams into net_messages.
+ * Winsock has no batched receive, so this is just a loop
+ * around NET_GetPacket(). Returns the number of messages
+ * read, less than maxmsgs means that all sockets are drained.
+ */
+int
+NET_GetPackets(netsrc_t sock, netadr_t *net_from, sizebuf_t *net_messages,
+		int maxmsgs)
+{
+	int count;
+
+	count = 0;
+
+	while ((count < maxmsgs) &&
+		   NET_GetPacket(sock, &net_from[count], &net_messages[count]))
+	{
+		count++;
+	}
+
+	return count;
+}
+
 /* ============================================================================= */
 
 void
@@ -797,6 +820,21 @@ NET_SendPacket(netsrc_t sock, int length, void *data, netadr_t to)
 	}
 }
 
+/*
+ * Sends count datagrams. Winsock has no batched send,
+ * so this is just a loop around NET_SendPacket().
+ */
+void
+NET_SendPackets(netsrc_t sock, netadr_t *to, sizebuf_t *msgs, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		NET_SendPacket(sock, msgs[i].cursize, msgs[i].data, to[i]);
+	}
+}
+
 /* ============================================================================= */
 
 int
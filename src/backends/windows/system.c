@@ -25,8 +25,13 @@
  * =======================================================================
  */
 
+/* Require Win Vista or higher for the
+   condition variables of the workers */
+#define _WIN32_WINNT 0x0600
+
 #include <errno.h>
 #include <float.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <direct.h>
@@ -429,6 +434,26 @@ Sys_Milliseconds(void)
 	return curtime;
 }
 
+/*
+ * Monotonic time for profiling, unrelated to curtime
+ */
+long long
+Sys_Microseconds(void)
+{
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (!freq.QuadPart)
+	{
+		QueryPerformanceFrequency(&freq);
+	}
+
+	QueryPerformanceCounter(&now);
+
+	return (now.QuadPart / freq.QuadPart) * 1000000 +
+		   (now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+}
+
 void
 Sys_Sleep(int msec)
 {
@@ -852,3 +877,224 @@ Sys_GetProcAddress(void *handle, const char *sym)
 	return GetProcAddress(handle, sym);
 }
 
+
+/* ================================================================ */
+
+static HANDLE sys_workers[MAX_WORKERS];
+static int sys_numworkers;
+static CRITICAL_SECTION sys_worklock;
+static CONDITION_VARIABLE sys_workstart;
+static CONDITION_VARIABLE sys_workdone;
+static qboolean sys_worklockinit;
+static void (*sys_workfunc)(int job);
+static int sys_worknext, sys_workjobs, sys_workfinished;
+static unsigned sys_workbatch;
+static qboolean sys_workquit;
+
+/*
+ * Takes jobs of the current batch until there are none
+ * left. Must be called with sys_worklock held.
+ */
+static void
+Sys_DoWork(void)
+{
+	int job;
+
+	while (sys_worknext < sys_workjobs)
+	{
+		job = sys_worknext++;
+
+		LeaveCriticalSection(&sys_worklock);
+		sys_workfunc(job);
+		EnterCriticalSection(&sys_worklock);
+
+		if (++sys_workfinished == sys_workjobs)
+		{
+			WakeConditionVariable(&sys_workdone);
+		}
+	}
+}
+
+static DWORD WINAPI
+Sys_WorkerThread(LPVOID arg)
+{
+	unsigned batch;
+
+	EnterCriticalSection(&sys_worklock);
+
+	batch = sys_workbatch;
+
+	while (true)
+	{
+		while (!sys_workquit && (batch == sys_workbatch))
+		{
+			SleepConditionVariableCS(&sys_workstart, &sys_worklock, INFINITE);
+		}
+
+		if (sys_workquit)
+		{
+			break;
+		}
+
+		batch = sys_workbatch;
+		Sys_DoWork();
+	}
+
+	LeaveCriticalSection(&sys_worklock);
+
+	return 0;
+}
+
+/*
+ * Starts count worker threads, replacing the running
+ * ones. Returns how many could be started.
+ */
+int
+Sys_StartWorkers(int count)
+{
+	Sys_StopWorkers();
+
+	if (!sys_worklockinit)
+	{
+		InitializeCriticalSection(&sys_worklock);
+		InitializeConditionVariable(&sys_workstart);
+		InitializeConditionVariable(&sys_workdone);
+		sys_worklockinit = true;
+	}
+
+	if (count > MAX_WORKERS)
+	{
+		count = MAX_WORKERS;
+	}
+
+	while (sys_numworkers < count)
+	{
+		sys_workers[sys_numworkers] = CreateThread(NULL, 0,
+				Sys_WorkerThread, NULL, 0, NULL);
+
+		if (!sys_workers[sys_numworkers])
+		{
+			Com_Printf("Couldn't start worker thread: %d\n", (int)GetLastError());
+			break;
+		}
+
+		sys_numworkers++;
+	}
+
+	return sys_numworkers;
+}
+
+void
+Sys_StopWorkers(void)
+{
+	int i;
+
+	if (!sys_numworkers)
+	{
+		return;
+	}
+
+	EnterCriticalSection(&sys_worklock);
+	sys_workquit = true;
+	WakeAllConditionVariable(&sys_workstart);
+	LeaveCriticalSection(&sys_worklock);
+
+	WaitForMultipleObjects(sys_numworkers, sys_workers, TRUE, INFINITE);
+
+	for (i = 0; i < sys_numworkers; i++)
+	{
+		CloseHandle(sys_workers[i]);
+	}
+
+	sys_numworkers = 0;
+	sys_workquit = false;
+}
+
+/*
+ * Calls func for every job in 0 to numjobs - 1, spread
+ * over the workers and the calling thread. Returns
+ * when all jobs are finished.
+ */
+void
+Sys_RunWorkers(void (*func)(int job), int numjobs)
+{
+	int i;
+
+	if (!sys_numworkers || (numjobs < 2))
+	{
+		for (i = 0; i < numjobs; i++)
+		{
+			func(i);
+		}
+
+		return;
+	}
+
+	EnterCriticalSection(&sys_worklock);
+
+	sys_workfunc = func;
+	sys_worknext = 0;
+	sys_workjobs = numjobs;
+	sys_workfinished = 0;
+	sys_workbatch++;
+	WakeAllConditionVariable(&sys_workstart);
+
+	Sys_DoWork();
+
+	while (sys_workfinished < sys_workjobs)
+	{
+		SleepConditionVariableCS(&sys_workdone, &sys_worklock, INFINITE);
+	}
+
+	LeaveCriticalSection(&sys_worklock);
+}
+
+void *
+Sys_MapFile(const char *path, int *size)
+{
+	HANDLE file, mapping;
+	DWORD high, low;
+	void *base;
+
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+			NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return NULL;
+	}
+
+	low = GetFileSize(file, &high);
+
+	if ((low == INVALID_FILE_SIZE) || high || !low || (low > INT_MAX))
+	{
+		CloseHandle(file);
+		return NULL;
+	}
+
+	mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	CloseHandle(file);
+
+	if (!mapping)
+	{
+		return NULL;
+	}
+
+	base = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+	CloseHandle(mapping);
+
+	if (!base)
+	{
+		return NULL;
+	}
+
+	*size = (int)low;
+
+	return base;
+}
+
+void
+Sys_UnmapFile(void *base, int size)
+{
+	UnmapViewOfFile(base);
+}
@@ -391,7 +391,7 @@ CL_RequestNextDownload(void)
 	if (precache_check == TEXTURE_CNT + 1)
 	{
 		extern int numtexinfo;
-		extern mapsurface_t map_surfaces[];
+		extern mapsurface_t *map_surfaces;
 
 		if (allow_download->value && allow_download_maps->value)
 		{
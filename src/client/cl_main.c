@@ -55,6 +55,8 @@ cvar_t *cl_async;
 
 cvar_t *cl_shownet;
 cvar_t *cl_showmiss;
+cvar_t *cl_packedents;
+cvar_t *cl_fragments;
 cvar_t *cl_showclamp;
 
 cvar_t *cl_paused;
@@ -105,18 +107,28 @@ extern cvar_t *allow_download_sounds;
 extern cvar_t *allow_download_maps;
 
 /*
- * Dumps the current net message, prefixed by the length
+ * Dumps the current net message, prefixed by the length. A
+ * message put together from fragments is split into several
+ * blocks at the given offsets, so each fits into MAX_MSGLEN.
  */
 void
-CL_WriteDemoMessage(void)
+CL_WriteDemoMessage(int *splits, int numsplits)
 {
-	int len, swlen;
+	int i, start, end, swlen;
 
 	/* the first eight bytes are just packet sequencing stuff */
-	len = net_message.cursize - 8;
-	swlen = LittleLong(len);
-	fwrite(&swlen, 4, 1, cls.demofile);
-	fwrite(net_message.data + 8, len, 1, cls.demofile);
+	start = 8;
+
+	for (i = 0; i <= numsplits; i++)
+	{
+		end = (i < numsplits) ? splits[i] : net_message.cursize;
+
+		swlen = LittleLong(end - start);
+		fwrite(&swlen, 4, 1, cls.demofile);
+		fwrite(net_message.data + start, end - start, 1, cls.demofile);
+
+		start = end;
+	}
 }
 
 /*
@@ -187,6 +199,12 @@ CL_Record_f(void)
 		return;
 	}
 
+	if (cls.serverProtocol == PROTOCOL_PACKED)
+	{
+		Com_Printf("Recording with packed entities, set cl_packedents 0 and\n"
+				"reconnect for a demo other clients can play.\n");
+	}
+
 	cls.demorecording = true;
 
 	/* don't start saving messages until a non-delta compressed message is received */
@@ -197,7 +215,7 @@ CL_Record_f(void)
 
 	/* send the serverdata */
 	MSG_WriteByte(&buf, svc_serverdata);
-	MSG_WriteLong(&buf, PROTOCOL_VERSION);
+	MSG_WriteLong(&buf, cls.serverProtocol); /* the frames are recorded as sent */
 	MSG_WriteLong(&buf, 0x10000 + cl.servercount);
 	MSG_WriteByte(&buf, 1);  /* demos are always attract loops */
 	MSG_WriteString(&buf, cl.gamedir);
@@ -508,6 +526,10 @@ CL_InitLocal(void)
 
 	cl_shownet = Cvar_Get("cl_shownet", "0", 0);
 	cl_showmiss = Cvar_Get("cl_showmiss", "0", 0);
+	/* opt-in, demos recorded with it need a client that knows
+	   PROTOCOL_PACKED, stock clients and demo tools can't read them */
+	cl_packedents = Cvar_Get("cl_packedents", "0", CVAR_ARCHIVE);
+	cl_fragments = Cvar_Get("cl_fragments", "1", CVAR_ARCHIVE);
 	cl_showclamp = Cvar_Get("showclamp", "0", 0);
 	cl_timeout = Cvar_Get("cl_timeout", "120", 0);
 	cl_paused = Cvar_Get("paused", "0", 0);
@@ -979,7 +1001,7 @@ CL_Init(void)
 
 	net_message.data = net_message_buffer;
 
-	net_message.maxsize = sizeof(net_message_buffer);
+	net_message.maxsize = MAX_MSGLEN;
 
 	M_Init();
 
@@ -134,8 +134,12 @@ CL_SendConnectPacket(void)
 
 	userinfo_modified = false;
 
-	Netchan_OutOfBandPrint(NS_CLIENT, adr, "connect %i %i %i \"%s\"\n",
-			PROTOCOL_VERSION, port, cls.challenge, Cvar_Userinfo());
+	/* older servers ignore the request for fragments,
+	   the loopback can't take their bursts */
+	Netchan_OutOfBandPrint(NS_CLIENT, adr, "connect %i %i %i \"%s\"%s\n",
+			cls.connectProtocol, port, cls.challenge, Cvar_Userinfo(),
+			(cl_fragments->value && (adr.type != NA_LOOPBACK)) ?
+			" fragments" : "");
 }
 
 /*
@@ -152,6 +156,7 @@ CL_CheckForResend(void)
 		cls.state = ca_connecting;
 		Q_strlcpy(cls.servername, "localhost", sizeof(cls.servername));
 		/* we don't need a challenge on the localhost */
+		cls.connectProtocol = PROTOCOL_VERSION;
 		CL_SendConnectPacket();
 		return;
 	}
@@ -345,6 +350,8 @@ CL_Disconnect(void)
 	Netchan_Transmit(&cls.netchan, strlen((const char *)final), final);
 	Netchan_Transmit(&cls.netchan, strlen((const char *)final), final);
 
+	Netchan_FreeFragments(&cls.netchan);
+
 	CL_ClearState();
 
 	/* stop file download */
@@ -562,6 +569,7 @@ CL_ConnectionlessPacket(void)
 {
 	char *s;
 	char *c;
+	int i;
 
 	MSG_BeginReading(&net_message);
 	MSG_ReadLong(&net_message); /* skip the -1 */
@@ -583,8 +591,15 @@ CL_ConnectionlessPacket(void)
 			return;
 		}
 
+		/* a reconnect may not have gone through CL_Disconnect */
+		Netchan_FreeFragments(&cls.netchan);
 		Netchan_Setup(NS_CLIENT, &cls.netchan, net_from, cls.quakePort);
 
+		if (!strcmp(Cmd_Argv(1), "fragments"))
+		{
+			Netchan_EnableFragments(&cls.netchan);
+		}
+
 		MSG_WriteChar(&cls.netchan.message, clc_stringcmd);
 		MSG_WriteString(&cls.netchan.message, "new");
 		cls.state = ca_connected;
@@ -632,6 +647,17 @@ CL_ConnectionlessPacket(void)
 	if (!strcmp(c, "challenge"))
 	{
 		cls.challenge = (int)strtol(Cmd_Argv(1), (char **)NULL, 10);
+		cls.connectProtocol = PROTOCOL_VERSION;
+
+		/* servers that speak PROTOCOL_PACKED say so */
+		for (i = 2; i < Cmd_Argc(); i++)
+		{
+			if (!strcmp(Cmd_Argv(i), "packedents") && cl_packedents->value)
+			{
+				cls.connectProtocol = PROTOCOL_PACKED;
+			}
+		}
+
 		CL_SendConnectPacket();
 		return;
 	}
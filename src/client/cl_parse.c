@@ -31,6 +31,10 @@ void CL_ParseDownload(void);
 
 int bitcounts[32]; /* just for protocol profiling */
 
+/* a reliable message of MAX_RELIABLE_MSGLEN
+   bytes fits into this many demo blocks */
+#define MAX_DEMOSPLITS 64
+
 char *svc_strings[256] = {
 	"svc_bad",
 
@@ -271,23 +275,15 @@ CL_ParseDelta(entity_state_t *from, entity_state_t *to, int number, int bits)
 }
 
 /*
- * Parses deltas from the given base and adds the resulting entity to
- * the current frame
+ * Makes the freshly parsed state the current one of the entity
  */
-void
-CL_DeltaEntity(frame_t *frame, int newnum, entity_state_t *old, int bits)
+static void
+CL_UpdateEntity(int newnum, entity_state_t *state)
 {
 	centity_t *ent;
-	entity_state_t *state;
 
 	ent = &cl_entities[newnum];
 
-	state = &cl_parse_entities[cl.parse_entities & (MAX_PARSE_ENTITIES - 1)];
-	cl.parse_entities++;
-	frame->num_entities++;
-
-	CL_ParseDelta(old, state, newnum, bits);
-
 	/* some data changes will force no lerping */
 	if ((state->modelindex != ent->current.modelindex) ||
 		(state->modelindex2 != ent->current.modelindex2) ||
@@ -333,6 +329,40 @@ CL_DeltaEntity(frame_t *frame, int newnum, entity_state_t *old, int bits)
 	ent->current = *state;
 }
 
+/*
+ * Parses deltas from the given base and adds the resulting entity to
+ * the current frame
+ */
+void
+CL_DeltaEntity(frame_t *frame, int newnum, entity_state_t *old, int bits)
+{
+	entity_state_t *state;
+
+	state = &cl_parse_entities[cl.parse_entities & (MAX_PARSE_ENTITIES - 1)];
+	cl.parse_entities++;
+	frame->num_entities++;
+
+	CL_ParseDelta(old, state, newnum, bits);
+	CL_UpdateEntity(newnum, state);
+}
+
+/*
+ * CL_DeltaEntity for PROTOCOL_PACKED
+ */
+static void
+CL_PackedDeltaEntity(frame_t *frame, bitbuf_t *bb, int newnum,
+		entity_state_t *old)
+{
+	entity_state_t *state;
+
+	state = &cl_parse_entities[cl.parse_entities & (MAX_PARSE_ENTITIES - 1)];
+	cl.parse_entities++;
+	frame->num_entities++;
+
+	MSG_ReadPackedDelta(bb, old, state, newnum);
+	CL_UpdateEntity(newnum, state);
+}
+
 /*
  * An svc_packetentities has just been
  * parsed, deal with the rest of the
@@ -516,6 +546,149 @@ CL_ParsePacketEntities(frame_t *oldframe, frame_t *newframe)
 	}
 }
 
+/*
+ * The PROTOCOL_PACKED variant of CL_ParsePacketEntities,
+ * see SV_EmitPackedEntities for the format.
+ */
+static void
+CL_ParsePackedEntities(frame_t *oldframe, frame_t *newframe)
+{
+	entity_state_t *oldstate = NULL;
+	int oldindex, oldnum;
+	int newnum, last;
+	bitbuf_t bb;
+
+	newframe->parse_entities = cl.parse_entities;
+	newframe->num_entities = 0;
+
+	oldindex = 0;
+	oldnum = 99999;
+
+	if (oldframe && (oldframe->num_entities > 0))
+	{
+		oldstate = &cl_parse_entities[oldframe->parse_entities &
+			(MAX_PARSE_ENTITIES - 1)];
+		oldnum = oldstate->number;
+	}
+
+	MSG_BeginBits(&bb, &net_message);
+	last = 0;
+
+	while (1)
+	{
+		newnum = MSG_ReadPackedNumber(&bb, last);
+
+		if (newnum >= MAX_EDICTS)
+		{
+			Com_Error(ERR_DROP, "CL_ParsePackedEntities: bad number:%i", newnum);
+		}
+
+		if (net_message.readcount > net_message.cursize)
+		{
+			Com_Error(ERR_DROP, "CL_ParsePackedEntities: end of message");
+		}
+
+		if (!newnum)
+		{
+			break;
+		}
+
+		last = newnum;
+
+		/* the entities skipped in the list are unchanged */
+		while (oldnum < newnum)
+		{
+			if (cl_shownet->value == 3)
+			{
+				Com_Printf("   unchanged: %i\n", oldnum);
+			}
+
+			CL_DeltaEntity(newframe, oldnum, oldstate, 0);
+
+			if (++oldindex >= oldframe->num_entities)
+			{
+				oldnum = 99999;
+			}
+			else
+			{
+				oldstate = &cl_parse_entities[(oldframe->parse_entities +
+										oldindex) & (MAX_PARSE_ENTITIES - 1)];
+				oldnum = oldstate->number;
+			}
+		}
+
+		if (MSG_ReadBits(&bb, 1))
+		{
+			/* the entity present in oldframe is not in the current frame */
+			if (cl_shownet->value == 3)
+			{
+				Com_Printf("   remove: %i\n", newnum);
+			}
+
+			if (oldnum != newnum)
+			{
+				Com_Printf("U_REMOVE: oldnum != newnum\n");
+				continue;
+			}
+		}
+		else if (oldnum == newnum)
+		{
+			/* delta from previous state */
+			if (cl_shownet->value == 3)
+			{
+				Com_Printf("   delta: %i\n", newnum);
+			}
+
+			CL_PackedDeltaEntity(newframe, &bb, newnum, oldstate);
+		}
+		else
+		{
+			/* delta from baseline */
+			if (cl_shownet->value == 3)
+			{
+				Com_Printf("   baseline: %i\n", newnum);
+			}
+
+			CL_PackedDeltaEntity(newframe, &bb, newnum,
+					&cl_entities[newnum].baseline);
+			continue;
+		}
+
+		if (++oldindex >= oldframe->num_entities)
+		{
+			oldnum = 99999;
+		}
+		else
+		{
+			oldstate = &cl_parse_entities[(oldframe->parse_entities +
+									oldindex) & (MAX_PARSE_ENTITIES - 1)];
+			oldnum = oldstate->number;
+		}
+	}
+
+	/* any remaining entities in the old frame are copied over */
+	while (oldnum != 99999)
+	{
+		if (cl_shownet->value == 3)
+		{
+			Com_Printf("   unchanged: %i\n", oldnum);
+		}
+
+		CL_DeltaEntity(newframe, oldnum, oldstate, 0);
+
+		if (++oldindex >= oldframe->num_entities)
+		{
+			oldnum = 99999;
+		}
+		else
+		{
+			oldstate = &cl_parse_entities[(oldframe->parse_entities +
+									oldindex) & (MAX_PARSE_ENTITIES - 1)];
+			oldnum = oldstate->number;
+		}
+	}
+}
+
 void
 CL_ParsePlayerstate(frame_t *oldframe, frame_t *newframe)
 {
@@ -774,7 +947,14 @@ CL_ParseFrame(void)
 		Com_Error(ERR_DROP, "CL_ParseFrame: 0x%X not packetentities", cmd);
 	}
 
-	CL_ParsePacketEntities(old, &cl.frame);
+	if (cls.serverProtocol == PROTOCOL_PACKED)
+	{
+		CL_ParsePackedEntities(old, &cl.frame);
+	}
+	else
+	{
+		CL_ParsePacketEntities(old, &cl.frame);
+	}
 
 	/* save the frame off in the backup array for later delta comparisons */
 	cl.frames[cl.frame.serverframe & UPDATE_MASK] = cl.frame;
@@ -832,7 +1012,7 @@ CL_ParseServerData(void)
 	if (Com_ServerState() && (PROTOCOL_VERSION == 34))
 	{
 	}
-	else if (i != PROTOCOL_VERSION)
+	else if ((i != PROTOCOL_VERSION) && (i != PROTOCOL_PACKED))
 	{
 		Com_Error(ERR_DROP, "Server returned version %i, not %i",
 				i, PROTOCOL_VERSION);
@@ -1245,6 +1425,8 @@ CL_ParseServerMessage(void)
 	int cmd;
 	char *s;
 	int i;
+	int splits[MAX_DEMOSPLITS];
+	int numsplits, blockstart, cmdstart;
 
 	/* if recording demos, copy the message out */
 	if (cl_shownet->value == 1)
@@ -1257,6 +1439,9 @@ CL_ParseServerMessage(void)
 		Com_Printf("------------------\n");
 	}
 
+	numsplits = 0;
+	blockstart = cmdstart = net_message.readcount;
+
 	/* parse the message */
 	while (1)
 	{
@@ -1266,6 +1451,17 @@ CL_ParseServerMessage(void)
 			break;
 		}
 
+		/* a message put together from fragments doesn't fit into
+		   one demo block, start the next one before the command
+		   that overflowed it */
+		if ((net_message.readcount - blockstart > MAX_MSGLEN) &&
+			(cmdstart > blockstart) && (numsplits < MAX_DEMOSPLITS))
+		{
+			splits[numsplits++] = cmdstart;
+			blockstart = cmdstart;
+		}
+
+		cmdstart = net_message.readcount;
 		cmd = MSG_ReadByte(&net_message);
 
 		if (cmd == -1)
@@ -1398,7 +1594,7 @@ CL_ParseServerMessage(void)
 	   until after we have parsed the frame */
 	if (cls.demorecording && !cls.demowaiting)
 	{
-		CL_WriteDemoMessage();
+		CL_WriteDemoMessage(splits, numsplits);
 	}
 }
 
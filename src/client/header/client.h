@@ -231,6 +231,7 @@ typedef struct
 	int			serverProtocol; /* in case we are doing some kind of version hack */
 
 	int			challenge; /* from the server to use for connecting */
+	int			connectProtocol; /* asked for in the connect */
 
 	qboolean	forcePacket; /* Forces a package to be send at the next frame. */
 
@@ -270,6 +271,8 @@ extern	cvar_t	*cl_run;
 extern	cvar_t	*cl_anglespeedkey;
 extern	cvar_t	*cl_shownet;
 extern	cvar_t	*cl_showmiss;
+extern	cvar_t	*cl_packedents;
+extern	cvar_t	*cl_fragments;
 extern	cvar_t	*cl_showclamp;
 extern	cvar_t	*lookspring;
 extern	cvar_t	*lookstrafe;
@@ -458,7 +461,7 @@ void IN_CenterView (void);
 float CL_KeyState (kbutton_t *key);
 char *Key_KeynumToString (int keynum);
 
-void CL_WriteDemoMessage (void);
+void CL_WriteDemoMessage (int *splits, int numsplits);
 void CL_Stop_f (void);
 void CL_Record_f (void);
 
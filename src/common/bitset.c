@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 1997-2001 Id Software, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ *
+ * =======================================================================
+ *
+ * Bit vector operations used for the PVS and PHS rows. The vector
+ * variants (SSE2 and AVX2 on x86, NEON on ARM) are selected at the
+ * first call, with a scalar fallback for everything else. Bit n of
+ * a vector is bit n & 7 of byte n >> 3.
+ *
+ * =======================================================================
+ */
+
+#include "header/common.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+ #define BITS_X86
+ #include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+ #define BITS_NEON
+ #include <arm_neon.h>
+#endif
+
+static void Bits_OrScalar(byte *dst, const byte *src, int bytes);
+static qboolean Bits_TestAnyScalar(const byte *bits, const int *list, int count);
+
+/* chosen by Bits_UseSIMD in Qcommon_Init, before
+   the server's worker threads are started */
+static void (*bits_or)(byte *dst, const byte *src, int bytes) = Bits_OrScalar;
+static qboolean (*bits_testany)(const byte *bits, const int *list, int count) =
+	Bits_TestAnyScalar;
+static const char *bits_name = "scalar";
+
+static void
+Bits_OrScalar(byte *dst, const byte *src, int bytes)
+{
+	int i;
+
+	for (i = 0; i < bytes; i++)
+	{
+		dst[i] |= src[i];
+	}
+}
+
+static qboolean
+Bits_TestAnyScalar(const byte *bits, const int *list, int count)
+{
+	int i, l;
+
+	for (i = 0; i < count; i++)
+	{
+		l = list[i];
+
+		if (bits[l >> 3] & (1 << (l & 7)))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+#ifdef BITS_X86
+
+__attribute__((target("sse2")))
+static void
+Bits_OrSSE2(byte *dst, const byte *src, int bytes)
+{
+	__m128i a, b;
+	int i;
+
+	for (i = 0; i + 16 <= bytes; i += 16)
+	{
+		a = _mm_loadu_si128((const __m128i *)(dst + i));
+		b = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(a, b));
+	}
+
+	Bits_OrScalar(dst + i, src + i, bytes - i);
+}
+
+__attribute__((target("avx2")))
+static void
+Bits_OrAVX2(byte *dst, const byte *src, int bytes)
+{
+	__m256i a, b;
+	int i;
+
+	for (i = 0; i + 32 <= bytes; i += 32)
+	{
+		a = _mm256_loadu_si256((const __m256i *)(dst + i));
+		b = _mm256_loadu_si256((const __m256i *)(src + i));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(a, b));
+	}
+
+	Bits_OrSSE2(dst + i, src + i, bytes - i);
+}
+
+/*
+ * Gathers the 32 bit words holding eight bits at once. x86 is
+ * little endian, so bit n & 31 of word n >> 5 is the same as
+ * bit n & 7 of byte n >> 3. The vector must be padded to a
+ * multiple of four bytes.
+ */
+__attribute__((target("avx2")))
+static qboolean
+Bits_TestAnyAVX2(const byte *bits, const int *list, int count)
+{
+	__m256i l, words, mask;
+	int i;
+
+	for (i = 0; i + 8 <= count; i += 8)
+	{
+		l = _mm256_loadu_si256((const __m256i *)(list + i));
+		words = _mm256_i32gather_epi32((const int *)bits,
+				_mm256_srli_epi32(l, 5), 4);
+		mask = _mm256_sllv_epi32(_mm256_set1_epi32(1),
+				_mm256_and_si256(l, _mm256_set1_epi32(31)));
+
+		if (!_mm256_testz_si256(words, mask))
+		{
+			return true;
+		}
+	}
+
+	return Bits_TestAnyScalar(bits, list + i, count - i);
+}
+
+#endif
+
+#ifdef BITS_NEON
+
+static void
+Bits_OrNEON(byte *dst, const byte *src, int bytes)
+{
+	int i;
+
+	for (i = 0; i + 16 <= bytes; i += 16)
+	{
+		vst1q_u8(dst + i, vorrq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+	}
+
+	Bits_OrScalar(dst + i, src + i, bytes - i);
+}
+
+#endif
+
+/*
+ * Selects the fastest implementations the CPU
+ * supports, or the scalar ones if simd is false.
+ */
+void
+Bits_UseSIMD(qboolean simd)
+{
+	bits_or = Bits_OrScalar;
+	bits_testany = Bits_TestAnyScalar;
+	bits_name = "scalar";
+
+	if (!simd)
+	{
+		return;
+	}
+
+#ifdef BITS_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+	{
+		bits_or = Bits_OrAVX2;
+		bits_testany = Bits_TestAnyAVX2;
+		bits_name = "AVX2";
+	}
+	else if (__builtin_cpu_supports("sse2"))
+	{
+		bits_or = Bits_OrSSE2;
+		bits_name = "SSE2";
+	}
+#elif defined(BITS_NEON)
+	bits_or = Bits_OrNEON;
+	bits_name = "NEON";
+#endif
+}
+
+const char *
+Bits_Implementation(void)
+{
+	return bits_name;
+}
+
+/*
+ * dst |= src
+ */
+void
+Bits_Or(byte *dst, const byte *src, int bytes)
+{
+	bits_or(dst, src, bytes);
+}
+
+/*
+ * Returns true if any of the count bits
+ * numbered in list is set in bits.
+ */
+qboolean
+Bits_TestAny(const byte *bits, const int *list, int count)
+{
+	return bits_testany(bits, list, count);
+}
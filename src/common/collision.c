@@ -27,16 +27,27 @@
 
 #include "header/common.h"
 
+#if defined(__x86_64__) || defined(_M_X64)
+ #define CM_SSE
+ #include <emmintrin.h>
+#endif
+
+/* the plane is copied into the node and the nodes are
+   stored depth first, so a trace walking down the front
+   sides touches one cache line per node */
 typedef struct
 {
-	cplane_t	*plane;
+	cplane_t	plane;
 	int			children[2]; /* negative numbers are leafs */
+	int			pad; /* 32 bytes */
 } cnode_t;
 
+/* indices instead of pointers, so that
+   a shared image works at any address */
 typedef struct
 {
-	cplane_t	*plane;
-	mapsurface_t	*surface;
+	int			planenum;
+	int			surfnum;
 } cbrushside_t;
 
 typedef struct
@@ -53,44 +64,137 @@ typedef struct
 	int			contents;
 	int			numsides;
 	int			firstbrushside;
-	int			checkcount;	/* to avoid repeated testings */
+	int			firstsideblock;
 } cbrush_t;
 
+/* the side planes of a brush in blocks of four for
+   the vector kernels, unused sides never clip */
+typedef struct
+{
+	float		normal[3][4];
+	float		dist[4];
+} csideblock_t;
+
+#define MAX_MAP_SIDEBLOCKS (MAX_MAP_BRUSHSIDES / 4 + MAX_MAP_BRUSHES + 2)
+
+/* header of the decompressed PVS and PHS rows written
+   to maps/<name>.vis, followed by the PVS rows of all
+   clusters and then the PHS rows */
+#define VISCACHE_IDENT (('S' << 24) + ('I' << 16) + ('V' << 8) + 'C')
+#define VISCACHE_VERSION 1
+#define VISMATRIX_MAXBYTES (64 * 1024 * 1024)
+
+typedef struct
+{
+	int			ident;
+	int			version;
+	unsigned	checksum; /* of the bsp */
+	int			numclusters;
+	int			rowbytes;
+} dviscache_t;
+
+/* the collision model as written to maps/<name>.cm for map_shared,
+   in native byte order. The box hull is included at the end of its
+   arrays, the areas are copied out since their floods change. */
+#define CMIMAGE_IDENT (('P' << 24) + ('A' << 16) + ('M' << 8) + 'C')
+#define CMIMAGE_VERSION 2
+
+enum
+{
+	CMI_PLANES,
+	CMI_NODES,
+	CMI_LEAFS,
+	CMI_LEAFBRUSHES,
+	CMI_BRUSHES,
+	CMI_BRUSHSIDES,
+	CMI_SIDEBLOCKS,
+	CMI_SURFACES,
+	CMI_CMODELS,
+	CMI_AREAS,
+	CMI_AREAPORTALS,
+	CMI_VISIBILITY,
+	CMI_ENTITYSTRING,
+	CMI_VISMATRIX,
+	CMI_NUM
+};
+
+typedef struct
+{
+	int			ident;
+	int			version;
+	unsigned	checksum; /* of the bsp */
+	int			numplanes, numnodes, numleafs, numleafbrushes;
+	int			numbrushes, numbrushsides, numsideblocks, numtexinfo;
+	int			numcmodels, numareas, numareaportals, numvisibility;
+	int			numentitychars, numclusters;
+	int			emptyleaf, solidleaf;
+	int			visrowbytes; /* 0 without the vis matrix */
+	lump_t		lumps[CMI_NUM];
+} dcmimage_t;
+
 typedef struct
 {
 	int		numareaportals;
 	int		firstareaportal;
-	int		floodnum; /* if two areas have equal floodnums, they are connected */
+	int		floodnum; /* root area of the flood, the root is its own */
 	int		floodvalid;
 } carea_t;
 
+typedef struct
+{
+	float		*mins, *maxs;
+	int			*list;
+	int			count, maxcount;
+	int			topnode;
+} cleaflist_t;
+
+/* a map is loaded into these, unless it
+   is mapped from a shared image */
+static byte cm_visibility[MAX_MAP_VISIBILITY];
+static cbrush_t cm_brushes[MAX_MAP_BRUSHES];
+static cbrushside_t cm_brushsides[MAX_MAP_BRUSHSIDES];
+static csideblock_t cm_sideblocks[MAX_MAP_SIDEBLOCKS];
+static char cm_entitystring[MAX_MAP_ENTSTRING];
+static cleaf_t cm_leafs[MAX_MAP_LEAFS];
+static cmodel_t cm_cmodels[MAX_MAP_MODELS];
+static cnode_t cm_nodes[MAX_MAP_NODES+6]; /* extra for box hull */
+static cplane_t cm_planes[MAX_MAP_PLANES+6]; /* extra for box hull */
+static dareaportal_t cm_areaportals[MAX_MAP_AREAPORTALS];
+static mapsurface_t cm_surfaces[MAX_MAP_TEXINFO + 1]; /* one empty for box hull */
+static unsigned short cm_leafbrushes[MAX_MAP_LEAFBRUSHES];
+
 byte *cmod_base;
-byte map_visibility[MAX_MAP_VISIBILITY];
+byte *map_image; /* the shared image, if mapped */
+int map_imagesize;
+byte *map_visibility = cm_visibility;
 byte pvsrow[MAX_MAP_LEAFS / 8];
 byte phsrow[MAX_MAP_LEAFS / 8];
 carea_t	map_areas[MAX_MAP_AREAS];
-cbrush_t map_brushes[MAX_MAP_BRUSHES];
-cbrushside_t map_brushsides[MAX_MAP_BRUSHSIDES];
+cbrush_t *map_brushes = cm_brushes;
+cbrushside_t *map_brushsides = cm_brushsides;
+csideblock_t *map_sideblocks = cm_sideblocks;
 char map_name[MAX_QPATH];
-char map_entitystring[MAX_MAP_ENTSTRING];
+char *map_entitystring = cm_entitystring;
 cbrush_t *box_brush;
 cleaf_t	*box_leaf;
-cleaf_t	map_leafs[MAX_MAP_LEAFS];
-cmodel_t map_cmodels[MAX_MAP_MODELS];
-cnode_t	map_nodes[MAX_MAP_NODES+6]; /* extra for box hull */
+cleaf_t	*map_leafs = cm_leafs;
+cmodel_t *map_cmodels = cm_cmodels;
+cnode_t	*map_nodes = cm_nodes;
 cplane_t *box_planes;
-cplane_t map_planes[MAX_MAP_PLANES+6]; /* extra for box hull */
+cplane_t *map_planes = cm_planes;
 cvar_t *map_noareas;
-dareaportal_t map_areaportals[MAX_MAP_AREAPORTALS];
-dvis_t *map_vis = (dvis_t *)map_visibility;
+cvar_t *map_shared;
+cvar_t *map_viscache;
+cvar_t *map_vismatrix;
+dareaportal_t *map_areaportals = cm_areaportals;
+dvis_t *map_vis = (dvis_t *)cm_visibility;
+byte *map_vismatrix_rows; /* PVS rows, PHS rows, one empty row */
+int vis_rowbytes;
 int box_headnode;
-int	checkcount;
+cmtrace_t cm_trace; /* context of CM_BoxTrace */
+cmtracebatch_t cm_tracebatch; /* context of CM_BoxTraceBatch */
 int	emptyleaf, solidleaf;
 int	floodvalid;
-float *leaf_mins, *leaf_maxs;
-int leaf_count, leaf_maxcount;
-int *leaf_list;
-int leaf_topnode;
 int	numareaportals;
 int numareas = 1;
 int	numbrushes;
@@ -102,18 +206,20 @@ int	numleafbrushes;
 int numleafs = 1; /* allow leaf funcs to be called without a map */
 int	numnodes;
 int	numplanes;
+int	numsideblocks;
 int	numtexinfo;
 int	numvisibility;
-int trace_contents;
-mapsurface_t map_surfaces[MAX_MAP_TEXINFO];
+mapsurface_t *map_surfaces = cm_surfaces;
 mapsurface_t nullsurface;
 qboolean portalopen[MAX_MAP_AREAPORTALS];
-qboolean trace_ispoint; /* optimized case */
-trace_t trace_trace;
-unsigned short	map_leafbrushes[MAX_MAP_LEAFBRUSHES];
-vec3_t trace_start, trace_end;
-vec3_t trace_mins, trace_maxs;
-vec3_t trace_extents;
+int portalareas[MAX_MAP_AREAPORTALS][2]; /* the areas a portal joins */
+
+/* CM_WriteAreaBits output of each area, valid
+   while the generation matches areabits_valid */
+byte map_areabits[MAX_MAP_AREAS][MAX_MAP_AREAS / 8];
+int areabits_generation[MAX_MAP_AREAS];
+int areabits_valid = 1;
+unsigned short	*map_leafbrushes = cm_leafbrushes;
 
 #ifndef DEDICATED_ONLY
 int		c_pointcontents;
@@ -123,6 +229,8 @@ int		c_traces, c_brush_traces;
 /* 1/32 epsilon to keep floating point happy */
 #define DIST_EPSILON (0.03125f)
 
+static qboolean cm_simd = true;
+
 void
 FloodArea_r(carea_t *area, int floodnum)
 {
@@ -152,16 +260,20 @@ FloodArea_r(carea_t *area, int floodnum)
 	}
 }
 
+/*
+ * Floods all areas from scratch. Every area of a flood gets
+ * the first area of it as floodnum, which makes that area
+ * the root of the flood.
+ */
 void
 FloodAreaConnections(void)
 {
 	int i;
 	carea_t *area;
-	int floodnum;
 
 	/* all current floods are now invalid */
 	floodvalid++;
-	floodnum = 0;
+	areabits_valid++;
 
 	/* area 0 is not used */
 	for (i = 1; i < numareas; i++)
@@ -173,21 +285,90 @@ FloodAreaConnections(void)
 			continue; /* already flooded into */
 		}
 
-		floodnum++;
-		FloodArea_r(area, floodnum);
+		FloodArea_r(area, i);
 	}
 }
 
+/*
+ * CM_SetAreaPortalState keeps every floodnum pointing
+ * at the root, so the lookup only reads and is safe
+ * from the server's worker threads
+ */
+static int
+CM_FloodRoot(int area)
+{
+	return map_areas[area].floodnum;
+}
+
+/*
+ * Updates the floods for one portal. An opened portal joins
+ * the floods of its two areas. A closed one can only split
+ * the flood it was in, so only that flood is flooded again,
+ * from both sides of the portal.
+ */
 void
 CM_SetAreaPortalState(int portalnum, qboolean open)
 {
+	int i;
+	int area1, area2;
+	int root1, root2;
+
 	if (portalnum > numareaportals)
 	{
 		Com_Error(ERR_DROP, "areaportal > numareaportals");
 	}
 
+	if (portalopen[portalnum] == open)
+	{
+		return;
+	}
+
 	portalopen[portalnum] = open;
-	FloodAreaConnections();
+
+	area1 = portalareas[portalnum][0];
+	area2 = portalareas[portalnum][1];
+
+	if (!area1 || !area2)
+	{
+		FloodAreaConnections(); /* not between two areas */
+		return;
+	}
+
+	root1 = CM_FloodRoot(area1);
+	root2 = CM_FloodRoot(area2);
+
+	if (open)
+	{
+		if (root1 != root2)
+		{
+			/* the second flood moves over to the first root */
+			for (i = 1; i < numareas; i++)
+			{
+				if (map_areas[i].floodnum == root2)
+				{
+					map_areas[i].floodnum = root1;
+				}
+			}
+
+			areabits_valid++;
+		}
+
+		return;
+	}
+
+	if (root1 != root2)
+	{
+		return;
+	}
+
+	floodvalid++;
+	FloodArea_r(&map_areas[area1], area1);
+
+	if (map_areas[area2].floodvalid != floodvalid)
+	{
+		FloodArea_r(&map_areas[area2], area2);
+		areabits_valid++;
+	}
 }
 
 qboolean
@@ -203,7 +384,7 @@ CM_AreasConnected(int area1, int area2)
 		Com_Error(ERR_DROP, "area > numareas");
 	}
 
-	if (map_areas[area1].floodnum == map_areas[area2].floodnum)
+	if (CM_FloodRoot(area1) == CM_FloodRoot(area2))
 	{
 		return true;
 	}
@@ -215,14 +396,18 @@ CM_AreasConnected(int area1, int area2)
  * Writes a length byte followed by a bit vector of all the areas
  * that area in the same flood as the area parameter
  *
- * This is used by the client refreshes to cull visibility
+ * This is used by the client refreshes to cull visibility. The
+ * vector of an area is kept until a portal changes the floods.
+ * Filling that cache writes, so this must only be called from
+ * the main thread.
  */
 int
 CM_WriteAreaBits(byte *buffer, int area)
 {
 	int i;
-	int floodnum;
+	int root;
 	int bytes;
+	byte *bits;
 
 	bytes = (numareas + 7) >> 3;
 
@@ -234,17 +419,26 @@ CM_WriteAreaBits(byte *buffer, int area)
 
 	else
 	{
-		memset(buffer, 0, bytes);
+		bits = map_areabits[area];
 
-		floodnum = map_areas[area].floodnum;
-
-		for (i = 0; i < numareas; i++)
+		if (areabits_generation[area] != areabits_valid)
 		{
-			if ((map_areas[i].floodnum == floodnum) || !area)
+			memset(bits, 0, bytes);
+
+			root = CM_FloodRoot(area);
+
+			for (i = 0; i < numareas; i++)
 			{
-				buffer[i >> 3] |= 1 << (i & 7);
+				if (!area || (CM_FloodRoot(i) == root))
+				{
+					bits[i >> 3] |= 1 << (i & 7);
+				}
 			}
+
+			areabits_generation[area] = areabits_valid;
 		}
+
+		memcpy(buffer, bits, bytes);
 	}
 
 	return bytes;
@@ -309,6 +503,60 @@ CM_HeadnodeVisible(int nodenum, byte *visbits)
 	return CM_HeadnodeVisible(node->children[1], visbits);
 }
 
+static int
+CM_HeadnodeClusters_r(int nodenum, int *list, int count, int listsize)
+{
+	int cluster;
+	int i;
+
+	while (nodenum >= 0)
+	{
+		count = CM_HeadnodeClusters_r(map_nodes[nodenum].children[0],
+				list, count, listsize);
+
+		if (count < 0)
+		{
+			return count;
+		}
+
+		nodenum = map_nodes[nodenum].children[1];
+	}
+
+	cluster = map_leafs[-1 - nodenum].cluster;
+
+	if (cluster == -1)
+	{
+		return count;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		if (list[i] == cluster)
+		{
+			return count;
+		}
+	}
+
+	if (count == listsize)
+	{
+		return -1;
+	}
+
+	list[count] = cluster;
+
+	return count + 1;
+}
+
+/*
+ * Lists the clusters of all leafs below a node, each
+ * one once. Returns -1 if there are more than listsize.
+ */
+int
+CM_HeadnodeClusters(int headnode, int *list, int listsize)
+{
+	return CM_HeadnodeClusters_r(headnode, list, 0, listsize);
+}
+
 /*
  * Set up the planes and nodes so that the six floats of a bounding box
  * can just be stored out and get a proper clipping hull structure.
@@ -352,12 +600,11 @@ CM_InitBoxHull(void)
 
 		/* brush sides */
 		s = &map_brushsides[numbrushsides + i];
-		s->plane = map_planes + (numplanes + i * 2 + side);
-		s->surface = &nullsurface;
+		s->planenum = numplanes + i * 2 + side;
+		s->surfnum = numtexinfo; /* the empty one after the map's */
 
 		/* nodes */
 		c = &map_nodes[box_headnode + i];
-		c->plane = map_planes + (numplanes + i * 2);
 		c->children[side] = -1 - emptyleaf;
 
 		if (i != 5)
@@ -382,6 +629,8 @@ CM_InitBoxHull(void)
 		p->signbits = 0;
 		VectorClear(p->normal);
 		p->normal[i >> 1] = -1;
+
+		c->plane = box_planes[i * 2];
 	}
 }
 
@@ -392,6 +641,8 @@ CM_InitBoxHull(void)
 int
 CM_HeadnodeForBox(vec3_t mins, vec3_t maxs)
 {
+	int i;
+
 	box_planes[0].dist = maxs[0];
 	box_planes[1].dist = -maxs[0];
 	box_planes[2].dist = mins[0];
@@ -405,6 +656,19 @@ CM_HeadnodeForBox(vec3_t mins, vec3_t maxs)
 	box_planes[10].dist = mins[2];
 	box_planes[11].dist = -mins[2];
 
+	map_nodes[box_headnode].plane.dist = maxs[0];
+	map_nodes[box_headnode + 1].plane.dist = mins[0];
+	map_nodes[box_headnode + 2].plane.dist = maxs[1];
+	map_nodes[box_headnode + 3].plane.dist = mins[1];
+	map_nodes[box_headnode + 4].plane.dist = maxs[2];
+	map_nodes[box_headnode + 5].plane.dist = mins[2];
+
+	for (i = 0; i < 6; i++)
+	{
+		map_sideblocks[box_brush->firstsideblock + (i >> 2)].dist[i & 3] =
+			map_planes[map_brushsides[box_brush->firstbrushside + i].planenum].dist;
+	}
+
 	return box_headnode;
 }
 
@@ -418,7 +682,7 @@ CM_PointLeafnum_r(vec3_t p, int num)
 	while (num >= 0)
 	{
 		node = map_nodes + num;
-		plane = node->plane;
+		plane = &node->plane;
 
 		if (plane->type < 3)
 		{
@@ -463,8 +727,8 @@ CM_PointLeafnum(vec3_t p)
  * Fills in a list of all the leafs touched
  */
 
-void
-CM_BoxLeafnums_r(int nodenum)
+static void
+CM_BoxLeafnums_r(cleaflist_t *ll, int nodenum)
 {
 	cplane_t *plane;
 	cnode_t *node;
@@ -474,18 +738,18 @@ CM_BoxLeafnums_r(int nodenum)
 	{
 		if (nodenum < 0)
 		{
-			if (leaf_count >= leaf_maxcount)
+			if (ll->count >= ll->maxcount)
 			{
 				return;
 			}
 
-			leaf_list[leaf_count++] = -1 - nodenum;
+			ll->list[ll->count++] = -1 - nodenum;
 			return;
 		}
 
 		node = &map_nodes[nodenum];
-		plane = node->plane;
-		s = BOX_ON_PLANE_SIDE(leaf_mins, leaf_maxs, plane);
+		plane = &node->plane;
+		s = BOX_ON_PLANE_SIDE(ll->mins, ll->maxs, plane);
 
 		if (s == 1)
 		{
@@ -500,37 +764,39 @@ CM_BoxLeafnums_r(int nodenum)
 		else
 		{
 			/* go down both */
-			if (leaf_topnode == -1)
+			if (ll->topnode == -1)
 			{
-				leaf_topnode = nodenum;
+				ll->topnode = nodenum;
 			}
 
-			CM_BoxLeafnums_r(node->children[0]);
+			CM_BoxLeafnums_r(ll, node->children[0]);
 			nodenum = node->children[1];
 		}
 	}
 }
 
-int
+static int
 CM_BoxLeafnums_headnode(vec3_t mins, vec3_t maxs, int *list,
 		int listsize, int headnode, int *topnode)
 {
-	leaf_list = list;
-	leaf_count = 0;
-	leaf_maxcount = listsize;
-	leaf_mins = mins;
-	leaf_maxs = maxs;
+	cleaflist_t ll;
 
-	leaf_topnode = -1;
+	ll.list = list;
+	ll.count = 0;
+	ll.maxcount = listsize;
+	ll.mins = mins;
+	ll.maxs = maxs;
 
-	CM_BoxLeafnums_r(headnode);
+	ll.topnode = -1;
+
+	CM_BoxLeafnums_r(&ll, headnode);
 
 	if (topnode)
 	{
-		*topnode = leaf_topnode;
+		*topnode = ll.topnode;
 	}
 
-	return leaf_count;
+	return ll.count;
 }
 
 int
@@ -588,9 +854,239 @@ CM_TransformedPointContents(vec3_t p, int headnode,
 	return map_leafs[l].contents;
 }
 
+#ifdef CM_SSE
+
+/*
+ * Distances of p1 and p2 to four sides pushed out for the box, in
+ * the same order of operations as the scalar code so the results
+ * are exactly the same.
+ */
+static void
+CM_SideDistsSSE(const csideblock_t *block, const float *mins,
+		const float *maxs, const float *p1, const float *p2,
+		qboolean ispoint, __m128 *d1, __m128 *d2)
+{
+	__m128 nx, ny, nz, dist;
+	__m128 ox, oy, oz;
+	__m128 zero;
+
+	nx = _mm_loadu_ps(block->normal[0]);
+	ny = _mm_loadu_ps(block->normal[1]);
+	nz = _mm_loadu_ps(block->normal[2]);
+	dist = _mm_loadu_ps(block->dist);
+
+	if (!ispoint)
+	{
+		/* push the planes out apropriately for mins/maxs */
+		zero = _mm_setzero_ps();
+
+		ox = _mm_cmplt_ps(nx, zero);
+		ox = _mm_or_ps(_mm_and_ps(ox, _mm_set1_ps(maxs[0])),
+				_mm_andnot_ps(ox, _mm_set1_ps(mins[0])));
+		oy = _mm_cmplt_ps(ny, zero);
+		oy = _mm_or_ps(_mm_and_ps(oy, _mm_set1_ps(maxs[1])),
+				_mm_andnot_ps(oy, _mm_set1_ps(mins[1])));
+		oz = _mm_cmplt_ps(nz, zero);
+		oz = _mm_or_ps(_mm_and_ps(oz, _mm_set1_ps(maxs[2])),
+				_mm_andnot_ps(oz, _mm_set1_ps(mins[2])));
+
+		dist = _mm_sub_ps(dist, _mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, nx),
+						_mm_mul_ps(oy, ny)), _mm_mul_ps(oz, nz)));
+	}
+
+	*d1 = _mm_sub_ps(_mm_add_ps(_mm_add_ps(
+					_mm_mul_ps(_mm_set1_ps(p1[0]), nx),
+					_mm_mul_ps(_mm_set1_ps(p1[1]), ny)),
+				_mm_mul_ps(_mm_set1_ps(p1[2]), nz)), dist);
+
+	if (d2)
+	{
+		*d2 = _mm_sub_ps(_mm_add_ps(_mm_add_ps(
+						_mm_mul_ps(_mm_set1_ps(p2[0]), nx),
+						_mm_mul_ps(_mm_set1_ps(p2[1]), ny)),
+					_mm_mul_ps(_mm_set1_ps(p2[2]), nz)), dist);
+	}
+}
+
+/*
+ * CM_ClipBoxToBrush for four sides at a time. Only the
+ * sides the move crosses are looked at one by one.
+ */
+static void
+CM_ClipBoxToBrushSSE(vec3_t mins, vec3_t maxs, vec3_t p1,
+		vec3_t p2, trace_t *trace, cbrush_t *brush, qboolean ispoint)
+{
+	const csideblock_t *block;
+	__m128 d1, d2, zero;
+	__m128 getout, startout;
+	float d1s[4], d2s[4];
+	float enterfrac, leavefrac;
+	float f;
+	int b, i, numblocks, crossing;
+	cplane_t *clipplane;
+	cbrushside_t *side, *leadside;
+
+	enterfrac = -1;
+	leavefrac = 1;
+	clipplane = NULL;
+	leadside = NULL;
+
+	zero = _mm_setzero_ps();
+	getout = startout = zero;
+
+	numblocks = (brush->numsides + 3) >> 2;
+	block = &map_sideblocks[brush->firstsideblock];
+
+	for (b = 0; b < numblocks; b++, block++)
+	{
+		CM_SideDistsSSE(block, mins, maxs, p1, p2, ispoint, &d1, &d2);
+
+		getout = _mm_or_ps(getout, _mm_cmpgt_ps(d2, zero));
+		startout = _mm_or_ps(startout, _mm_cmpgt_ps(d1, zero));
+
+		/* if completely in front of a face, no intersection */
+		if (_mm_movemask_ps(_mm_and_ps(_mm_cmpgt_ps(d1, zero),
+						_mm_cmpge_ps(d2, d1))))
+		{
+			return;
+		}
+
+		crossing = _mm_movemask_ps(_mm_or_ps(_mm_cmpnle_ps(d1, zero),
+					_mm_cmpnle_ps(d2, zero)));
+
+		if (!crossing)
+		{
+			continue;
+		}
+
+		_mm_storeu_ps(d1s, d1);
+		_mm_storeu_ps(d2s, d2);
+
+		for (i = 0; i < 4; i++)
+		{
+			if (!(crossing & (1 << i)))
+			{
+				continue;
+			}
+
+			if (d1s[i] > d2s[i])
+			{
+				/* enter */
+				f = (d1s[i] - DIST_EPSILON) / (d1s[i] - d2s[i]);
+
+				if (f > enterfrac)
+				{
+					side = &map_brushsides[brush->firstbrushside + b * 4 + i];
+					enterfrac = f;
+					clipplane = &map_planes[side->planenum];
+					leadside = side;
+				}
+			}
+
+			else
+			{
+				/* leave */
+				f = (d1s[i] + DIST_EPSILON) / (d1s[i] - d2s[i]);
+
+				if (f < leavefrac)
+				{
+					leavefrac = f;
+				}
+			}
+		}
+	}
+
+	if (!_mm_movemask_ps(startout))
+	{
+		/* original point was inside brush */
+		trace->startsolid = true;
+
+		if (!_mm_movemask_ps(getout))
+		{
+			trace->allsolid = true;
+		}
+
+		return;
+	}
+
+	if (enterfrac < leavefrac)
+	{
+		if ((enterfrac > -1) && (enterfrac < trace->fraction))
+		{
+			if (enterfrac < 0)
+			{
+				enterfrac = 0;
+			}
+
+			if (clipplane == NULL)
+			{
+				Com_Error(ERR_FATAL, "clipplane was NULL!\n");
+			}
+
+			trace->fraction = enterfrac;
+			trace->plane = *clipplane;
+			trace->surface = &(map_surfaces[leadside->surfnum].c);
+			trace->contents = brush->contents;
+		}
+	}
+}
+
+static void
+CM_TestBoxInBrushSSE(vec3_t mins, vec3_t maxs, vec3_t p1,
+		trace_t *trace, cbrush_t *brush)
+{
+	const csideblock_t *block;
+	__m128 d1;
+	int b, numblocks;
+
+	numblocks = (brush->numsides + 3) >> 2;
+	block = &map_sideblocks[brush->firstsideblock];
+
+	for (b = 0; b < numblocks; b++, block++)
+	{
+		CM_SideDistsSSE(block, mins, maxs, p1, NULL, false, &d1, NULL);
+
+		/* if completely in front of face, no intersection */
+		if (_mm_movemask_ps(_mm_cmpgt_ps(d1, _mm_setzero_ps())))
+		{
+			return;
+		}
+	}
+
+	/* inside this brush */
+	trace->startsolid = trace->allsolid = true;
+	trace->fraction = 0;
+	trace->contents = brush->contents;
+}
+
+#endif
+
+/*
+ * Switches between the vector and the scalar brush
+ * kernels, the results are the same.
+ */
 void
+CM_UseSIMD(qboolean simd)
+{
+	cm_simd = simd;
+}
+
+const char *
+CM_SIMDImplementation(void)
+{
+#ifdef CM_SSE
+	if (cm_simd)
+	{
+		return "SSE";
+	}
+#endif
+
+	return "scalar";
+}
+
+static void
 CM_ClipBoxToBrush(vec3_t mins, vec3_t maxs, vec3_t p1,
-		vec3_t p2, trace_t *trace, cbrush_t *brush)
+		vec3_t p2, trace_t *trace, cbrush_t *brush, qboolean ispoint)
 {
 	int i, j;
 	cplane_t *plane, *clipplane;
@@ -615,6 +1111,14 @@ CM_ClipBoxToBrush(vec3_t mins, vec3_t maxs, vec3_t p1,
 	c_brush_traces++;
 #endif
 
+#ifdef CM_SSE
+	if (cm_simd)
+	{
+		CM_ClipBoxToBrushSSE(mins, maxs, p1, p2, trace, brush, ispoint);
+		return;
+	}
+#endif
+
 	getout = false;
 	startout = false;
 	leadside = NULL;
@@ -622,9 +1126,9 @@ CM_ClipBoxToBrush(vec3_t mins, vec3_t maxs, vec3_t p1,
 	for (i = 0; i < brush->numsides; i++)
 	{
 		side = &map_brushsides[brush->firstbrushside + i];
-		plane = side->plane;
+		plane = &map_planes[side->planenum];
 
-		if (!trace_ispoint)
+		if (!ispoint)
 		{
 			/* general box case
 			   push the plane out
@@ -731,14 +1235,14 @@ CM_ClipBoxToBrush(vec3_t mins, vec3_t maxs, vec3_t p1,
 
 			trace->fraction = enterfrac;
 			trace->plane = *clipplane;
-			trace->surface = &(leadside->surface->c);
+			trace->surface = &(map_surfaces[leadside->surfnum].c);
 			trace->contents = brush->contents;
 		}
 	}
 }
 
-void
-CM_TestBoxInBrush(vec3_t mins, vec3_t maxs, vec3_t p1, 
+static void
+CM_TestBoxInBrush(vec3_t mins, vec3_t maxs, vec3_t p1,
 		trace_t *trace, cbrush_t *brush)
 {
 	int i, j;
@@ -753,10 +1257,18 @@ CM_TestBoxInBrush(vec3_t mins, vec3_t maxs, vec3_t p1,
 		return;
 	}
 
+#ifdef CM_SSE
+	if (cm_simd)
+	{
+		CM_TestBoxInBrushSSE(mins, maxs, p1, trace, brush);
+		return;
+	}
+#endif
+
 	for (i = 0; i < brush->numsides; i++)
 	{
 		side = &map_brushsides[brush->firstbrushside + i];
-		plane = side->plane;
+		plane = &map_planes[side->planenum];
 
 		/* general box case
 		   push the plane out
@@ -792,17 +1304,170 @@ CM_TestBoxInBrush(vec3_t mins, vec3_t maxs, vec3_t p1,
 	trace->contents = brush->contents;
 }
 
-void
-CM_TraceToLeaf(int leafnum)
+/*
+ * The capsule reaches radius + halfheight * |normal[2]|
+ * in front of its center, so every brush side needs a
+ * single offset instead of the corner of the box.
+ */
+static void
+CM_ClipCapsuleToBrush(cmtrace_t *ctx, cbrush_t *brush)
 {
-	int k;
-	int brushnum;
-	cleaf_t *leaf;
+	int i;
+	cplane_t *plane, *clipplane;
+	float dist;
+	float enterfrac, leavefrac;
+	float d1, d2;
+	qboolean getout, startout;
+	float f;
+	cbrushside_t *side, *leadside;
+	trace_t *trace;
+
+	if (!brush->numsides)
+	{
+		return;
+	}
+
+#ifndef DEDICATED_ONLY
+	c_brush_traces++;
+#endif
+
+	trace = &ctx->trace;
+	enterfrac = -1;
+	leavefrac = 1;
+	clipplane = NULL;
+	getout = false;
+	startout = false;
+	leadside = NULL;
+
+	for (i = 0; i < brush->numsides; i++)
+	{
+		side = &map_brushsides[brush->firstbrushside + i];
+		plane = &map_planes[side->planenum];
+
+		dist = plane->dist + ctx->radius +
+			ctx->halfheight * (float)fabs(plane->normal[2]);
+
+		d1 = DotProduct(ctx->start, plane->normal) - dist;
+		d2 = DotProduct(ctx->end, plane->normal) - dist;
+
+		if (d2 > 0)
+		{
+			getout = true; /* endpoint is not in solid */
+		}
+
+		if (d1 > 0)
+		{
+			startout = true;
+		}
+
+		/* if completely in front of face, no intersection */
+		if ((d1 > 0) && (d2 >= d1))
+		{
+			return;
+		}
+
+		if ((d1 <= 0) && (d2 <= 0))
+		{
+			continue;
+		}
+
+		/* crosses face */
+		if (d1 > d2)
+		{
+			f = (d1 - DIST_EPSILON) / (d1 - d2);
+
+			if (f > enterfrac)
+			{
+				enterfrac = f;
+				clipplane = plane;
+				leadside = side;
+			}
+		}
+
+		else
+		{
+			f = (d1 + DIST_EPSILON) / (d1 - d2);
+
+			if (f < leavefrac)
+			{
+				leavefrac = f;
+			}
+		}
+	}
+
+	if (!startout)
+	{
+		/* original point was inside brush */
+		trace->startsolid = true;
+
+		if (!getout)
+		{
+			trace->allsolid = true;
+		}
+
+		return;
+	}
+
+	if ((enterfrac < leavefrac) && (enterfrac > -1) &&
+		(enterfrac < trace->fraction))
+	{
+		if (enterfrac < 0)
+		{
+			enterfrac = 0;
+		}
+
+		trace->fraction = enterfrac;
+		trace->plane = *clipplane;
+		trace->surface = &(map_surfaces[leadside->surfnum].c);
+		trace->contents = brush->contents;
+	}
+}
+
+static void
+CM_TestCapsuleInBrush(cmtrace_t *ctx, cbrush_t *brush)
+{
+	int i;
+	cplane_t *plane;
+	float dist;
+	cbrushside_t *side;
+
+	if (!brush->numsides)
+	{
+		return;
+	}
+
+	for (i = 0; i < brush->numsides; i++)
+	{
+		side = &map_brushsides[brush->firstbrushside + i];
+		plane = &map_planes[side->planenum];
+
+		dist = plane->dist + ctx->radius +
+			ctx->halfheight * (float)fabs(plane->normal[2]);
+
+		/* if completely in front of face, no intersection */
+		if (DotProduct(ctx->start, plane->normal) - dist > 0)
+		{
+			return;
+		}
+	}
+
+	/* inside this brush */
+	ctx->trace.startsolid = ctx->trace.allsolid = true;
+	ctx->trace.fraction = 0;
+	ctx->trace.contents = brush->contents;
+}
+
+static void
+CM_TraceToLeaf(cmtrace_t *ctx, int leafnum)
+{
+	int k;
+	int brushnum;
+	cleaf_t *leaf;
 	cbrush_t *b;
 
 	leaf = &map_leafs[leafnum];
 
-	if (!(leaf->contents & trace_contents))
+	if (!(leaf->contents & ctx->contents))
 	{
 		return;
 	}
@@ -813,30 +1478,38 @@ CM_TraceToLeaf(int leafnum)
 		brushnum = map_leafbrushes[leaf->firstleafbrush + k];
 		b = &map_brushes[brushnum];
 
-		if (b->checkcount == checkcount)
+		if (ctx->brushchecks[brushnum] == ctx->checkcount)
 		{
 			continue; /* already checked this brush in another leaf */
 		}
 
-		b->checkcount = checkcount;
+		ctx->brushchecks[brushnum] = ctx->checkcount;
 
-		if (!(b->contents & trace_contents))
+		if (!(b->contents & ctx->contents))
 		{
 			continue;
 		}
 
-		CM_ClipBoxToBrush(trace_mins, trace_maxs, trace_start,
-				trace_end, &trace_trace, b);
+		if (ctx->capsule)
+		{
+			CM_ClipCapsuleToBrush(ctx, b);
+		}
+
+		else
+		{
+			CM_ClipBoxToBrush(ctx->mins, ctx->maxs, ctx->start,
+					ctx->end, &ctx->trace, b, ctx->ispoint);
+		}
 
-		if (!trace_trace.fraction)
+		if (!ctx->trace.fraction)
 		{
 			return;
 		}
 	}
 }
 
-void
-CM_TestInLeaf(int leafnum)
+static void
+CM_TestInLeaf(cmtrace_t *ctx, int leafnum)
 {
 	int k;
 	int brushnum;
@@ -845,7 +1518,7 @@ CM_TestInLeaf(int leafnum)
 
 	leaf = &map_leafs[leafnum];
 
-	if (!(leaf->contents & trace_contents))
+	if (!(leaf->contents & ctx->contents))
 	{
 		return;
 	}
@@ -856,29 +1529,38 @@ CM_TestInLeaf(int leafnum)
 		brushnum = map_leafbrushes[leaf->firstleafbrush + k];
 		b = &map_brushes[brushnum];
 
-		if (b->checkcount == checkcount)
+		if (ctx->brushchecks[brushnum] == ctx->checkcount)
 		{
 			continue; /* already checked this brush in another leaf */
 		}
 
-		b->checkcount = checkcount;
+		ctx->brushchecks[brushnum] = ctx->checkcount;
 
-		if (!(b->contents & trace_contents))
+		if (!(b->contents & ctx->contents))
 		{
 			continue;
 		}
 
-		CM_TestBoxInBrush(trace_mins, trace_maxs, trace_start, &trace_trace, b);
+		if (ctx->capsule)
+		{
+			CM_TestCapsuleInBrush(ctx, b);
+		}
+
+		else
+		{
+			CM_TestBoxInBrush(ctx->mins, ctx->maxs, ctx->start, &ctx->trace, b);
+		}
 
-		if (!trace_trace.fraction)
+		if (!ctx->trace.fraction)
 		{
 			return;
 		}
 	}
 }
 
-void
-CM_RecursiveHullCheck(int num, float p1f, float p2f, vec3_t p1, vec3_t p2)
+static void
+CM_RecursiveHullCheck(cmtrace_t *ctx, int num, float p1f, float p2f,
+		vec3_t p1, vec3_t p2)
 {
 	cnode_t *node;
 	cplane_t *plane;
@@ -890,7 +1572,7 @@ CM_RecursiveHullCheck(int num, float p1f, float p2f, vec3_t p1, vec3_t p2)
 	int side;
 	float midf;
 
-	if (trace_trace.fraction <= p1f)
+	if (ctx->trace.fraction <= p1f)
 	{
 		return; /* already hit something nearer */
 	}
@@ -898,20 +1580,20 @@ CM_RecursiveHullCheck(int num, float p1f, float p2f, vec3_t p1, vec3_t p2)
 	/* if < 0, we are in a leaf node */
 	if (num < 0)
 	{
-		CM_TraceToLeaf(-1 - num);
+		CM_TraceToLeaf(ctx, -1 - num);
 		return;
 	}
 
 	/* find the point distances to the seperating plane
 	   and the offset for the size of the box */
 	node = map_nodes + num;
-	plane = node->plane;
+	plane = &node->plane;
 
 	if (plane->type < 3)
 	{
 		t1 = p1[plane->type] - plane->dist;
 		t2 = p2[plane->type] - plane->dist;
-		offset = trace_extents[plane->type];
+		offset = ctx->extents[plane->type];
 	}
 
 	else
@@ -919,29 +1601,35 @@ CM_RecursiveHullCheck(int num, float p1f, float p2f, vec3_t p1, vec3_t p2)
 		t1 = DotProduct(plane->normal, p1) - plane->dist;
 		t2 = DotProduct(plane->normal, p2) - plane->dist;
 
-		if (trace_ispoint)
+		if (ctx->ispoint)
 		{
 			offset = 0;
 		}
 
+		else if (ctx->capsule)
+		{
+			offset = ctx->radius +
+				ctx->halfheight * (float)fabs(plane->normal[2]);
+		}
+
 		else
 		{
-			offset = (float)fabs(trace_extents[0] * plane->normal[0]) +
-					 (float)fabs(trace_extents[1] * plane->normal[1]) +
-					 (float)fabs(trace_extents[2] * plane->normal[2]);
+			offset = (float)fabs(ctx->extents[0] * plane->normal[0]) +
+					 (float)fabs(ctx->extents[1] * plane->normal[1]) +
+					 (float)fabs(ctx->extents[2] * plane->normal[2]);
 		}
 	}
 
 	/* see which sides we need to consider */
 	if ((t1 >= offset) && (t2 >= offset))
 	{
-		CM_RecursiveHullCheck(node->children[0], p1f, p2f, p1, p2);
+		CM_RecursiveHullCheck(ctx, node->children[0], p1f, p2f, p1, p2);
 		return;
 	}
 
 	if ((t1 < -offset) && (t2 < -offset))
 	{
-		CM_RecursiveHullCheck(node->children[1], p1f, p2f, p1, p2);
+		CM_RecursiveHullCheck(ctx, node->children[1], p1f, p2f, p1, p2);
 		return;
 	}
 
@@ -987,7 +1675,7 @@ CM_RecursiveHullCheck(int num, float p1f, float p2f, vec3_t p1, vec3_t p2)
 		mid[i] = p1[i] + frac * (p2[i] - p1[i]);
 	}
 
-	CM_RecursiveHullCheck(node->children[side], p1f, midf, p1, mid);
+	CM_RecursiveHullCheck(ctx, node->children[side], p1f, midf, p1, mid);
 
 	/* go past the node */
 	if (frac2 < 0)
@@ -1007,36 +1695,115 @@ CM_RecursiveHullCheck(int num, float p1f, float p2f, vec3_t p1, vec3_t p2)
 		mid[i] = p1[i] + frac2 * (p2[i] - p1[i]);
 	}
 
-	CM_RecursiveHullCheck(node->children[side ^ 1], midf, p2f, mid, p2);
+	CM_RecursiveHullCheck(ctx, node->children[side ^ 1], midf, p2f, mid, p2);
 }
 
-trace_t
-CM_BoxTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs,
-		int headnode, int brushmask)
+/*
+ * Fits the upright capsule into mins and maxs. The trace walks
+ * the center of the capsule, p1 and p2 are start and end moved
+ * there. Returns false for a point, that's traced as a box.
+ */
+static qboolean
+CM_SetupCapsule(cmtrace_t *ctx, vec3_t start, vec3_t end,
+		vec3_t mins, vec3_t maxs, vec3_t p1, vec3_t p2)
+{
+	vec3_t center;
+	float height;
+
+	if (VectorCompare(mins, vec3_origin) && VectorCompare(maxs, vec3_origin))
+	{
+		return false;
+	}
+
+	VectorAdd(mins, maxs, center);
+	VectorScale(center, 0.5f, center);
+
+	ctx->radius = maxs[0] - mins[0] < maxs[1] - mins[1] ?
+		maxs[0] - mins[0] : maxs[1] - mins[1];
+	ctx->radius *= 0.5f;
+
+	height = (maxs[2] - mins[2]) * 0.5f;
+	ctx->halfheight = height > ctx->radius ? height - ctx->radius : 0;
+
+	VectorAdd(start, center, p1);
+	VectorAdd(end, center, p2);
+
+	/* the bounds of the capsule around its center */
+	VectorSet(ctx->extents, ctx->radius, ctx->radius,
+			ctx->radius + ctx->halfheight);
+	VectorNegate(ctx->extents, ctx->mins);
+	VectorCopy(ctx->extents, ctx->maxs);
+
+	return true;
+}
+
+/*
+ * A brush is skipped when its entry in brushchecks matches the
+ * checkcount of the trace, so a context has to start zeroed.
+ */
+void
+CM_InitTraceContext(cmtrace_t *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+void
+CM_InitTraceBatchContext(cmtracebatch_t *ctx)
+{
+	ctx->checkcount = 0;
+	memset(ctx->brushchecks, 0, sizeof(ctx->brushchecks));
+	memset(ctx->brushrays, 0, sizeof(ctx->brushrays));
+}
+
+/*
+ * Sweeps a box or a capsule through the world using the given
+ * context. Any number of threads may trace at the same time, as
+ * long as each one uses its own context and the map isn't changed.
+ */
+static trace_t
+CM_SweepContext(cmtrace_t *ctx, vec3_t start, vec3_t end,
+		vec3_t mins, vec3_t maxs, int headnode, int brushmask,
+		qboolean capsule)
 {
+	vec3_t p1, p2;
 	int i;
 
-	checkcount++; /* for multi-check avoidance */
+	/* start over instead of overflowing */
+	if (ctx->checkcount == 0x7fffffff)
+	{
+		CM_InitTraceContext(ctx);
+	}
+
+	ctx->checkcount++; /* for multi-check avoidance */
 
 #ifndef DEDICATED_ONLY
 	c_traces++; /* for statistics, may be zeroed */
 #endif
 
 	/* fill in a default trace */
-	memset(&trace_trace, 0, sizeof(trace_trace));
-	trace_trace.fraction = 1;
-	trace_trace.surface = &(nullsurface.c);
+	memset(&ctx->trace, 0, sizeof(ctx->trace));
+	ctx->trace.fraction = 1;
+	ctx->trace.surface = &(nullsurface.c);
 
 	if (!numnodes)  /* map not loaded */
 	{
-		return trace_trace;
+		return ctx->trace;
+	}
+
+	ctx->contents = brushmask;
+	ctx->capsule = capsule && CM_SetupCapsule(ctx, start, end,
+			mins, maxs, p1, p2);
+
+	if (!ctx->capsule)
+	{
+		VectorCopy(start, p1);
+		VectorCopy(end, p2);
+		VectorCopy(mins, ctx->mins);
+		VectorCopy(maxs, ctx->maxs);
 	}
 
-	trace_contents = brushmask;
-	VectorCopy(start, trace_start);
-	VectorCopy(end, trace_end);
-	VectorCopy(mins, trace_mins);
-	VectorCopy(maxs, trace_maxs);
+	VectorCopy(p1, ctx->start);
+	VectorCopy(p2, ctx->end);
 
 	/* check for position test special case */
 	if ((start[0] == end[0]) && (start[1] == end[1]) && (start[2] == end[2]))
@@ -1046,8 +1813,8 @@ CM_BoxTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs,
 		vec3_t c1, c2;
 		int topnode;
 
-		VectorAdd(start, mins, c1);
-		VectorAdd(start, maxs, c2);
+		VectorAdd(p1, ctx->mins, c1);
+		VectorAdd(p1, ctx->maxs, c2);
 
 		for (i = 0; i < 3; i++)
 		{
@@ -1060,61 +1827,104 @@ CM_BoxTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs,
 
 		for (i = 0; i < numleafs; i++)
 		{
-			CM_TestInLeaf(leafs[i]);
+			CM_TestInLeaf(ctx, leafs[i]);
 
-			if (trace_trace.allsolid)
+			if (ctx->trace.allsolid)
 			{
 				break;
 			}
 		}
 
-		VectorCopy(start, trace_trace.endpos);
-		return trace_trace;
+		VectorCopy(start, ctx->trace.endpos);
+		return ctx->trace;
 	}
 
 	/* check for point special case */
-	if ((mins[0] == 0) && (mins[1] == 0) && (mins[2] == 0) &&
+	if (ctx->capsule)
+	{
+		ctx->ispoint = false;
+	}
+
+	else if ((mins[0] == 0) && (mins[1] == 0) && (mins[2] == 0) &&
 		(maxs[0] == 0) && (maxs[1] == 0) && (maxs[2] == 0))
 	{
-		trace_ispoint = true;
-		VectorClear(trace_extents);
+		ctx->ispoint = true;
+		VectorClear(ctx->extents);
 	}
 
 	else
 	{
-		trace_ispoint = false;
-		trace_extents[0] = -mins[0] > maxs[0] ? -mins[0] : maxs[0];
-		trace_extents[1] = -mins[1] > maxs[1] ? -mins[1] : maxs[1];
-		trace_extents[2] = -mins[2] > maxs[2] ? -mins[2] : maxs[2];
+		ctx->ispoint = false;
+		ctx->extents[0] = -mins[0] > maxs[0] ? -mins[0] : maxs[0];
+		ctx->extents[1] = -mins[1] > maxs[1] ? -mins[1] : maxs[1];
+		ctx->extents[2] = -mins[2] > maxs[2] ? -mins[2] : maxs[2];
 	}
 
 	/* general sweeping through world */
-	CM_RecursiveHullCheck(headnode, 0, 1, start, end);
+	CM_RecursiveHullCheck(ctx, headnode, 0, 1, p1, p2);
 
-	if (trace_trace.fraction == 1)
+	if (ctx->trace.fraction == 1)
 	{
-		VectorCopy(end, trace_trace.endpos);
+		VectorCopy(end, ctx->trace.endpos);
 	}
 
 	else
 	{
 		for (i = 0; i < 3; i++)
 		{
-			trace_trace.endpos[i] = start[i] + trace_trace.fraction *
+			ctx->trace.endpos[i] = start[i] + ctx->trace.fraction *
 									(end[i] - start[i]);
 		}
 	}
 
-	return trace_trace;
+	return ctx->trace;
+}
+
+trace_t
+CM_BoxTraceContext(cmtrace_t *ctx, vec3_t start, vec3_t end,
+		vec3_t mins, vec3_t maxs, int headnode, int brushmask)
+{
+	return CM_SweepContext(ctx, start, end, mins, maxs,
+			headnode, brushmask, false);
+}
+
+trace_t
+CM_BoxTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs,
+		int headnode, int brushmask)
+{
+	return CM_SweepContext(&cm_trace, start, end, mins, maxs,
+			headnode, brushmask, false);
+}
+
+/*
+ * The capsule is upright, as wide as the smaller side of the
+ * box and as high as the box. Brush sides are pushed out by a
+ * single offset, so there's less work per side than for a box.
+ */
+trace_t
+CM_CapsuleTraceContext(cmtrace_t *ctx, vec3_t start, vec3_t end,
+		vec3_t mins, vec3_t maxs, int headnode, int brushmask)
+{
+	return CM_SweepContext(ctx, start, end, mins, maxs,
+			headnode, brushmask, true);
+}
+
+trace_t
+CM_CapsuleTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs,
+		int headnode, int brushmask)
+{
+	return CM_SweepContext(&cm_trace, start, end, mins, maxs,
+			headnode, brushmask, true);
 }
 
 /*
  * Handles offseting and rotation of the end points for moving and
  * rotating entities
  */
-trace_t
-CM_TransformedBoxTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs,
-		int headnode, int brushmask, vec3_t origin, vec3_t angles)
+static trace_t
+CM_TransformedSweepContext(cmtrace_t *ctx, vec3_t start, vec3_t end,
+		vec3_t mins, vec3_t maxs, int headnode, int brushmask,
+		vec3_t origin, vec3_t angles, qboolean capsule)
 {
 	trace_t trace;
 	vec3_t start_l, end_l;
@@ -1154,8 +1964,9 @@ CM_TransformedBoxTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs,
 		end_l[2] = DotProduct(temp, up);
 	}
 
-	/* sweep the box through the model */
-	trace = CM_BoxTrace(start_l, end_l, mins, maxs, headnode, brushmask);
+	/* sweep the box or capsule through the model */
+	trace = CM_SweepContext(ctx, start_l, end_l, mins, maxs,
+			headnode, brushmask, capsule);
 
 	if (rotated && (trace.fraction != 1.0))
 	{
@@ -1175,47 +1986,770 @@ CM_TransformedBoxTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs,
 	return trace;
 }
 
-void
-CMod_LoadSubmodels(lump_t *l)
+trace_t
+CM_TransformedBoxTraceContext(cmtrace_t *ctx, vec3_t start, vec3_t end,
+		vec3_t mins, vec3_t maxs, int headnode, int brushmask,
+		vec3_t origin, vec3_t angles)
 {
-	dmodel_t *in;
-	cmodel_t *out;
-	int i, j, count;
+	return CM_TransformedSweepContext(ctx, start, end, mins, maxs,
+			headnode, brushmask, origin, angles, false);
+}
 
-	in = (void *)(cmod_base + l->fileofs);
+trace_t
+CM_TransformedBoxTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs,
+		int headnode, int brushmask, vec3_t origin, vec3_t angles)
+{
+	return CM_TransformedSweepContext(&cm_trace, start, end, mins, maxs,
+			headnode, brushmask, origin, angles, false);
+}
 
-	if (l->filelen % sizeof(*in))
-	{
-		Com_Error(ERR_DROP, "MOD_LoadBmodel: funny lump size");
-	}
+trace_t
+CM_TransformedCapsuleTraceContext(cmtrace_t *ctx, vec3_t start,
+		vec3_t end, vec3_t mins, vec3_t maxs, int headnode,
+		int brushmask, vec3_t origin, vec3_t angles)
+{
+	return CM_TransformedSweepContext(ctx, start, end, mins, maxs,
+			headnode, brushmask, origin, angles, true);
+}
 
-	count = l->filelen / sizeof(*in);
+trace_t
+CM_TransformedCapsuleTrace(vec3_t start, vec3_t end, vec3_t mins,
+		vec3_t maxs, int headnode, int brushmask, vec3_t origin,
+		vec3_t angles)
+{
+	return CM_TransformedSweepContext(&cm_trace, start, end, mins, maxs,
+			headnode, brushmask, origin, angles, true);
+}
 
-	if (count < 1)
+static void
+CM_TraceToLeafBatch(cmtracebatch_t *ctx, int leafnum,
+		const cmraypart_t *parts, int numparts)
+{
+	int i, k;
+	int brushnum;
+	unsigned bit;
+	cleaf_t *leaf;
+	cbrush_t *b;
+	trace_t *trace;
+
+	leaf = &map_leafs[leafnum];
+
+	if (!(leaf->contents & ctx->contents))
 	{
-		Com_Error(ERR_DROP, "Map with no models");
+		return;
 	}
 
-	if (count > MAX_MAP_MODELS)
+	for (k = 0; k < leaf->numleafbrushes; k++)
 	{
-		Com_Error(ERR_DROP, "Map has too many models");
-	}
+		brushnum = map_leafbrushes[leaf->firstleafbrush + k];
+		b = &map_brushes[brushnum];
 
-	numcmodels = count;
+		if (!(b->contents & ctx->contents))
+		{
+			continue;
+		}
+
+		if (ctx->brushchecks[brushnum] != ctx->checkcount)
+		{
+			ctx->brushchecks[brushnum] = ctx->checkcount;
+			ctx->brushrays[brushnum] = 0;
+		}
+
+		/* trace every ray of the leaf against the brush */
+		for (i = 0; i < numparts; i++)
+		{
+			bit = 1u << parts[i].ray;
+			trace = &ctx->traces[parts[i].ray];
+
+			if ((ctx->brushrays[brushnum] & bit) || !trace->fraction)
+			{
+				continue; /* checked in another leaf or stuck */
+			}
+
+			ctx->brushrays[brushnum] |= bit;
+
+			CM_ClipBoxToBrush(ctx->mins, ctx->maxs, ctx->starts[parts[i].ray],
+					ctx->ends[parts[i].ray], trace, b, ctx->ispoint);
+		}
+	}
+}
+
+static void
+CM_TestInLeafBatch(cmtracebatch_t *ctx, int leafnum, int ray)
+{
+	int k;
+	int brushnum;
+	unsigned bit;
+	cleaf_t *leaf;
+	cbrush_t *b;
+	trace_t *trace;
+
+	leaf = &map_leafs[leafnum];
+	trace = &ctx->traces[ray];
+	bit = 1u << ray;
+
+	if (!(leaf->contents & ctx->contents))
+	{
+		return;
+	}
+
+	for (k = 0; k < leaf->numleafbrushes; k++)
+	{
+		brushnum = map_leafbrushes[leaf->firstleafbrush + k];
+		b = &map_brushes[brushnum];
+
+		if (!(b->contents & ctx->contents))
+		{
+			continue;
+		}
+
+		if (ctx->brushchecks[brushnum] != ctx->checkcount)
+		{
+			ctx->brushchecks[brushnum] = ctx->checkcount;
+			ctx->brushrays[brushnum] = 0;
+		}
+
+		if (ctx->brushrays[brushnum] & bit)
+		{
+			continue;
+		}
+
+		ctx->brushrays[brushnum] |= bit;
+
+		CM_TestBoxInBrush(ctx->mins, ctx->maxs, ctx->starts[ray], trace, b);
+
+		if (!trace->fraction)
+		{
+			return;
+		}
+	}
+}
+
+/*
+ * Splits a ray part at a node like CM_RecursiveHullCheck does,
+ * halves[0] gets the front and halves[1] the back part. Returns
+ * the side of the near part.
+ */
+static int
+CM_SplitRayPart(const cmraypart_t *part, float t1, float t2,
+		float offset, cmraypart_t **halves)
+{
+	cmraypart_t *nearpart, *farpart;
+	float frac, frac2;
+	float idist;
+	int i;
+	int side;
+
+	/* put the crosspoint DIST_EPSILON pixels on the near side */
+	if (t1 < t2)
+	{
+		idist = 1.0f / (t1 - t2);
+		side = 1;
+		frac2 = (t1 + offset + DIST_EPSILON) * idist;
+		frac = (t1 - offset + DIST_EPSILON) * idist;
+	}
+
+	else if (t1 > t2)
+	{
+		idist = 1.0 / (t1 - t2);
+		side = 0;
+		frac2 = (t1 - offset - DIST_EPSILON) * idist;
+		frac = (t1 + offset + DIST_EPSILON) * idist;
+	}
+
+	else
+	{
+		side = 0;
+		frac = 1;
+		frac2 = 0;
+	}
+
+	frac = (frac < 0) ? 0 : ((frac > 1) ? 1 : frac);
+	frac2 = (frac2 < 0) ? 0 : ((frac2 > 1) ? 1 : frac2);
+
+	nearpart = halves[side];
+	farpart = halves[side ^ 1];
+
+	nearpart->ray = farpart->ray = part->ray;
+
+	nearpart->p1f = part->p1f;
+	nearpart->p2f = part->p1f + (part->p2f - part->p1f) * frac;
+	farpart->p1f = part->p1f + (part->p2f - part->p1f) * frac2;
+	farpart->p2f = part->p2f;
+
+	for (i = 0; i < 3; i++)
+	{
+		nearpart->p1[i] = part->p1[i];
+		nearpart->p2[i] = part->p1[i] + frac * (part->p2[i] - part->p1[i]);
+		farpart->p1[i] = part->p1[i] + frac2 * (part->p2[i] - part->p1[i]);
+		farpart->p2[i] = part->p2[i];
+	}
+
+	return side;
+}
+
+/*
+ * Drops the parts of rays that already hit something nearer.
+ */
+static int
+CM_FilterRayParts(cmtracebatch_t *ctx, cmraypart_t *parts, int numparts)
+{
+	int i, j;
+
+	for (i = j = 0; i < numparts; i++)
+	{
+		if (ctx->traces[parts[i].ray].fraction <= parts[i].p1f)
+		{
+			continue;
+		}
+
+		if (i != j)
+		{
+			parts[j] = parts[i];
+		}
+
+		j++;
+	}
+
+	return j;
+}
+
+/*
+ * Distance the plane is pushed out by the batch box
+ */
+static float
+CM_BatchOffset(const cmtracebatch_t *ctx, const cplane_t *plane)
+{
+	if (plane->type < 3)
+	{
+		return ctx->extents[plane->type];
+	}
+
+	if (ctx->ispoint)
+	{
+		return 0;
+	}
+
+	return (float)fabs(ctx->extents[0] * plane->normal[0]) +
+		   (float)fabs(ctx->extents[1] * plane->normal[1]) +
+		   (float)fabs(ctx->extents[2] * plane->normal[2]);
+}
+
+/*
+ * Walks a single ray of a batch, once the others went elsewhere
+ */
+static void
+CM_RecursiveHullCheckRay(cmtracebatch_t *ctx, int num,
+		const cmraypart_t *part)
+{
+	cmraypart_t split[2];
+	cmraypart_t *halves[2];
+	cnode_t *node;
+	cplane_t *plane;
+	float t1, t2, offset;
+	int side;
+
+	while (1)
+	{
+		if (ctx->traces[part->ray].fraction <= part->p1f)
+		{
+			return; /* already hit something nearer */
+		}
+
+		/* if < 0, we are in a leaf node */
+		if (num < 0)
+		{
+			CM_TraceToLeafBatch(ctx, -1 - num, part, 1);
+			return;
+		}
+
+		node = map_nodes + num;
+		plane = &node->plane;
+		offset = CM_BatchOffset(ctx, plane);
+
+		if (plane->type < 3)
+		{
+			t1 = part->p1[plane->type] - plane->dist;
+			t2 = part->p2[plane->type] - plane->dist;
+		}
+
+		else
+		{
+			t1 = DotProduct(plane->normal, part->p1) - plane->dist;
+			t2 = DotProduct(plane->normal, part->p2) - plane->dist;
+		}
+
+		/* see which sides we need to consider */
+		if ((t1 >= offset) && (t2 >= offset))
+		{
+			num = node->children[0];
+			continue;
+		}
+
+		if ((t1 < -offset) && (t2 < -offset))
+		{
+			num = node->children[1];
+			continue;
+		}
+
+		halves[0] = &split[0];
+		halves[1] = &split[1];
+
+		side = CM_SplitRayPart(part, t1, t2, offset, halves);
+
+		CM_RecursiveHullCheckRay(ctx, node->children[side], &split[side]);
+		CM_RecursiveHullCheckRay(ctx, node->children[side ^ 1],
+				&split[side ^ 1]);
+
+		return;
+	}
+}
+
+/*
+ * Walks all rays of a pass down the tree together. As long
+ * as they stay on one side of the nodes no copies are made,
+ * where they split the parts for both children are put at
+ * the start of the free ray parts. A lone ray goes on by
+ * itself. The child most rays reach first is walked first,
+ * the others get their far part before the near one, which
+ * only costs a few brush tests since the nearest hit wins.
+ */
+static void
+CM_RecursiveHullCheckBatch(cmtracebatch_t *ctx, int num,
+		cmraypart_t *parts, int numparts, cmraypart_t *free)
+{
+	cmraypart_t *split[2];
+	cmraypart_t *halves[2];
+	int numsplit[2], nearside[2];
+	int i, side;
+	int front, back;
+	cnode_t *node;
+	cplane_t *plane;
+	float t1, t2, offset;
+
+	while (1)
+	{
+		if (numparts == 1)
+		{
+			CM_RecursiveHullCheckRay(ctx, num, parts);
+			return;
+		}
+
+		/* if < 0, we are in a leaf node */
+		if (num < 0)
+		{
+			numparts = CM_FilterRayParts(ctx, parts, numparts);
+
+			if (numparts)
+			{
+				CM_TraceToLeafBatch(ctx, -1 - num, parts, numparts);
+			}
+
+			return;
+		}
+
+		node = map_nodes + num;
+		plane = &node->plane;
+		offset = CM_BatchOffset(ctx, plane);
+
+		front = back = 0;
+
+		for (i = 0; i < numparts; i++)
+		{
+			if (plane->type < 3)
+			{
+				t1 = parts[i].p1[plane->type] - plane->dist;
+				t2 = parts[i].p2[plane->type] - plane->dist;
+			}
+
+			else
+			{
+				t1 = DotProduct(plane->normal, parts[i].p1) - plane->dist;
+				t2 = DotProduct(plane->normal, parts[i].p2) - plane->dist;
+			}
+
+			if ((t1 >= offset) && (t2 >= offset))
+			{
+				front++;
+			}
+
+			else if ((t1 < -offset) && (t2 < -offset))
+			{
+				back++;
+			}
+		}
+
+		/* all on one side, go down without copying */
+		if (front == numparts)
+		{
+			num = node->children[0];
+			continue;
+		}
+
+		if (back == numparts)
+		{
+			num = node->children[1];
+			continue;
+		}
+
+		if (free + 2 * numparts > ctx->parts + CM_BATCHPARTS)
+		{
+			/* out of parts, very deep tree */
+			for (i = 0; i < numparts; i++)
+			{
+				CM_RecursiveHullCheckRay(ctx, num, &parts[i]);
+			}
+
+			return;
+		}
+
+		split[0] = free;
+		split[1] = free + numparts;
+		free += 2 * numparts;
+
+		numsplit[0] = numsplit[1] = 0;
+		nearside[0] = nearside[1] = 0;
+
+		for (i = 0; i < numparts; i++)
+		{
+			if (ctx->traces[parts[i].ray].fraction <= parts[i].p1f)
+			{
+				continue; /* already hit something nearer */
+			}
+
+			if (plane->type < 3)
+			{
+				t1 = parts[i].p1[plane->type] - plane->dist;
+				t2 = parts[i].p2[plane->type] - plane->dist;
+			}
+
+			else
+			{
+				t1 = DotProduct(plane->normal, parts[i].p1) - plane->dist;
+				t2 = DotProduct(plane->normal, parts[i].p2) - plane->dist;
+			}
+
+			if ((t1 >= offset) && (t2 >= offset))
+			{
+				split[0][numsplit[0]++] = parts[i];
+				nearside[0]++;
+			}
+
+			else if ((t1 < -offset) && (t2 < -offset))
+			{
+				split[1][numsplit[1]++] = parts[i];
+				nearside[1]++;
+			}
+
+			else
+			{
+				halves[0] = &split[0][numsplit[0]++];
+				halves[1] = &split[1][numsplit[1]++];
+
+				side = CM_SplitRayPart(&parts[i], t1, t2, offset, halves);
+				nearside[side]++;
+			}
+		}
+
+		side = (nearside[1] > nearside[0]) ? 1 : 0;
+
+		if (numsplit[side])
+		{
+			CM_RecursiveHullCheckBatch(ctx, node->children[side],
+					split[side], numsplit[side], free);
+		}
+
+		if (numsplit[side ^ 1])
+		{
+			CM_RecursiveHullCheckBatch(ctx, node->children[side ^ 1],
+					split[side ^ 1], numsplit[side ^ 1], free);
+		}
+
+		return;
+	}
+}
+
+static void
+CM_TestPositionBatch(cmtracebatch_t *ctx, int ray, int headnode)
+{
+	int leafs[1024];
+	int i, numleafs;
+	vec3_t c1, c2;
+	int topnode;
+
+	VectorAdd(ctx->starts[ray], ctx->mins, c1);
+	VectorAdd(ctx->starts[ray], ctx->maxs, c2);
+
+	for (i = 0; i < 3; i++)
+	{
+		c1[i] -= 1;
+		c2[i] += 1;
+	}
+
+	numleafs = CM_BoxLeafnums_headnode(c1, c2, leafs, 1024,
+			headnode, &topnode);
+
+	for (i = 0; i < numleafs; i++)
+	{
+		CM_TestInLeafBatch(ctx, leafs[i], ray);
+
+		if (ctx->traces[ray].allsolid)
+		{
+			break;
+		}
+	}
+}
+
+/*
+ * Sweeps the same box along count rays at once. The tree is walked
+ * once for every CM_BATCHRAYS rays instead of once per ray, which
+ * pays off for rays that run close to each other, like the pellets
+ * of a shotgun. Each trace is the one CM_BoxTraceContext would
+ * return, only the plane of a hit exactly on an edge may differ.
+ */
+void
+CM_BoxTraceBatchContext(cmtracebatch_t *ctx, int count, vec3_t *starts,
+		vec3_t *ends, vec3_t mins, vec3_t maxs, int headnode,
+		int brushmask, trace_t *traces)
+{
+	cmraypart_t *parts;
+	int first, numrays, numparts;
+	int i, r;
+	trace_t *trace;
+
+	ctx->contents = brushmask;
+	VectorCopy(mins, ctx->mins);
+	VectorCopy(maxs, ctx->maxs);
+
+	/* check for point special case */
+	if ((mins[0] == 0) && (mins[1] == 0) && (mins[2] == 0) &&
+		(maxs[0] == 0) && (maxs[1] == 0) && (maxs[2] == 0))
+	{
+		ctx->ispoint = true;
+		VectorClear(ctx->extents);
+	}
+
+	else
+	{
+		ctx->ispoint = false;
+		ctx->extents[0] = -mins[0] > maxs[0] ? -mins[0] : maxs[0];
+		ctx->extents[1] = -mins[1] > maxs[1] ? -mins[1] : maxs[1];
+		ctx->extents[2] = -mins[2] > maxs[2] ? -mins[2] : maxs[2];
+	}
+
+	for (first = 0; first < count; first += CM_BATCHRAYS)
+	{
+		numrays = count - first;
+
+		if (numrays > CM_BATCHRAYS)
+		{
+			numrays = CM_BATCHRAYS;
+		}
+
+		if (ctx->checkcount == 0x7fffffff)
+		{
+			CM_InitTraceBatchContext(ctx);
+		}
+
+		ctx->checkcount++;
+		ctx->traces = traces + first;
+		ctx->starts = starts + first;
+		ctx->ends = ends + first;
+
+		parts = ctx->parts;
+		numparts = 0;
+
+		for (r = 0; r < numrays; r++)
+		{
+#ifndef DEDICATED_ONLY
+			c_traces++;
+#endif
+
+			trace = &ctx->traces[r];
+
+			/* fill in a default trace */
+			memset(trace, 0, sizeof(*trace));
+			trace->fraction = 1;
+			trace->surface = &(nullsurface.c);
+
+			if (!numnodes)  /* map not loaded */
+			{
+				continue;
+			}
+
+			/* check for position test special case */
+			if (VectorCompare(ctx->starts[r], ctx->ends[r]))
+			{
+				CM_TestPositionBatch(ctx, r, headnode);
+				continue;
+			}
+
+			parts[numparts].ray = r;
+			parts[numparts].p1f = 0;
+			parts[numparts].p2f = 1;
+			VectorCopy(ctx->starts[r], parts[numparts].p1);
+			VectorCopy(ctx->ends[r], parts[numparts].p2);
+			numparts++;
+		}
+
+		/* general sweeping through world */
+		if (numparts)
+		{
+			CM_RecursiveHullCheckBatch(ctx, headnode, parts, numparts,
+					parts + numparts);
+		}
+
+		for (r = 0; r < numrays; r++)
+		{
+			trace = &ctx->traces[r];
+
+			if (trace->fraction == 1)
+			{
+				VectorCopy(ctx->ends[r], trace->endpos);
+			}
+
+			else
+			{
+				for (i = 0; i < 3; i++)
+				{
+					trace->endpos[i] = ctx->starts[r][i] + trace->fraction *
+									   (ctx->ends[r][i] - ctx->starts[r][i]);
+				}
+			}
+		}
+	}
+}
+
+void
+CM_BoxTraceBatch(int count, vec3_t *starts, vec3_t *ends, vec3_t mins,
+		vec3_t maxs, int headnode, int brushmask, trace_t *traces)
+{
+	CM_BoxTraceBatchContext(&cm_tracebatch, count, starts, ends, mins,
+			maxs, headnode, brushmask, traces);
+}
+
+void
+CMod_LoadSubmodels(lump_t *l)
+{
+	dmodel_t *in;
+	cmodel_t *out;
+	int i, j, count;
+
+	in = (void *)(cmod_base + l->fileofs);
+
+	if (l->filelen % sizeof(*in))
+	{
+		Com_Error(ERR_DROP, "MOD_LoadBmodel: funny lump size");
+	}
+
+	count = l->filelen / sizeof(*in);
+
+	if (count < 1)
+	{
+		Com_Error(ERR_DROP, "Map with no models");
+	}
+
+	if (count > MAX_MAP_MODELS)
+	{
+		Com_Error(ERR_DROP, "Map has too many models");
+	}
+
+	numcmodels = count;
+
+	for (i = 0; i < count; i++, in++, out++)
+	{
+		out = &map_cmodels[i];
+
+		for (j = 0; j < 3; j++)
+		{
+			/* spread the mins / maxs by a pixel */
+			out->mins[j] = LittleFloat(in->mins[j]) - 1;
+			out->maxs[j] = LittleFloat(in->maxs[j]) + 1;
+			out->origin[j] = LittleFloat(in->origin[j]);
+		}
+
+		out->headnode = LittleLong(in->headnode);
+	}
+}
+
+static void
+CMod_AddNodeBrushes(cmodel_t *model, int num)
+{
+	cleaf_t *leaf;
+	cbrush_t *brush;
+	cplane_t *plane;
+	vec3_t mins, maxs;
+	int i, j, k;
+
+	while (num >= 0)
+	{
+		CMod_AddNodeBrushes(model, map_nodes[num].children[0]);
+		num = map_nodes[num].children[1];
+	}
+
+	leaf = &map_leafs[-1 - num];
+
+	for (i = 0; i < leaf->numleafbrushes; i++)
+	{
+		brush = &map_brushes[map_leafbrushes[leaf->firstleafbrush + i]];
+
+		/* the axial sides bound the brush */
+		VectorCopy(model->mins, mins);
+		VectorCopy(model->maxs, maxs);
+
+		for (j = 0; j < brush->numsides; j++)
+		{
+			plane = &map_planes[map_brushsides[brush->firstbrushside + j].planenum];
+			k = plane->type;
+
+			if (k > 2)
+			{
+				continue;
+			}
+
+			if ((plane->normal[k] > 0) && (plane->dist < maxs[k]))
+			{
+				maxs[k] = plane->dist;
+			}
+			else if ((plane->normal[k] < 0) && (-plane->dist > mins[k]))
+			{
+				mins[k] = -plane->dist;
+			}
+		}
+
+		model->contents |= brush->contents;
+		AddPointToBounds(mins, model->brushmins, model->brushmaxs);
+		AddPointToBounds(maxs, model->brushmins, model->brushmaxs);
+	}
+}
+
+/*
+ * Finds the bounds and contents of the brushes of each inline
+ * model, so that the server can skip models a move misses.
+ * The world keeps its bounds, it's traced against anyway.
+ */
+void
+CMod_LoadModelBrushes(void)
+{
+	cmodel_t *model;
+	int i;
 
-	for (i = 0; i < count; i++, in++, out++)
+	for (i = 0; i < numcmodels; i++)
 	{
-		out = &map_cmodels[i];
+		model = &map_cmodels[i];
 
-		for (j = 0; j < 3; j++)
+		if (!i)
 		{
-			/* spread the mins / maxs by a pixel */
-			out->mins[j] = LittleFloat(in->mins[j]) - 1;
-			out->maxs[j] = LittleFloat(in->maxs[j]) + 1;
-			out->origin[j] = LittleFloat(in->origin[j]);
+			VectorCopy(model->mins, model->brushmins);
+			VectorCopy(model->maxs, model->brushmaxs);
+			model->contents = ~0;
+			continue;
 		}
 
-		out->headnode = LittleLong(in->headnode);
+		ClearBounds(model->brushmins, model->brushmaxs);
+		model->contents = 0;
+
+		CMod_AddNodeBrushes(model, model->headnode);
 	}
 }
 
@@ -1255,6 +2789,8 @@ CMod_LoadSurfaces(lump_t *l)
 		out->c.flags = LittleLong(in->flags);
 		out->c.value = LittleLong(in->value);
 	}
+
+	memset(out, 0, sizeof(*out)); /* for the sides of the box hull */
 }
 
 void
@@ -1290,16 +2826,170 @@ CMod_LoadNodes(lump_t *l)
 
 	for (i = 0; i < count; i++, out++, in++)
 	{
-		out->plane = map_planes + LittleLong(in->planenum);
+		j = LittleLong(in->planenum);
+
+		if ((j < 0) || (j >= numplanes))
+		{
+			Com_Error(ERR_DROP, "Bad node planenum");
+		}
+
+		out->plane = map_planes[j];
 
 		for (j = 0; j < 2; j++)
 		{
 			child = LittleLong(in->children[j]);
+
+			if (child >= count)
+			{
+				Com_Error(ERR_DROP, "Bad node child");
+			}
+
 			out->children[j] = child;
 		}
 	}
 }
 
+/*
+ * Copies the side planes of all brushes and the box brush into
+ * blocks of four for the vector kernels. The unused sides of the
+ * last block of a brush are behind every point.
+ */
+static void
+CMod_LoadSideBlocks(void)
+{
+	cbrush_t *brush;
+	cplane_t *plane;
+	csideblock_t *block;
+	int i, j, k;
+
+	numsideblocks = 0;
+
+	for (i = 0; i <= numbrushes; i++)
+	{
+		brush = &map_brushes[i]; /* the last one is the box */
+
+		if ((brush->numsides < 0) || (brush->firstbrushside < 0) ||
+			(brush->firstbrushside + brush->numsides > numbrushsides +
+			 ((i == numbrushes) ? 6 : 0)))
+		{
+			Com_Error(ERR_DROP, "CMod_LoadSideBlocks: bad brush sides");
+		}
+
+		brush->firstsideblock = numsideblocks;
+
+		for (j = 0; j < brush->numsides; j += 4)
+		{
+			if (numsideblocks == MAX_MAP_SIDEBLOCKS)
+			{
+				Com_Error(ERR_DROP, "Map has too many brush sides");
+			}
+
+			block = &map_sideblocks[numsideblocks++];
+
+			for (k = 0; k < 4; k++)
+			{
+				if (j + k < brush->numsides)
+				{
+					plane = &map_planes[map_brushsides[brush->firstbrushside + j + k].planenum];
+
+					block->normal[0][k] = plane->normal[0];
+					block->normal[1][k] = plane->normal[1];
+					block->normal[2][k] = plane->normal[2];
+					block->dist[k] = plane->dist;
+				}
+
+				else
+				{
+					block->normal[0][k] = 0;
+					block->normal[1][k] = 0;
+					block->normal[2][k] = 0;
+					block->dist[k] = 1e30f;
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Renumbers the nodes in depth first order, front
+ * side first, starting with the world model. Node
+ * numbers are private to the collision code, the
+ * headnodes of the models are changed to match.
+ */
+static void
+CMod_SortNodes(void)
+{
+	static int stack[MAX_MAP_NODES];
+	static int newnum[MAX_MAP_NODES];
+	static cnode_t sorted[MAX_MAP_NODES];
+	int i, j, n, count, depth;
+
+	for (i = 0; i < numnodes; i++)
+	{
+		newnum[i] = -1;
+	}
+
+	count = 0;
+
+	for (i = 0; i < numcmodels + numnodes; i++)
+	{
+		/* the models first, then anything they don't reach */
+		n = (i < numcmodels) ? map_cmodels[i].headnode : i - numcmodels;
+
+		if ((n < 0) || (n >= numnodes) || (newnum[n] != -1))
+		{
+			continue;
+		}
+
+		depth = 0;
+		stack[depth++] = n;
+
+		while (depth)
+		{
+			n = stack[--depth];
+
+			if (newnum[n] != -1)
+			{
+				continue;
+			}
+
+			newnum[n] = count;
+			sorted[count++] = map_nodes[n];
+
+			for (j = 1; j >= 0; j--)
+			{
+				if ((map_nodes[n].children[j] >= 0) &&
+					(newnum[map_nodes[n].children[j]] == -1) &&
+					(depth < MAX_MAP_NODES))
+				{
+					stack[depth++] = map_nodes[n].children[j];
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		for (j = 0; j < 2; j++)
+		{
+			if (sorted[i].children[j] >= 0)
+			{
+				sorted[i].children[j] = newnum[sorted[i].children[j]];
+			}
+		}
+	}
+
+	memcpy(map_nodes, sorted, count * sizeof(cnode_t));
+
+	for (i = 0; i < numcmodels; i++)
+	{
+		if ((map_cmodels[i].headnode >= 0) && (map_cmodels[i].headnode < numnodes))
+		{
+			map_cmodels[i].headnode = newnum[map_cmodels[i].headnode];
+		}
+	}
+}
+
 void
 CMod_LoadBrushes(lump_t *l)
 {
@@ -1521,7 +3211,7 @@ CMod_LoadBrushSides(lump_t *l)
 	for (i = 0; i < count; i++, in++, out++)
 	{
 		num = LittleShort(in->planenum);
-		out->plane = &map_planes[num];
+		out->planenum = num;
 		j = LittleShort(in->texinfo);
 
 		if (j >= numtexinfo)
@@ -1529,7 +3219,7 @@ CMod_LoadBrushSides(lump_t *l)
 			Com_Error(ERR_DROP, "Bad brushside texinfo");
 		}
 
-		out->surface = &map_surfaces[j];
+		out->surfnum = j;
 	}
 }
 
@@ -1594,6 +3284,36 @@ CMod_LoadAreaPortals(lump_t *l)
 	memcpy(out, in, sizeof(dareaportal_t) * count);
 }
 
+/*
+ * Remembers the two areas of each
+ * portal for CM_SetAreaPortalState
+ */
+void
+CMod_LoadPortalAreas(void)
+{
+	dareaportal_t *p;
+	int i, j;
+	int portalnum;
+
+	memset(portalareas, 0, sizeof(portalareas));
+
+	for (i = 1; i < numareas; i++)
+	{
+		p = &map_areaportals[map_areas[i].firstareaportal];
+
+		for (j = 0; j < map_areas[i].numareaportals; j++, p++)
+		{
+			portalnum = LittleLong(p->portalnum);
+
+			if ((portalnum >= 0) && (portalnum < MAX_MAP_AREAPORTALS))
+			{
+				portalareas[portalnum][0] = i;
+				portalareas[portalnum][1] = LittleLong(p->otherarea);
+			}
+		}
+	}
+}
+
 void
 CMod_LoadVisibility(lump_t *l)
 {
@@ -1609,6 +3329,147 @@ CMod_LoadVisibility(lump_t *l)
 	map_vis->numclusters = LittleLong(map_vis->numclusters);
 }
 
+void CM_DecompressVis(byte *in, byte *out);
+
+/*
+ * maps/<name>.<ext> in the game dir
+ */
+static void
+CMod_CacheName(const char *name, const char *ext, char *path, int size)
+{
+	char base[MAX_QPATH];
+
+	COM_StripExtension((char *)name, base);
+	Com_sprintf(path, size, "%s/%s.%s", FS_Gamedir(), base, ext);
+}
+
+static qboolean
+CMod_ReadVisCache(const char *name, unsigned checksum, int matrixbytes)
+{
+	char path[MAX_OSPATH];
+	dviscache_t header;
+	FILE *f;
+	qboolean ok;
+
+	CMod_CacheName(name, "vis", path, sizeof(path));
+
+	if ((f = fopen(path, "rb")) == NULL)
+	{
+		return false;
+	}
+
+	ok = (fread(&header, sizeof(header), 1, f) == 1) &&
+		(LittleLong(header.ident) == VISCACHE_IDENT) &&
+		(LittleLong(header.version) == VISCACHE_VERSION) &&
+		(LittleLong(header.checksum) == checksum) &&
+		(LittleLong(header.numclusters) == numclusters) &&
+		(LittleLong(header.rowbytes) == vis_rowbytes) &&
+		(fread(map_vismatrix_rows, matrixbytes, 1, f) == 1);
+
+	fclose(f);
+
+	if (!ok)
+	{
+		/* a truncated body leaves part of the rows filled, and
+		   the rebuild doesn't touch the padding or the last row */
+		memset(map_vismatrix_rows, 0, matrixbytes);
+		Com_DPrintf("%s is stale, rebuilding it.\n", path);
+	}
+
+	return ok;
+}
+
+static void
+CMod_WriteVisCache(const char *name, unsigned checksum, int matrixbytes)
+{
+	char path[MAX_OSPATH];
+	char tmp[MAX_OSPATH];
+	dviscache_t header;
+	qboolean ok;
+	FILE *f;
+
+	CMod_CacheName(name, "vis", path, sizeof(path));
+	Com_sprintf(tmp, sizeof(tmp), "%s.%x", path, (unsigned)Sys_Microseconds());
+	FS_CreatePath(tmp);
+
+	if ((f = fopen(tmp, "wb")) == NULL)
+	{
+		Com_DPrintf("Couldn't write %s.\n", tmp);
+		return;
+	}
+
+	header.ident = LittleLong(VISCACHE_IDENT);
+	header.version = LittleLong(VISCACHE_VERSION);
+	header.checksum = LittleLong(checksum);
+	header.numclusters = LittleLong(numclusters);
+	header.rowbytes = LittleLong(vis_rowbytes);
+
+	ok = (fwrite(&header, sizeof(header), 1, f) == 1) &&
+		(fwrite(map_vismatrix_rows, matrixbytes, 1, f) == 1);
+
+	fclose(f);
+
+	/* rename doesn't replace files on Windows */
+	if (!ok || ((rename(tmp, path) != 0) &&
+		((remove(path) != 0) || (rename(tmp, path) != 0))))
+	{
+		Com_DPrintf("Couldn't write %s.\n", path);
+		remove(tmp);
+	}
+}
+
+/*
+ * Decompresses the PVS and PHS rows of all clusters into one
+ * block, so that CM_ClusterPVS and CM_ClusterPHS only return
+ * a pointer. The rows are padded to whole 32 bit words. With
+ * map_viscache set the block is read from and written to
+ * maps/<name>.vis in the game dir.
+ */
+static void
+CMod_LoadVisMatrix(const char *name, unsigned checksum)
+{
+	int matrixbytes;
+	int i;
+
+	if (!map_vismatrix->value)
+	{
+		return;
+	}
+
+	vis_rowbytes = ((numclusters + 31) >> 5) * 4;
+
+	if ((size_t)vis_rowbytes * (2 * numclusters + 1) > VISMATRIX_MAXBYTES)
+	{
+		Com_DPrintf("%i clusters are too many for the vis matrix.\n",
+				numclusters);
+		return;
+	}
+
+	matrixbytes = vis_rowbytes * (2 * numclusters + 1);
+	map_vismatrix_rows = Z_Malloc(matrixbytes);
+
+	if (map_viscache->value &&
+		CMod_ReadVisCache(name, checksum, matrixbytes))
+	{
+		return;
+	}
+
+	for (i = 0; i < numclusters; i++)
+	{
+		CM_DecompressVis(map_visibility +
+				LittleLong(map_vis->bitofs[i][DVIS_PVS]),
+				map_vismatrix_rows + i * vis_rowbytes);
+		CM_DecompressVis(map_visibility +
+				LittleLong(map_vis->bitofs[i][DVIS_PHS]),
+				map_vismatrix_rows + (numclusters + i) * vis_rowbytes);
+	}
+
+	if (map_viscache->value)
+	{
+		CMod_WriteVisCache(name, checksum, matrixbytes);
+	}
+}
+
 void
 CMod_LoadEntityString(lump_t *l)
 {
@@ -1622,6 +3483,312 @@ CMod_LoadEntityString(lump_t *l)
 	memcpy(map_entitystring, cmod_base + l->fileofs, l->filelen);
 }
 
+/*
+ * Drops the shared image or the vis matrix of the last
+ * map, the next one is loaded into the static arrays
+ */
+static void
+CMod_FreeMap(void)
+{
+	if (map_image)
+	{
+		Sys_UnmapFile(map_image, map_imagesize);
+		map_image = NULL;
+		map_vismatrix_rows = NULL;
+	}
+	else if (map_vismatrix_rows)
+	{
+		Z_Free(map_vismatrix_rows);
+		map_vismatrix_rows = NULL;
+	}
+
+	map_planes = cm_planes;
+	map_nodes = cm_nodes;
+	map_leafs = cm_leafs;
+	map_leafbrushes = cm_leafbrushes;
+	map_brushes = cm_brushes;
+	map_brushsides = cm_brushsides;
+	map_sideblocks = cm_sideblocks;
+	map_surfaces = cm_surfaces;
+	map_cmodels = cm_cmodels;
+	map_areaportals = cm_areaportals;
+	map_visibility = cm_visibility;
+	map_entitystring = cm_entitystring;
+	map_vis = (dvis_t *)map_visibility;
+}
+
+/*
+ * Size of each lump of an image with the counts
+ * of the header, including the box hull
+ */
+static void
+CMod_ImageLumpSizes(const dcmimage_t *header, int *len)
+{
+	len[CMI_PLANES] = (header->numplanes + 12) * sizeof(cplane_t);
+	len[CMI_NODES] = (header->numnodes + 6) * sizeof(cnode_t);
+	len[CMI_LEAFS] = (header->numleafs + 1) * sizeof(cleaf_t);
+	len[CMI_LEAFBRUSHES] = (header->numleafbrushes + 1) * sizeof(unsigned short);
+	len[CMI_BRUSHES] = (header->numbrushes + 1) * sizeof(cbrush_t);
+	len[CMI_BRUSHSIDES] = (header->numbrushsides + 6) * sizeof(cbrushside_t);
+	len[CMI_SIDEBLOCKS] = header->numsideblocks * sizeof(csideblock_t);
+	len[CMI_SURFACES] = (header->numtexinfo + 1) * sizeof(mapsurface_t);
+	len[CMI_CMODELS] = header->numcmodels * sizeof(cmodel_t);
+	len[CMI_AREAS] = header->numareas * sizeof(carea_t);
+	len[CMI_AREAPORTALS] = header->numareaportals * sizeof(dareaportal_t);
+	len[CMI_VISIBILITY] = header->numvisibility;
+	len[CMI_ENTITYSTRING] = header->numentitychars + 1;
+	len[CMI_VISMATRIX] = header->visrowbytes * (2 * header->numclusters + 1);
+}
+
+/*
+ * Writes the loaded map to maps/<name>.cm for other servers to
+ * map. It's written under a temporary name and renamed, so that
+ * no server ever maps a part of it.
+ */
+static void
+CMod_WriteImage(const char *name, unsigned checksum)
+{
+	char path[MAX_OSPATH];
+	char tmp[MAX_OSPATH];
+	const void *data[CMI_NUM];
+	int len[CMI_NUM];
+	dcmimage_t header;
+	byte *image;
+	int i, size;
+	FILE *f;
+
+	data[CMI_PLANES] = map_planes;
+	data[CMI_NODES] = map_nodes;
+	data[CMI_LEAFS] = map_leafs;
+	data[CMI_LEAFBRUSHES] = map_leafbrushes;
+	data[CMI_BRUSHES] = map_brushes;
+	data[CMI_BRUSHSIDES] = map_brushsides;
+	data[CMI_SIDEBLOCKS] = map_sideblocks;
+	data[CMI_SURFACES] = map_surfaces;
+	data[CMI_CMODELS] = map_cmodels;
+	data[CMI_AREAS] = map_areas;
+	data[CMI_AREAPORTALS] = map_areaportals;
+	data[CMI_VISIBILITY] = map_visibility;
+	data[CMI_ENTITYSTRING] = map_entitystring;
+	data[CMI_VISMATRIX] = map_vismatrix_rows;
+
+	memset(&header, 0, sizeof(header));
+	header.ident = CMIMAGE_IDENT;
+	header.version = CMIMAGE_VERSION;
+	header.checksum = checksum;
+	header.numplanes = numplanes;
+	header.numnodes = numnodes;
+	header.numleafs = numleafs;
+	header.numleafbrushes = numleafbrushes;
+	header.numbrushes = numbrushes;
+	header.numbrushsides = numbrushsides;
+	header.numsideblocks = numsideblocks;
+	header.numtexinfo = numtexinfo;
+	header.numcmodels = numcmodels;
+	header.numareas = numareas;
+	header.numareaportals = numareaportals;
+	header.numvisibility = numvisibility;
+	header.numentitychars = numentitychars;
+	header.numclusters = numclusters;
+	header.emptyleaf = emptyleaf;
+	header.solidleaf = solidleaf;
+	header.visrowbytes = map_vismatrix_rows ? vis_rowbytes : 0;
+
+	CMod_ImageLumpSizes(&header, len);
+
+	/* every lump starts on a cache line */
+	size = (sizeof(header) + 63) & ~63;
+
+	for (i = 0; i < CMI_NUM; i++)
+	{
+		header.lumps[i].fileofs = size;
+		header.lumps[i].filelen = len[i];
+		size = (size + len[i] + 63) & ~63;
+	}
+
+	image = Z_Malloc(size);
+	memcpy(image, &header, sizeof(header));
+
+	for (i = 0; i < CMI_NUM; i++)
+	{
+		/* the entity string gets a terminating 0 */
+		memcpy(image + header.lumps[i].fileofs, data[i],
+				len[i] - ((i == CMI_ENTITYSTRING) ? 1 : 0));
+	}
+
+	CMod_CacheName(name, "cm", path, sizeof(path));
+	Com_sprintf(tmp, sizeof(tmp), "%s.%x", path, (unsigned)Sys_Microseconds());
+	FS_CreatePath(tmp);
+
+	if ((f = fopen(tmp, "wb")) == NULL)
+	{
+		Com_DPrintf("Couldn't write %s.\n", tmp);
+		Z_Free(image);
+		return;
+	}
+
+	i = fwrite(image, size, 1, f);
+	fclose(f);
+	Z_Free(image);
+
+	/* rename doesn't replace files on Windows */
+	if ((i != 1) || ((rename(tmp, path) != 0) &&
+		((remove(path) != 0) || (rename(tmp, path) != 0))))
+	{
+		Com_DPrintf("Couldn't write %s.\n", path);
+		remove(tmp);
+	}
+}
+
+/*
+ * The counts of an image index the fixed size arrays of the
+ * collision model, so they get the limits CMod_Load* enforce
+ */
+static qboolean
+CMod_ImageCountsValid(const dcmimage_t *header)
+{
+	if ((header->numplanes < 1) || (header->numplanes > MAX_MAP_PLANES) ||
+		(header->numnodes < 1) || (header->numnodes > MAX_MAP_NODES) ||
+		(header->numleafs < 1) || (header->numleafs > MAX_MAP_LEAFS) ||
+		(header->numleafbrushes < 1) ||
+		(header->numleafbrushes > MAX_MAP_LEAFBRUSHES) ||
+		(header->numbrushes < 0) || (header->numbrushes > MAX_MAP_BRUSHES) ||
+		(header->numbrushsides < 0) ||
+		(header->numbrushsides > MAX_MAP_BRUSHSIDES) ||
+		(header->numsideblocks < 0) ||
+		(header->numsideblocks > MAX_MAP_SIDEBLOCKS) ||
+		(header->numtexinfo < 1) || (header->numtexinfo > MAX_MAP_TEXINFO) ||
+		(header->numcmodels < 1) || (header->numcmodels > MAX_MAP_MODELS) ||
+		(header->numareas < 0) || (header->numareas > MAX_MAP_AREAS) ||
+		(header->numareaportals < 0) ||
+		(header->numareaportals > MAX_MAP_AREAS) ||
+		(header->numvisibility < 0) ||
+		(header->numvisibility > MAX_MAP_VISIBILITY) ||
+		(header->numentitychars < 0) ||
+		(header->numentitychars > MAX_MAP_ENTSTRING) ||
+		(header->numclusters < 0) || (header->numclusters > MAX_MAP_LEAFS))
+	{
+		return false;
+	}
+
+	if ((header->emptyleaf < 0) || (header->emptyleaf >= header->numleafs) ||
+		(header->solidleaf < 0) || (header->solidleaf >= header->numleafs))
+	{
+		return false;
+	}
+
+	/* the rows are looked up by cluster */
+	if (header->visrowbytes &&
+		(header->visrowbytes != ((header->numclusters + 31) >> 5) * 4))
+	{
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Maps maps/<name>.cm if it was written for the same bsp. The
+ * image is mapped copy on write, only the pages of the box hull
+ * are ever written and copied, all others are shared with the
+ * other servers mapping it.
+ */
+static qboolean
+CMod_MapImage(const char *name, unsigned checksum)
+{
+	char path[MAX_OSPATH];
+	int len[CMI_NUM];
+	dcmimage_t *header;
+	byte *image;
+	int i, size;
+
+	CMod_CacheName(name, "cm", path, sizeof(path));
+
+	if ((image = Sys_MapFile(path, &size)) == NULL)
+	{
+		return false;
+	}
+
+	header = (dcmimage_t *)image;
+
+	if ((size < sizeof(*header)) ||
+		(header->ident != CMIMAGE_IDENT) ||
+		(header->version != CMIMAGE_VERSION) ||
+		(header->checksum != checksum) ||
+		!CMod_ImageCountsValid(header))
+	{
+		Com_DPrintf("%s is stale, rebuilding it.\n", path);
+		Sys_UnmapFile(image, size);
+		return false;
+	}
+
+	CMod_ImageLumpSizes(header, len);
+
+	for (i = 0; i < CMI_NUM; i++)
+	{
+		if ((len[i] < 0) || (header->lumps[i].filelen != len[i]) ||
+			(header->lumps[i].fileofs & 63) ||
+			(header->lumps[i].fileofs > size - len[i]))
+		{
+			Com_DPrintf("%s is broken, rebuilding it.\n", path);
+			Sys_UnmapFile(image, size);
+			return false;
+		}
+	}
+
+	map_image = image;
+	map_imagesize = size;
+
+	numplanes = header->numplanes;
+	numnodes = header->numnodes;
+	numleafs = header->numleafs;
+	numleafbrushes = header->numleafbrushes;
+	numbrushes = header->numbrushes;
+	numbrushsides = header->numbrushsides;
+	numsideblocks = header->numsideblocks;
+	numtexinfo = header->numtexinfo;
+	numcmodels = header->numcmodels;
+	numareas = header->numareas;
+	numareaportals = header->numareaportals;
+	numvisibility = header->numvisibility;
+	numentitychars = header->numentitychars;
+	numclusters = header->numclusters;
+	emptyleaf = header->emptyleaf;
+	solidleaf = header->solidleaf;
+	vis_rowbytes = header->visrowbytes;
+
+	map_planes = (cplane_t *)(image + header->lumps[CMI_PLANES].fileofs);
+	map_nodes = (cnode_t *)(image + header->lumps[CMI_NODES].fileofs);
+	map_leafs = (cleaf_t *)(image + header->lumps[CMI_LEAFS].fileofs);
+	map_leafbrushes = (unsigned short *)(image +
+			header->lumps[CMI_LEAFBRUSHES].fileofs);
+	map_brushes = (cbrush_t *)(image + header->lumps[CMI_BRUSHES].fileofs);
+	map_brushsides = (cbrushside_t *)(image +
+			header->lumps[CMI_BRUSHSIDES].fileofs);
+	map_sideblocks = (csideblock_t *)(image +
+			header->lumps[CMI_SIDEBLOCKS].fileofs);
+	map_surfaces = (mapsurface_t *)(image + header->lumps[CMI_SURFACES].fileofs);
+	map_cmodels = (cmodel_t *)(image + header->lumps[CMI_CMODELS].fileofs);
+	map_areaportals = (dareaportal_t *)(image +
+			header->lumps[CMI_AREAPORTALS].fileofs);
+	map_visibility = image + header->lumps[CMI_VISIBILITY].fileofs;
+	map_entitystring = (char *)(image + header->lumps[CMI_ENTITYSTRING].fileofs);
+	map_vis = (dvis_t *)map_visibility;
+	map_vismatrix_rows = vis_rowbytes ?
+		image + header->lumps[CMI_VISMATRIX].fileofs : NULL;
+
+	/* the floods are per server */
+	memcpy(map_areas, image + header->lumps[CMI_AREAS].fileofs, len[CMI_AREAS]);
+
+	for (i = 0; i < numareas; i++)
+	{
+		map_areas[i].floodvalid = 0;
+		map_areas[i].floodnum = 0;
+	}
+
+	return true;
+}
+
 /*
  * Loads in the map and all submodels
  */
@@ -1635,6 +3802,9 @@ CM_LoadMap(char *name, qboolean clientload, unsigned *checksum)
 	static unsigned last_checksum;
 
 	map_noareas = Cvar_Get("map_noareas", "0", 0);
+	map_shared = Cvar_Get("map_shared", "0", 0);
+	map_vismatrix = Cvar_Get("map_vismatrix", "1", 0);
+	map_viscache = Cvar_Get("map_viscache", "0", 0);
 
 	if (!strcmp(map_name,
 				name) && (clientload || !Cvar_VariableValue("flushmap")))
@@ -1651,6 +3821,9 @@ CM_LoadMap(char *name, qboolean clientload, unsigned *checksum)
 	}
 
 	/* free old stuff */
+	CMod_FreeMap();
+	CM_InitTraceContext(&cm_trace);
+	CM_InitTraceBatchContext(&cm_tracebatch);
 	numplanes = 0;
 	numnodes = 0;
 	numleafs = 0;
@@ -1693,6 +3866,21 @@ CM_LoadMap(char *name, qboolean clientload, unsigned *checksum)
 				name, header.version, BSPVERSION);
 	}
 
+	if (map_shared->value && CMod_MapImage(name, last_checksum))
+	{
+		FS_FreeFile(buf);
+
+		CM_InitBoxHull();
+		CMod_LoadPortalAreas();
+
+		memset(portalopen, 0, sizeof(portalopen));
+		FloodAreaConnections();
+
+		strcpy(map_name, name);
+
+		return &map_cmodels[0];
+	}
+
 	cmod_base = (byte *)buf;
 
 	/* load into heap */
@@ -1704,14 +3892,24 @@ CM_LoadMap(char *name, qboolean clientload, unsigned *checksum)
 	CMod_LoadBrushSides(&header.lumps[LUMP_BRUSHSIDES]);
 	CMod_LoadSubmodels(&header.lumps[LUMP_MODELS]);
 	CMod_LoadNodes(&header.lumps[LUMP_NODES]);
+	CMod_SortNodes();
+	CMod_LoadModelBrushes();
 	CMod_LoadAreas(&header.lumps[LUMP_AREAS]);
 	CMod_LoadAreaPortals(&header.lumps[LUMP_AREAPORTALS]);
+	CMod_LoadPortalAreas();
 	CMod_LoadVisibility(&header.lumps[LUMP_VISIBILITY]);
 	CMod_LoadEntityString(&header.lumps[LUMP_ENTITIES]);
 
 	FS_FreeFile(buf);
 
 	CM_InitBoxHull();
+	CMod_LoadSideBlocks();
+	CMod_LoadVisMatrix(name, last_checksum);
+
+	if (map_shared->value)
+	{
+		CMod_WriteImage(name, last_checksum);
+	}
 
 	memset(portalopen, 0, sizeof(portalopen));
 	FloodAreaConnections();
@@ -1843,6 +4041,16 @@ CM_DecompressVis(byte *in, byte *out)
 byte *
 CM_ClusterPVS(int cluster)
 {
+	if (map_vismatrix_rows)
+	{
+		if (cluster == -1)
+		{
+			cluster = 2 * numclusters; /* the empty row */
+		}
+
+		return map_vismatrix_rows + cluster * vis_rowbytes;
+	}
+
 	if (cluster == -1)
 	{
 		memset(pvsrow, 0, (numclusters + 7) >> 3);
@@ -1860,6 +4068,13 @@ CM_ClusterPVS(int cluster)
 byte *
 CM_ClusterPHS(int cluster)
 {
+	if (map_vismatrix_rows)
+	{
+		cluster = (cluster == -1) ? numclusters : cluster;
+
+		return map_vismatrix_rows + (numclusters + cluster) * vis_rowbytes;
+	}
+
 	if (cluster == -1)
 	{
 		memset(phsrow, 0, (numclusters + 7) >> 3);
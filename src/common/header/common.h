@@ -81,6 +81,15 @@ void *SZ_GetSpace(sizebuf_t *buf, int length);
 void SZ_Write(sizebuf_t *buf, void *data, int length);
 void SZ_Print(sizebuf_t *buf, char *data);  /* strcats onto the sizebuf */
 
+/* bits written to or read from a sizebuf_t */
+typedef struct
+{
+	sizebuf_t *sb;
+	unsigned long long acc;     /* bits not yet in the sizebuf or not yet read */
+	int numbits;                /* in acc */
+	int count;                  /* bits written or read so far */
+} bitbuf_t;
+
 /* ================================================================== */
 
 struct usercmd_s;
@@ -125,6 +134,18 @@ void MSG_ReadDir(sizebuf_t *sb, vec3_t vector);
 
 void MSG_ReadData(sizebuf_t *sb, void *buffer, int size);
 
+void MSG_BeginBits(bitbuf_t *bb, sizebuf_t *sb);
+void MSG_WriteBits(bitbuf_t *bb, unsigned value, int numbits);
+void MSG_FlushBits(bitbuf_t *bb);
+void MSG_CopyBits(bitbuf_t *bb, const byte *data, int numbits);
+unsigned MSG_ReadBits(bitbuf_t *bb, int numbits);
+void MSG_WritePackedNumber(bitbuf_t *bb, int last, int number);
+int MSG_ReadPackedNumber(bitbuf_t *bb, int last);
+qboolean MSG_WritePackedDelta(bitbuf_t *bb, struct entity_state_s *from,
+		struct entity_state_s *to, qboolean force, qboolean newentity);
+void MSG_ReadPackedDelta(bitbuf_t *bb, struct entity_state_s *from,
+		struct entity_state_s *to, int number);
+
 /* ================================================================== */
 
 extern qboolean bigendien;
@@ -157,6 +178,12 @@ void Info_Print(char *s);
 
 #define PROTOCOL_VERSION 34
 
+/* 34 with bit packed entity deltas. Servers offer it with
+   "packedents" in the challenge, clients ask for it in their
+   connect. 35 and 36 are taken by R1Q2 and Q2PRO, which
+   negotiate theirs with "p=", so this stays clear of both. */
+#define PROTOCOL_PACKED 3434
+
 /* ========================================= */
 
 #define PORT_MASTER 27900
@@ -491,7 +518,9 @@ extern qboolean userinfo_modified;
 
 #define PORT_ANY -1
 #define MAX_MSGLEN 1400             /* max length of a message */
+#define MAX_RELIABLE_MSGLEN 0x8000  /* max length of a reliable message sent in fragments */
 #define PACKET_HEADER 10            /* two ints and a short */
+#define MAX_NET_BATCH 32            /* max datagrams per batched read or write */
 
 typedef enum
 {
@@ -523,7 +552,11 @@ void NET_Config(qboolean multiplayer);
 
 qboolean NET_GetPacket(netsrc_t sock, netadr_t *net_from,
 		sizebuf_t *net_message);
+int NET_GetPackets(netsrc_t sock, netadr_t *net_from,
+		sizebuf_t *net_messages, int maxmsgs);
 void NET_SendPacket(netsrc_t sock, int length, void *data, netadr_t to);
+void NET_SendPackets(netsrc_t sock, netadr_t *to, sizebuf_t *msgs,
+		int count);
 
 qboolean NET_CompareAdr(netadr_t a, netadr_t b);
 qboolean NET_CompareBaseAdr(netadr_t a, netadr_t b);
@@ -569,14 +602,30 @@ typedef struct
 	/* message is copied to this buffer when it is first transfered */
 	int reliable_length;
 	byte reliable_buf[MAX_MSGLEN - 16];         /* unacked reliable message */
+
+	/* reliable messages may be longer than a packet, then
+	   these MAX_RELIABLE_MSGLEN buffers are allocated and
+	   used instead, see Netchan_EnableFragments */
+	qboolean fragments;
+	byte *fragment_message;
+	byte *fragment_reliable;
+
+	/* the incoming reliable message put together so far */
+	int fragment_length;
+	byte *fragment_buf;
 } netchan_t;
 
 extern netadr_t net_from;
 extern sizebuf_t net_message;
-extern byte net_message_buffer[MAX_MSGLEN];
+
+/* room for a reliable message put together from fragments,
+   only MAX_MSGLEN bytes are used to receive the packets */
+extern byte net_message_buffer[MAX_MSGLEN + MAX_RELIABLE_MSGLEN];
 
 void Netchan_Init(void);
 void Netchan_Setup(netsrc_t sock, netchan_t *chan, netadr_t adr, int qport);
+void Netchan_EnableFragments(netchan_t *chan);
+void Netchan_FreeFragments(netchan_t *chan);
 
 qboolean Netchan_NeedReliable(netchan_t *chan);
 void Netchan_Transmit(netchan_t *chan, int length, byte *data);
@@ -586,6 +635,9 @@ qboolean Netchan_Process(netchan_t *chan, sizebuf_t *msg);
 
 qboolean Netchan_CanReliable(netchan_t *chan);
 
+void Netchan_BeginQueue(void);
+void Netchan_FlushQueue(void);
+
 /* CMODEL */
 
 #include "files.h"
@@ -605,11 +657,90 @@ int CM_PointContents(vec3_t p, int headnode);
 int CM_TransformedPointContents(vec3_t p, int headnode,
 		vec3_t origin, vec3_t angles);
 
+/* the state of a trace, threads tracing at the same time need
+   a context of their own. CM_InitTraceContext must be called on
+   a context before its first trace. */
+typedef struct
+{
+	trace_t trace;
+	vec3_t start, end;
+	vec3_t mins, maxs;
+	vec3_t extents;
+	qboolean ispoint;                   /* optimized case */
+	qboolean capsule;                   /* sweeping a capsule, not the box */
+	float radius, halfheight;           /* of the capsule */
+	int contents;
+	int checkcount;                     /* to avoid repeated testings */
+	int brushchecks[MAX_MAP_BRUSHES];   /* checkcount a brush was last tested */
+} cmtrace_t;
+
+void CM_InitTraceContext(cmtrace_t *ctx);
+
 trace_t CM_BoxTrace(vec3_t start, vec3_t end, vec3_t mins,
 		vec3_t maxs, int headnode, int brushmask);
 trace_t CM_TransformedBoxTrace(vec3_t start, vec3_t end,
 		vec3_t mins, vec3_t maxs, int headnode,
 		int brushmask, vec3_t origin, vec3_t angles);
+trace_t CM_BoxTraceContext(cmtrace_t *ctx, vec3_t start, vec3_t end,
+		vec3_t mins, vec3_t maxs, int headnode, int brushmask);
+trace_t CM_TransformedBoxTraceContext(cmtrace_t *ctx, vec3_t start,
+		vec3_t end, vec3_t mins, vec3_t maxs, int headnode,
+		int brushmask, vec3_t origin, vec3_t angles);
+
+/* like the box traces, but sweep the upright
+   capsule that fits into mins and maxs */
+trace_t CM_CapsuleTrace(vec3_t start, vec3_t end, vec3_t mins,
+		vec3_t maxs, int headnode, int brushmask);
+trace_t CM_TransformedCapsuleTrace(vec3_t start, vec3_t end,
+		vec3_t mins, vec3_t maxs, int headnode,
+		int brushmask, vec3_t origin, vec3_t angles);
+trace_t CM_CapsuleTraceContext(cmtrace_t *ctx, vec3_t start, vec3_t end,
+		vec3_t mins, vec3_t maxs, int headnode, int brushmask);
+trace_t CM_TransformedCapsuleTraceContext(cmtrace_t *ctx, vec3_t start,
+		vec3_t end, vec3_t mins, vec3_t maxs, int headnode,
+		int brushmask, vec3_t origin, vec3_t angles);
+
+#define CM_BATCHRAYS 32 /* rays walked through the tree at once */
+#define CM_BATCHPARTS 4096 /* ray parts on the way down */
+
+/* the part of a ray that is still in
+   front of a batch in the tree walk */
+typedef struct
+{
+	int ray;
+	float p1f, p2f;
+	vec3_t p1, p2;
+} cmraypart_t;
+
+/* the state of a batch trace, the rays of a pass are bits in
+   the brush masks. CM_InitTraceBatchContext must be called on
+   a context before its first trace. */
+typedef struct
+{
+	trace_t *traces;
+	vec3_t *starts, *ends;
+	vec3_t mins, maxs;
+	vec3_t extents;
+	qboolean ispoint;
+	int contents;
+	int checkcount;
+	int brushchecks[MAX_MAP_BRUSHES];
+	unsigned brushrays[MAX_MAP_BRUSHES];  /* rays that tested the brush */
+	cmraypart_t parts[CM_BATCHPARTS];
+} cmtracebatch_t;
+
+void CM_InitTraceBatchContext(cmtracebatch_t *ctx);
+
+void CM_BoxTraceBatch(int count, vec3_t *starts, vec3_t *ends,
+		vec3_t mins, vec3_t maxs, int headnode, int brushmask,
+		trace_t *traces);
+void CM_BoxTraceBatchContext(cmtracebatch_t *ctx, int count,
+		vec3_t *starts, vec3_t *ends, vec3_t mins, vec3_t maxs,
+		int headnode, int brushmask, trace_t *traces);
+
+/* selects the vector or the scalar brush clipping */
+void CM_UseSIMD(qboolean simd);
+const char *CM_SIMDImplementation(void);
 
 byte *CM_ClusterPVS(int cluster);
 byte *CM_ClusterPHS(int cluster);
@@ -630,9 +761,17 @@ qboolean CM_AreasConnected(int area1, int area2);
 
 int CM_WriteAreaBits(byte *buffer, int area);
 qboolean CM_HeadnodeVisible(int headnode, byte *visbits);
+int CM_HeadnodeClusters(int headnode, int *list, int listsize);
 
 void CM_WritePortalState(FILE *f);
 
+/* BIT VECTORS */
+
+void Bits_UseSIMD(qboolean simd);
+const char *Bits_Implementation(void);
+void Bits_Or(byte *dst, const byte *src, int bytes);
+qboolean Bits_TestAny(const byte *bits, const int *list, int count);
+
 /* PLAYER MOVEMENT CODE */
 
 extern float pm_airaccelerate;
@@ -765,12 +904,25 @@ void Sys_Quit(void);
 char *Sys_GetHomeDir(void);
 const char *Sys_GetBinaryDir(void);
 void Sys_Sleep(int msec);
+long long Sys_Microseconds(void);
 
 void Sys_FreeLibrary(void *handle);
 void *Sys_LoadLibrary(const char *path, const char *sym, void **handle);
 void *Sys_GetProcAddress(void *handle, const char *sym);
 void Sys_RedirectStdout(void);
 
+/* worker threads, the calling thread always works too */
+#define MAX_WORKERS 16
+
+int Sys_StartWorkers(int count);
+void Sys_StopWorkers(void);
+void Sys_RunWorkers(void (*func)(int job), int numjobs);
+
+/* maps a file copy on write, the pages
+   not written to are shared with others */
+void *Sys_MapFile(const char *path, int *size);
+void Sys_UnmapFile(void *base, int size);
+
 /* CLIENT / SERVER SYSTEMS */
 
 void CL_Init(void);
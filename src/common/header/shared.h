@@ -452,6 +452,8 @@ typedef struct cmodel_s
 	vec3_t mins, maxs;
 	vec3_t origin; /* for sounds or lights */
 	int headnode;
+	vec3_t brushmins, brushmaxs; /* tight bounds of the brushes */
+	int contents; /* of all brushes */
 } cmodel_t;
 
 typedef struct csurface_s
@@ -263,6 +263,7 @@ Qcommon_Init(int argc, char **argv)
 	Sys_Init();
 	NET_Init();
 	Netchan_Init();
+	Bits_UseSIMD(true);
 	SV_Init();
 #ifndef DEDICATED_ONLY
 	CL_Init();
@@ -341,17 +342,23 @@ Qcommon_Frame(int msec)
 		}
 	}
 
-	if (fixedtime->value)
+	/* the dedicated server loop runs frames with no time
+	   passed to read packets right away, these must not
+	   move the clock */
+	if (msec)
 	{
-		msec = fixedtime->value;
-	}
-	else if (timescale->value)
-	{
-		msec *= timescale->value;
-
-		if (msec < 1)
+		if (fixedtime->value)
+		{
+			msec = fixedtime->value;
+		}
+		else if (timescale->value)
 		{
-			msec = 1;
+			msec *= timescale->value;
+
+			if (msec < 1)
+			{
+				msec = 1;
+			}
 		}
 	}
 
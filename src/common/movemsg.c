@@ -1042,3 +1042,565 @@ MSG_ReadData(sizebuf_t *msg_read, void *data, int len)
 	}
 }
 
+
+/* ================================================================== */
+
+/*
+ * Bit level access for PROTOCOL_PACKED. Bits go into the message
+ * starting with the lowest bit of each byte, MSG_FlushBits pads
+ * the last byte with zeros.
+ */
+void
+MSG_BeginBits(bitbuf_t *bb, sizebuf_t *sb)
+{
+	bb->sb = sb;
+	bb->acc = 0;
+	bb->numbits = 0;
+	bb->count = 0;
+}
+
+void
+MSG_WriteBits(bitbuf_t *bb, unsigned value, int numbits)
+{
+	if (numbits < 32)
+	{
+		value &= (1u << numbits) - 1;
+	}
+
+	bb->acc |= (unsigned long long)value << bb->numbits;
+	bb->numbits += numbits;
+	bb->count += numbits;
+
+	while (bb->numbits >= 8)
+	{
+		MSG_WriteByte(bb->sb, (int)(bb->acc & 255));
+		bb->acc >>= 8;
+		bb->numbits -= 8;
+	}
+}
+
+void
+MSG_FlushBits(bitbuf_t *bb)
+{
+	if (bb->numbits)
+	{
+		MSG_WriteByte(bb->sb, (int)(bb->acc & 255));
+	}
+
+	bb->acc = 0;
+	bb->numbits = 0;
+}
+
+/*
+ * Appends numbits bits written by another bitbuf_t
+ */
+void
+MSG_CopyBits(bitbuf_t *bb, const byte *data, int numbits)
+{
+	for ( ; numbits >= 8; numbits -= 8)
+	{
+		MSG_WriteBits(bb, *data++, 8);
+	}
+
+	if (numbits)
+	{
+		MSG_WriteBits(bb, *data, numbits);
+	}
+}
+
+unsigned
+MSG_ReadBits(bitbuf_t *bb, int numbits)
+{
+	unsigned value;
+	int c;
+
+	while (bb->numbits < numbits)
+	{
+		/* past the end reads zeros, the
+		   caller checks the readcount */
+		c = MSG_ReadByte(bb->sb);
+		bb->acc |= (unsigned long long)(c < 0 ? 0 : c) << bb->numbits;
+		bb->numbits += 8;
+	}
+
+	value = (unsigned)(bb->acc & ((1ull << numbits) - 1));
+	bb->acc >>= numbits;
+	bb->numbits -= numbits;
+	bb->count += numbits;
+
+	return value;
+}
+
+/* the widths of the four classes of a variable length
+   value, the class is sent as 0, 10, 110 or 111 */
+static const int msg_coordbits[4] = {5, 9, 13, 17};
+static const int msg_anglebits[4] = {3, 5, 7, 8};
+static const int msg_valuebits[4] = {4, 8, 16, 32};
+
+static void
+MSG_WriteVarBits(bitbuf_t *bb, unsigned value, const int *widths)
+{
+	int i;
+
+	for (i = 0; i < 3; i++)
+	{
+		if (value < (1u << widths[i]))
+		{
+			break;
+		}
+	}
+
+	MSG_WriteBits(bb, (1u << i) - 1, i);
+
+	if (i < 3)
+	{
+		MSG_WriteBits(bb, 0, 1);
+	}
+
+	MSG_WriteBits(bb, value, widths[i]);
+}
+
+static unsigned
+MSG_ReadVarBits(bitbuf_t *bb, const int *widths)
+{
+	int i;
+
+	for (i = 0; (i < 3) && MSG_ReadBits(bb, 1); i++)
+	{
+	}
+
+	return MSG_ReadBits(bb, widths[i]);
+}
+
+/* small signed values get short codes */
+static unsigned
+MSG_ZigZag(int v)
+{
+	return ((unsigned)v << 1) ^ (unsigned)(v >> 31);
+}
+
+static int
+MSG_UnZigZag(unsigned u)
+{
+	return (int)(u >> 1) ^ -(int)(u & 1);
+}
+
+/*
+ * The values a protocol 34 client ends up with. The packed
+ * deltas are taken between these, so both protocols give
+ * the client exactly the same entity states.
+ */
+static int
+MSG_PackCoord(float f)
+{
+	return (short)(int)(f * 8);
+}
+
+static int
+MSG_PackAngle(float f)
+{
+	return (int)(f * 256 / 360) & 255;
+}
+
+static int
+MSG_PackFrame(int frame)
+{
+	return (frame < 256) ? (frame & 255) : (short)frame;
+}
+
+/* MSG_WriteDeltaEntity sends a byte, a short or, for
+   everything else including negative skins, a long */
+static int
+MSG_PackSkin(int skin)
+{
+	if ((unsigned)skin < 256)
+	{
+		return skin & 255;
+	}
+
+	if ((unsigned)skin < 0x10000)
+	{
+		return (short)skin;
+	}
+
+	return skin;
+}
+
+static int
+MSG_PackRenderfx(int renderfx)
+{
+	return (renderfx < 256) ? (renderfx & 255) : renderfx;
+}
+
+/*
+ * Entity numbers go as the gap to the last one: 0 and three
+ * bits for 1 to 8, 10 and eight bits for 9 to 264, otherwise
+ * 11 and the number in ten bits. Number 0 ends the list.
+ */
+void
+MSG_WritePackedNumber(bitbuf_t *bb, int last, int number)
+{
+	int gap;
+
+	gap = number - last;
+
+	if (number && (gap >= 1) && (gap <= 8))
+	{
+		MSG_WriteBits(bb, 0, 1);
+		MSG_WriteBits(bb, gap - 1, 3);
+	}
+	else if (number && (gap >= 9) && (gap <= 264))
+	{
+		MSG_WriteBits(bb, 1, 2);
+		MSG_WriteBits(bb, gap - 9, 8);
+	}
+	else
+	{
+		MSG_WriteBits(bb, 3, 2);
+		MSG_WriteBits(bb, number, 10);
+	}
+}
+
+int
+MSG_ReadPackedNumber(bitbuf_t *bb, int last)
+{
+	if (!MSG_ReadBits(bb, 1))
+	{
+		return last + 1 + MSG_ReadBits(bb, 3);
+	}
+
+	if (!MSG_ReadBits(bb, 1))
+	{
+		return last + 9 + MSG_ReadBits(bb, 8);
+	}
+
+	return MSG_ReadBits(bb, 10);
+}
+
+/*
+ * The PROTOCOL_PACKED version of MSG_WriteDeltaEntity. The entity
+ * number is not part of it. Origins, angles and the frame go as
+ * the difference to the old state, the old origin as the difference
+ * to the new origin. Returns false if nothing had to be written.
+ */
+qboolean
+MSG_WritePackedDelta(bitbuf_t *bb, entity_state_t *from,
+		entity_state_t *to, qboolean force, qboolean newentity)
+{
+	int origin1[3], origin2[3], angles1[3], angles2[3], oldorigin[3];
+	int originbits, anglebits, modelbits;
+	int models1[4], models2[4];
+	qboolean sendold, more;
+	int frame;
+	int i;
+
+	originbits = 0;
+	anglebits = 0;
+
+	for (i = 0; i < 3; i++)
+	{
+		origin1[i] = MSG_PackCoord(from->origin[i]);
+		origin2[i] = MSG_PackCoord(to->origin[i]);
+		angles1[i] = MSG_PackAngle(from->angles[i]);
+		angles2[i] = MSG_PackAngle(to->angles[i]);
+
+		if (origin1[i] != origin2[i])
+		{
+			originbits |= 1 << i;
+		}
+
+		if (angles1[i] != angles2[i])
+		{
+			anglebits |= 1 << i;
+		}
+	}
+
+	/* without it the client takes the old origin from
+	   the state it deltas from, like protocol 34 */
+	sendold = false;
+
+	if (newentity || (to->renderfx & RF_BEAM))
+	{
+		for (i = 0; i < 3; i++)
+		{
+			oldorigin[i] = MSG_PackCoord(to->old_origin[i]);
+
+			if (oldorigin[i] != origin1[i])
+			{
+				sendold = true;
+			}
+		}
+	}
+
+	models1[0] = from->modelindex & 255;
+	models1[1] = from->modelindex2 & 255;
+	models1[2] = from->modelindex3 & 255;
+	models1[3] = from->modelindex4 & 255;
+	models2[0] = to->modelindex & 255;
+	models2[1] = to->modelindex2 & 255;
+	models2[2] = to->modelindex3 & 255;
+	models2[3] = to->modelindex4 & 255;
+
+	modelbits = 0;
+
+	for (i = 0; i < 4; i++)
+	{
+		if (models1[i] != models2[i])
+		{
+			modelbits |= 1 << i;
+		}
+	}
+
+	frame = MSG_PackFrame(to->frame) - MSG_PackFrame(from->frame);
+
+	more = modelbits ||
+		(MSG_PackSkin(to->skinnum) != MSG_PackSkin(from->skinnum)) ||
+		(to->effects != from->effects) ||
+		(MSG_PackRenderfx(to->renderfx) != MSG_PackRenderfx(from->renderfx)) ||
+		((to->sound & 255) != (from->sound & 255)) ||
+		((short)to->solid != (short)from->solid);
+
+	if (!originbits && !anglebits && !sendold && !frame &&
+		!(to->event & 255) && !more && !force)
+	{
+		return false; /* nothing to send! */
+	}
+
+	MSG_WriteBits(bb, originbits != 0, 1);
+
+	if (originbits)
+	{
+		MSG_WriteBits(bb, originbits, 3);
+
+		for (i = 0; i < 3; i++)
+		{
+			if (originbits & (1 << i))
+			{
+				MSG_WriteVarBits(bb, MSG_ZigZag(origin2[i] - origin1[i]),
+						msg_coordbits);
+			}
+		}
+	}
+
+	MSG_WriteBits(bb, anglebits != 0, 1);
+
+	if (anglebits)
+	{
+		MSG_WriteBits(bb, anglebits, 3);
+
+		for (i = 0; i < 3; i++)
+		{
+			if (anglebits & (1 << i))
+			{
+				MSG_WriteVarBits(bb,
+						MSG_ZigZag((signed char)(angles2[i] - angles1[i])),
+						msg_anglebits);
+			}
+		}
+	}
+
+	MSG_WriteBits(bb, sendold, 1);
+
+	if (sendold)
+	{
+		for (i = 0; i < 3; i++)
+		{
+			MSG_WriteVarBits(bb, MSG_ZigZag(oldorigin[i] - origin2[i]),
+					msg_coordbits);
+		}
+	}
+
+	MSG_WriteBits(bb, frame != 0, 1);
+
+	if (frame)
+	{
+		MSG_WriteVarBits(bb, MSG_ZigZag(frame), msg_valuebits);
+	}
+
+	MSG_WriteBits(bb, (to->event & 255) != 0, 1);
+
+	if (to->event & 255)
+	{
+		MSG_WriteBits(bb, to->event, 8);
+	}
+
+	/* the fields that change seldom */
+	MSG_WriteBits(bb, more, 1);
+
+	if (!more)
+	{
+		return true;
+	}
+
+	MSG_WriteBits(bb, modelbits, 4);
+
+	for (i = 0; i < 4; i++)
+	{
+		if (modelbits & (1 << i))
+		{
+			MSG_WriteBits(bb, models2[i], 8);
+		}
+	}
+
+	if (MSG_PackSkin(to->skinnum) != MSG_PackSkin(from->skinnum))
+	{
+		MSG_WriteBits(bb, 1, 1);
+		MSG_WriteVarBits(bb, MSG_PackSkin(to->skinnum), msg_valuebits);
+	}
+	else
+	{
+		MSG_WriteBits(bb, 0, 1);
+	}
+
+	MSG_WriteBits(bb, to->effects != from->effects, 1);
+
+	if (to->effects != from->effects)
+	{
+		MSG_WriteVarBits(bb, to->effects, msg_valuebits);
+	}
+
+	if (MSG_PackRenderfx(to->renderfx) != MSG_PackRenderfx(from->renderfx))
+	{
+		MSG_WriteBits(bb, 1, 1);
+		MSG_WriteVarBits(bb, MSG_PackRenderfx(to->renderfx), msg_valuebits);
+	}
+	else
+	{
+		MSG_WriteBits(bb, 0, 1);
+	}
+
+	MSG_WriteBits(bb, (to->sound & 255) != (from->sound & 255), 1);
+
+	if ((to->sound & 255) != (from->sound & 255))
+	{
+		MSG_WriteBits(bb, to->sound, 8);
+	}
+
+	MSG_WriteBits(bb, (short)to->solid != (short)from->solid, 1);
+
+	if ((short)to->solid != (short)from->solid)
+	{
+		MSG_WriteBits(bb, to->solid, 16);
+	}
+
+	return true;
+}
+
+/*
+ * Reads what MSG_WritePackedDelta wrote. from is the state
+ * the client has, it holds the packed values already.
+ */
+void
+MSG_ReadPackedDelta(bitbuf_t *bb, entity_state_t *from,
+		entity_state_t *to, int number)
+{
+	int mask;
+	int i;
+
+	/* set everything to the state we are delta'ing from */
+	*to = *from;
+
+	VectorCopy(from->origin, to->old_origin);
+	to->number = number;
+	to->event = 0;
+
+	if (MSG_ReadBits(bb, 1))
+	{
+		mask = MSG_ReadBits(bb, 3);
+
+		for (i = 0; i < 3; i++)
+		{
+			if (mask & (1 << i))
+			{
+				to->origin[i] = (short)(MSG_PackCoord(from->origin[i]) +
+					MSG_UnZigZag(MSG_ReadVarBits(bb, msg_coordbits))) * 0.125f;
+			}
+		}
+	}
+
+	if (MSG_ReadBits(bb, 1))
+	{
+		mask = MSG_ReadBits(bb, 3);
+
+		for (i = 0; i < 3; i++)
+		{
+			if (mask & (1 << i))
+			{
+				to->angles[i] = (signed char)(MSG_PackAngle(from->angles[i]) +
+					MSG_UnZigZag(MSG_ReadVarBits(bb, msg_anglebits))) * 1.40625f;
+			}
+		}
+	}
+
+	if (MSG_ReadBits(bb, 1))
+	{
+		for (i = 0; i < 3; i++)
+		{
+			to->old_origin[i] = (short)(MSG_PackCoord(to->origin[i]) +
+				MSG_UnZigZag(MSG_ReadVarBits(bb, msg_coordbits))) * 0.125f;
+		}
+	}
+
+	if (MSG_ReadBits(bb, 1))
+	{
+		to->frame = from->frame + MSG_UnZigZag(MSG_ReadVarBits(bb,
+					msg_valuebits));
+	}
+
+	if (MSG_ReadBits(bb, 1))
+	{
+		to->event = MSG_ReadBits(bb, 8);
+	}
+
+	if (!MSG_ReadBits(bb, 1))
+	{
+		return;
+	}
+
+	mask = MSG_ReadBits(bb, 4);
+
+	if (mask & 1)
+	{
+		to->modelindex = MSG_ReadBits(bb, 8);
+	}
+
+	if (mask & 2)
+	{
+		to->modelindex2 = MSG_ReadBits(bb, 8);
+	}
+
+	if (mask & 4)
+	{
+		to->modelindex3 = MSG_ReadBits(bb, 8);
+	}
+
+	if (mask & 8)
+	{
+		to->modelindex4 = MSG_ReadBits(bb, 8);
+	}
+
+	if (MSG_ReadBits(bb, 1))
+	{
+		to->skinnum = (int)MSG_ReadVarBits(bb, msg_valuebits);
+	}
+
+	if (MSG_ReadBits(bb, 1))
+	{
+		to->effects = MSG_ReadVarBits(bb, msg_valuebits);
+	}
+
+	if (MSG_ReadBits(bb, 1))
+	{
+		to->renderfx = (int)MSG_ReadVarBits(bb, msg_valuebits);
+	}
+
+	if (MSG_ReadBits(bb, 1))
+	{
+		to->sound = MSG_ReadBits(bb, 8);
+	}
+
+	if (MSG_ReadBits(bb, 1))
+	{
+		to->solid = (short)MSG_ReadBits(bb, 16);
+	}
+}
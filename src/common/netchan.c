@@ -79,20 +79,49 @@
  * frame, such as during the connection stage while waiting for the
  * client to load, then a packet only needs to be delivered if there is
  * something in the unacknowledged reliable
+ *
+ * Channels with fragments enabled send reliable messages of up to
+ * MAX_RELIABLE_MSGLEN bytes. The reliable payload of a packet then
+ * starts with its offset and its length, the top bit of the length
+ * marks the last fragment. All fragments go out at once, each in a
+ * packet of its own, the last one is followed by the unreliable part.
+ * The receiver flips its reliable bit once it has all of them, after
+ * a lost fragment the sender notices that as usual and sends the
+ * whole message again.
  */
 
+#define FRAGMENT_HEADER 4
+#define FRAGMENT_LAST 0x8000
+#define MAX_FRAGMENT (MAX_MSGLEN - PACKET_HEADER - FRAGMENT_HEADER)
+
 cvar_t *showpackets;
 cvar_t *showdrop;
 cvar_t *qport;
 
 netadr_t net_from;
 sizebuf_t net_message;
-byte net_message_buffer[MAX_MSGLEN];
+byte net_message_buffer[MAX_MSGLEN + MAX_RELIABLE_MSGLEN];
+
+/* while queueing, outgoing datagrams are collected
+   here and handed to NET_SendPackets in one go */
+static qboolean netchan_queueing;
+static netsrc_t netchan_queue_sock;
+static int netchan_queued;
+static netadr_t netchan_queue_to[MAX_NET_BATCH];
+static sizebuf_t netchan_queue_msg[MAX_NET_BATCH];
+static byte netchan_queue_buf[MAX_NET_BATCH][MAX_MSGLEN];
 
 void
 Netchan_Init(void)
 {
 	int port;
+	int i;
+
+	for (i = 0; i < MAX_NET_BATCH; i++)
+	{
+		SZ_Init(&netchan_queue_msg[i], netchan_queue_buf[i],
+				sizeof(netchan_queue_buf[i]));
+	}
 
 	/* pick a port value that should be nice and random */
 	port = Sys_Milliseconds() & 0xffff;
@@ -102,6 +131,64 @@ Netchan_Init(void)
 	qport = Cvar_Get("qport", va("%i", port), CVAR_NOSET);
 }
 
+static void
+Netchan_SendQueue(void)
+{
+	if (netchan_queued)
+	{
+		NET_SendPackets(netchan_queue_sock, netchan_queue_to,
+				netchan_queue_msg, netchan_queued);
+		netchan_queued = 0;
+	}
+}
+
+/*
+ * Starts collecting outgoing datagrams instead
+ * of sending them right away. The packets are
+ * sent by Netchan_FlushQueue.
+ */
+void
+Netchan_BeginQueue(void)
+{
+	netchan_queueing = true;
+}
+
+/*
+ * Sends all queued datagrams, in the order they
+ * were queued, and stops queueing.
+ */
+void
+Netchan_FlushQueue(void)
+{
+	Netchan_SendQueue();
+	netchan_queueing = false;
+}
+
+/*
+ * Sends a datagram or adds it to the queue
+ */
+static void
+Netchan_SendPacket(netsrc_t sock, int length, byte *data, netadr_t adr)
+{
+	if (!netchan_queueing)
+	{
+		NET_SendPacket(sock, length, data, adr);
+		return;
+	}
+
+	if ((netchan_queued == MAX_NET_BATCH) ||
+		(netchan_queued && (netchan_queue_sock != sock)))
+	{
+		Netchan_SendQueue();
+	}
+
+	netchan_queue_sock = sock;
+	netchan_queue_to[netchan_queued] = adr;
+	memcpy(netchan_queue_msg[netchan_queued].data, data, length);
+	netchan_queue_msg[netchan_queued].cursize = length;
+	netchan_queued++;
+}
+
 /*
  * Sends an out-of-band datagram
  */
@@ -118,7 +205,7 @@ Netchan_OutOfBand(int net_socket, netadr_t adr, int length, byte *data)
 	SZ_Write(&send, data, length);
 
 	/* send the datagram */
-	NET_SendPacket(net_socket, send.cursize, send.data, adr);
+	Netchan_SendPacket(net_socket, send.cursize, send.data, adr);
 }
 
 /*
@@ -156,6 +243,53 @@ Netchan_Setup(netsrc_t sock, netchan_t *chan, netadr_t adr, int qport)
 	chan->message.allowoverflow = true;
 }
 
+/*
+ * Both ends must agree on this before the
+ * first packet goes over the channel
+ */
+void
+Netchan_EnableFragments(netchan_t *chan)
+{
+	if (chan->fragments)
+	{
+		return;
+	}
+
+	chan->fragments = true;
+	chan->fragment_message = Z_Malloc(MAX_RELIABLE_MSGLEN * 3);
+	chan->fragment_reliable = chan->fragment_message + MAX_RELIABLE_MSGLEN;
+	chan->fragment_buf = chan->fragment_reliable + MAX_RELIABLE_MSGLEN;
+
+	memcpy(chan->fragment_message, chan->message_buf, chan->message.cursize);
+	chan->message.data = chan->fragment_message;
+	chan->message.maxsize = MAX_RELIABLE_MSGLEN;
+}
+
+/*
+ * Gives back the buffers of Netchan_EnableFragments,
+ * called when the connection is gone
+ */
+void
+Netchan_FreeFragments(netchan_t *chan)
+{
+	if (!chan->fragments)
+	{
+		return;
+	}
+
+	Z_Free(chan->fragment_message);
+
+	chan->fragments = false;
+	chan->fragment_message = NULL;
+	chan->fragment_reliable = NULL;
+	chan->fragment_buf = NULL;
+	chan->fragment_length = 0;
+	chan->reliable_length = 0;
+
+	SZ_Init(&chan->message, chan->message_buf, sizeof(chan->message_buf));
+	chan->message.allowoverflow = true;
+}
+
 /*
  * Returns true if the last reliable message has acked
  */
@@ -193,6 +327,48 @@ Netchan_NeedReliable(netchan_t *chan)
 	return send_reliable;
 }
 
+/*
+ * Starts the next packet of the channel
+ */
+static void
+Netchan_BeginPacket(netchan_t *chan, sizebuf_t *send, byte *send_buf,
+		qboolean send_reliable)
+{
+	unsigned w1, w2;
+
+	SZ_Init(send, send_buf, MAX_MSGLEN);
+
+	w1 = (chan->outgoing_sequence & ~(1 << 31)) | (send_reliable << 31);
+	w2 =
+		(chan->incoming_sequence &
+	~(1 << 31)) | (chan->incoming_reliable_sequence << 31);
+
+	chan->outgoing_sequence++;
+	chan->last_sent = curtime;
+
+	MSG_WriteLong(send, w1);
+	MSG_WriteLong(send, w2);
+
+	/* send the qport if we are a client */
+	if (chan->sock == NS_CLIENT)
+	{
+		MSG_WriteShort(send, qport->value);
+	}
+}
+
+static void
+Netchan_WriteFragment(netchan_t *chan, sizebuf_t *send, int offset,
+		int length)
+{
+	qboolean last;
+
+	last = (offset + length == chan->reliable_length);
+
+	MSG_WriteShort(send, offset);
+	MSG_WriteShort(send, length | (last ? FRAGMENT_LAST : 0));
+	SZ_Write(send, chan->fragment_reliable + offset, length);
+}
+
 /*
  * tries to send an unreliable message to a connection, and handles the
  * transmition / retransmition of the reliable messages.
@@ -205,7 +381,7 @@ Netchan_Transmit(netchan_t *chan, int length, byte *data)
 	sizebuf_t send;
 	byte send_buf[MAX_MSGLEN];
 	qboolean send_reliable;
-	unsigned w1, w2;
+	int offset;
 
 	/* check for message overflow */
 	if (chan->message.overflowed)
@@ -220,36 +396,52 @@ Netchan_Transmit(netchan_t *chan, int length, byte *data)
 
 	if (!chan->reliable_length && chan->message.cursize)
 	{
-		memcpy(chan->reliable_buf, chan->message_buf, chan->message.cursize);
+		memcpy(chan->fragments ? chan->fragment_reliable : chan->reliable_buf,
+				chan->message.data, chan->message.cursize);
 		chan->reliable_length = chan->message.cursize;
 		chan->message.cursize = 0;
 		chan->reliable_sequence ^= 1;
 	}
 
-	/* write the packet header */
-	SZ_Init(&send, send_buf, sizeof(send_buf));
-
-	w1 = (chan->outgoing_sequence & ~(1 << 31)) | (send_reliable << 31);
-	w2 =
-		(chan->incoming_sequence &
-	~(1 << 31)) | (chan->incoming_reliable_sequence << 31);
+	offset = 0;
 
-	chan->outgoing_sequence++;
-	chan->last_sent = curtime;
-
-	MSG_WriteLong(&send, w1);
-	MSG_WriteLong(&send, w2);
-
-	/* send the qport if we are a client */
-	if (chan->sock == NS_CLIENT)
+	/* all fragments but the last go out right away */
+	if (send_reliable && chan->fragments)
 	{
-		MSG_WriteShort(&send, qport->value);
+		for ( ; chan->reliable_length - offset > MAX_FRAGMENT;
+			 offset += MAX_FRAGMENT)
+		{
+			Netchan_BeginPacket(chan, &send, send_buf, true);
+			Netchan_WriteFragment(chan, &send, offset, MAX_FRAGMENT);
+
+			Netchan_SendPacket(chan->sock, send.cursize, send.data,
+					chan->remote_address);
+
+			if (showpackets->value)
+			{
+				Com_Printf("send %4i : s=%i reliable=%i fragment=%i\n",
+						send.cursize, chan->outgoing_sequence - 1,
+						chan->reliable_sequence, offset);
+			}
+		}
 	}
 
+	/* write the packet header */
+	Netchan_BeginPacket(chan, &send, send_buf, send_reliable);
+
 	/* copy the reliable message to the packet first */
 	if (send_reliable)
 	{
-		SZ_Write(&send, chan->reliable_buf, chan->reliable_length);
+		if (chan->fragments)
+		{
+			Netchan_WriteFragment(chan, &send, offset,
+					chan->reliable_length - offset);
+		}
+		else
+		{
+			SZ_Write(&send, chan->reliable_buf, chan->reliable_length);
+		}
+
 		chan->last_reliable_sequence = chan->outgoing_sequence;
 	}
 
@@ -264,7 +456,8 @@ Netchan_Transmit(netchan_t *chan, int length, byte *data)
 	}
 
 	/* send the datagram */
-	NET_SendPacket(chan->sock, send.cursize, send.data, chan->remote_address);
+	Netchan_SendPacket(chan->sock, send.cursize, send.data,
+			chan->remote_address);
 
 	if (showpackets->value)
 	{
@@ -285,6 +478,70 @@ Netchan_Transmit(netchan_t *chan, int length, byte *data)
 	}
 }
 
+/*
+ * Adds a fragment to the incoming reliable message. Once that
+ * is complete, it replaces the fragment in msg, which must be
+ * net_message, and true is returned.
+ */
+static qboolean
+Netchan_ReadFragment(netchan_t *chan, sizebuf_t *msg)
+{
+	int header, offset, length, tail;
+	qboolean last;
+
+	header = msg->readcount;
+	offset = MSG_ReadShort(msg) & 0xffff;
+	length = MSG_ReadShort(msg) & 0xffff;
+
+	last = (length & FRAGMENT_LAST) != 0;
+	length &= ~FRAGMENT_LAST;
+
+	if (msg->readcount + length > msg->cursize)
+	{
+		Com_Printf("%s:Runt fragment\n", NET_AdrToString(chan->remote_address));
+		return false;
+	}
+
+	/* the first fragment starts over, the ones after
+	   a lost fragment are ignored until it is resent */
+	if (!offset)
+	{
+		chan->fragment_length = 0;
+	}
+
+	if ((offset != chan->fragment_length) ||
+		(offset + length > MAX_RELIABLE_MSGLEN))
+	{
+		return false;
+	}
+
+	memcpy(chan->fragment_buf + offset, msg->data + msg->readcount, length);
+	chan->fragment_length += length;
+	msg->readcount += length;
+
+	if (!last)
+	{
+		return false;
+	}
+
+	chan->incoming_reliable_sequence ^= 1;
+
+	/* the whole message takes the place
+	   of the fragment, the rest follows */
+	tail = msg->cursize - msg->readcount;
+
+	memmove(msg->data + header + chan->fragment_length,
+			msg->data + msg->readcount, tail);
+	memcpy(msg->data + header, chan->fragment_buf, chan->fragment_length);
+
+	msg->cursize = header + chan->fragment_length + tail;
+	msg->readcount = header;
+
+	chan->fragment_length = 0;
+
+	return true;
+}
+
 /*
  * called when the current net_message is from remote_address
  * modifies net_message so that it points to the packet payload
@@ -367,14 +624,19 @@ Netchan_Process(netchan_t *chan, sizebuf_t *msg)
 	chan->incoming_acknowledged = sequence_ack;
 	chan->incoming_reliable_acknowledged = reliable_ack;
 
+	/* the message can now be read from the current message pointer */
+	chan->last_received = curtime;
+
+	if (reliable_message && chan->fragments)
+	{
+		return Netchan_ReadFragment(chan, msg);
+	}
+
 	if (reliable_message)
 	{
 		chan->incoming_reliable_sequence ^= 1;
 	}
 
-	/* the message can now be read from the current message pointer */
-	chan->last_received = curtime;
-
 	return true;
 }
 
@@ -36,6 +36,10 @@ int sm_meat_index;
 int snd_fry;
 int meansOfDeath;
 
+int frameticks = 1;
+int frametick;
+float ticktime = FRAMETIME;
+
 edict_t *g_edicts;
 
 cvar_t *deathmatch;
@@ -52,6 +56,9 @@ cvar_t *maxspectators;
 cvar_t *maxentities;
 cvar_t *g_select_empty;
 cvar_t *dedicated;
+cvar_t *sv_tracebatch;
+cvar_t *sv_capsuletrace;
+cvar_t *g_capsule;
 
 cvar_t *filterban;
 
@@ -409,19 +416,32 @@ ExitLevel(void)
 }
 
 /*
- * Advances the world by 0.1 seconds
+ * Advances the world by one server tick. The
+ * physics run every tick, thinks when they're
+ * due, the clients and the rules once per frame.
  */
 void
 G_RunFrame(void)
 {
 	int i;
 	edict_t *ent;
+	qboolean framestart;
+
+	framestart = !frametick;
+
+	if (framestart)
+	{
+		level.framenum++;
+	}
 
-	level.framenum++;
-	level.time = level.framenum * FRAMETIME;
+	frametick++;
+	level.time = (level.framenum - 1 + (double)frametick / frameticks) * FRAMETIME;
 
 	/* choose a client for monsters to target this frame */
-	AI_SetSightClient();
+	if (framestart)
+	{
+		AI_SetSightClient();
+	}
 
 	/* exit intermissions */
 	if (level.exitintermission)
@@ -444,7 +464,11 @@ G_RunFrame(void)
 
 		level.current_entity = ent;
 
-		VectorCopy(ent->s.origin, ent->s.old_origin);
+		/* the clients lerp from the last frame they got */
+		if (framestart)
+		{
+			VectorCopy(ent->s.origin, ent->s.old_origin);
+		}
 
 		/* if the ground entity moved, make sure we are still on it */
 		if ((ent->groundentity) &&
@@ -461,13 +485,24 @@ G_RunFrame(void)
 
 		if ((i > 0) && (i <= maxclients->value))
 		{
-			ClientBeginServerFrame(ent);
+			if (framestart)
+			{
+				ClientBeginServerFrame(ent);
+			}
+
 			continue;
 		}
 
 		G_RunEntity(ent);
 	}
 
+	if (frametick < frameticks)
+	{
+		return;
+	}
+
+	frametick = 0;
+
 	/* see if it is time to end a deathmatch */
 	CheckDMRules();
 
@@ -380,7 +380,7 @@ SV_AddGravity(edict_t *ent)
 		return;
 	}
 
-	ent->velocity[2] -= ent->gravity * sv_gravity->value * FRAMETIME;
+	ent->velocity[2] -= ent->gravity * sv_gravity->value * ticktime;
 }
 
 /*
@@ -509,6 +509,7 @@ SV_PushEntity(edict_t *ent, vec3_t push)
 	vec3_t start;
 	vec3_t end;
 	int mask;
+	int capsule;
 
 	VectorCopy(ent->s.origin, start);
 	VectorAdd(start, push, end);
@@ -524,12 +525,14 @@ retry:
 		mask = MASK_SOLID;
 	}
 
-	trace = gi.trace(start, ent->mins, ent->maxs, end, ent, mask);
+	capsule = (ent->movetype == MOVETYPE_FLYMISSILE) ? CAPSULE_PROJECTILES : 0;
+	trace = G_MoveTrace(start, ent->mins, ent->maxs, end, ent, mask, capsule);
 
 	if (trace.startsolid || trace.allsolid)
 	{
 		mask ^= CONTENTS_DEADMONSTER;
-		trace = gi.trace (start, ent->mins, ent->maxs, end, ent, mask);
+		trace = G_MoveTrace(start, ent->mins, ent->maxs, end, ent,
+				mask, capsule);
 	}
 
 	VectorCopy(trace.endpos, ent->s.origin);
@@ -796,8 +799,8 @@ SV_Physics_Pusher(edict_t *ent)
 			part->avelocity[0] || part->avelocity[1] || part->avelocity[2])
 		{
 			/* object is moving */
-			VectorScale(part->velocity, FRAMETIME, move);
-			VectorScale(part->avelocity, FRAMETIME, amove);
+			VectorScale(part->velocity, ticktime, move);
+			VectorScale(part->avelocity, ticktime, amove);
 
 			if (!SV_Push(part, move, amove))
 			{
@@ -819,7 +822,7 @@ SV_Physics_Pusher(edict_t *ent)
 		{
 			if (mv->nextthink > 0)
 			{
-				mv->nextthink += FRAMETIME;
+				mv->nextthink += ticktime;
 			}
 		}
 
@@ -875,8 +878,8 @@ SV_Physics_Noclip(edict_t *ent)
 		return;
 	}
 
-	VectorMA(ent->s.angles, FRAMETIME, ent->avelocity, ent->s.angles);
-	VectorMA(ent->s.origin, FRAMETIME, ent->velocity, ent->s.origin);
+	VectorMA(ent->s.angles, ticktime, ent->avelocity, ent->s.angles);
+	VectorMA(ent->s.origin, ticktime, ent->velocity, ent->s.origin);
 
 	gi.linkentity(ent);
 }
@@ -947,10 +950,10 @@ SV_Physics_Toss(edict_t *ent)
 	}
 
 	/* move angles */
-	VectorMA(ent->s.angles, FRAMETIME, ent->avelocity, ent->s.angles);
+	VectorMA(ent->s.angles, ticktime, ent->avelocity, ent->s.angles);
 
 	/* move origin */
-	VectorScale(ent->velocity, FRAMETIME, move);
+	VectorScale(ent->velocity, ticktime, move);
 	trace = SV_PushEntity(ent, move);
 
 	if (!ent->inuse)
@@ -1041,8 +1044,8 @@ SV_AddRotationalFriction(edict_t *ent)
 		return;
 	}
 
-	VectorMA(ent->s.angles, FRAMETIME, ent->avelocity, ent->s.angles);
-	adjustment = FRAMETIME * STOPSPEED * FRICTION;
+	VectorMA(ent->s.angles, ticktime, ent->avelocity, ent->s.angles);
+	adjustment = ticktime * STOPSPEED * FRICTION;
 
 	for (n = 0; n < 3; n++)
 	{
@@ -1135,7 +1138,7 @@ SV_Physics_Step(edict_t *ent)
 		speed = fabs(ent->velocity[2]);
 		control = speed < STOPSPEED ? STOPSPEED : speed;
 		friction = FRICTION / 3;
-		newspeed = speed - (FRAMETIME * control * friction);
+		newspeed = speed - (ticktime * control * friction);
 
 		if (newspeed < 0)
 		{
@@ -1151,7 +1154,7 @@ SV_Physics_Step(edict_t *ent)
 	{
 		speed = fabs(ent->velocity[2]);
 		control = speed < STOPSPEED ? STOPSPEED : speed;
-		newspeed = speed - (FRAMETIME * control * WATERFRICTION * ent->waterlevel);
+		newspeed = speed - (ticktime * control * WATERFRICTION * ent->waterlevel);
 
 		if (newspeed < 0)
 		{
@@ -1178,7 +1181,7 @@ SV_Physics_Step(edict_t *ent)
 					friction = FRICTION;
 
 					control = speed < STOPSPEED ? STOPSPEED : speed;
-					newspeed = speed - FRAMETIME * control * friction;
+					newspeed = speed - ticktime * control * friction;
 
 					if (newspeed < 0)
 					{
@@ -1202,7 +1205,7 @@ SV_Physics_Step(edict_t *ent)
 			mask = MASK_SOLID;
 		}
 
-		SV_FlyMove(ent, FRAMETIME, mask);
+		SV_FlyMove(ent, ticktime, mask);
 
 		gi.linkentity(ent);
 		G_TouchTriggers(ent);
@@ -611,6 +611,7 @@ SpawnEntities(const char *mapname, char *entities, const char *spawnpoint)
 	gi.FreeTags(TAG_LEVEL);
 
 	memset(&level, 0, sizeof(level));
+	frametick = 0;
 	memset(g_edicts, 0, game.maxentities * sizeof(g_edicts[0]));
 
 	Q_strlcpy(level.mapname, mapname, sizeof(level.mapname));
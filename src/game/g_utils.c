@@ -650,6 +650,22 @@ G_TouchSolids(edict_t *ent)
 	}
 }
 
+/*
+ * gi.trace, or the capsule trace if g_capsule has the
+ * capsule bit and the server knows about capsules.
+ */
+trace_t
+G_MoveTrace(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end,
+		edict_t *passent, int contentmask, int capsule)
+{
+	if (((int)g_capsule->value & capsule) && sv_capsuletrace->value)
+	{
+		return gi.capsuletrace(start, mins, maxs, end, passent, contentmask);
+	}
+
+	return gi.trace(start, mins, maxs, end, passent, contentmask);
+}
+
 /*
  * Kills all entities that would touch the
  * proposed new positioning of ent. Ent s
@@ -26,6 +26,8 @@
 
 #include "header/local.h"
 
+#define SHOTGUN_BATCH 32 /* pellets traced at once */
+
 /*
  * This is a support routine used when a client is firing
  * a non-instant attack weapon.  It checks to see if a
@@ -167,134 +169,136 @@ fire_hit(edict_t *self, vec3_t aim, int damage, int kick)
 }
 
 /*
- * This is an internal support routine
- * used for bullet/pellet based weapons.
+ * Picks the end of a bullet or pellet
+ * spread around aimdir.
  */
-void
-fire_lead(edict_t *self, vec3_t start, vec3_t aimdir, int damage, int kick,
-		int te_impact, int hspread, int vspread, int mod)
+static void
+fire_lead_spread(vec3_t start, vec3_t aimdir, int hspread,
+		int vspread, vec3_t end)
 {
-	trace_t tr;
 	vec3_t dir;
 	vec3_t forward, right, up;
-	vec3_t end;
 	float r;
 	float u;
-	vec3_t water_start;
-	qboolean water = false;
-	int content_mask = MASK_SHOT | MASK_WATER;
 
-	if (!self)
-	{
-		return;
-	}
-
-	tr = gi.trace(self->s.origin, NULL, NULL, start, self, MASK_SHOT);
+	vectoangles(aimdir, dir);
+	AngleVectors(dir, forward, right, up);
 
-	if (!(tr.fraction < 1.0))
-	{
-		vectoangles(aimdir, dir);
-		AngleVectors(dir, forward, right, up);
+	r = crandom() * hspread;
+	u = crandom() * vspread;
+	VectorMA(start, 8192, forward, end);
+	VectorMA(end, r, right, end);
+	VectorMA(end, u, up, end);
+}
 
-		r = crandom() * hspread;
-		u = crandom() * vspread;
-		VectorMA(start, 8192, forward, end);
-		VectorMA(end, r, right, end);
-		VectorMA(end, u, up, end);
+/*
+ * Splashes the water a bullet hit, bends
+ * it and traces on ignoring the water.
+ */
+static void
+fire_lead_water(edict_t *self, vec3_t start, vec3_t end, trace_t *tr,
+		qboolean *water, vec3_t water_start, int hspread, int vspread)
+{
+	vec3_t dir;
+	vec3_t forward, right, up;
+	float r;
+	float u;
 
-		if (gi.pointcontents(start) & MASK_WATER)
-		{
-			water = true;
-			VectorCopy(start, water_start);
-			content_mask &= ~MASK_WATER;
-		}
+	/* see if we hit water */
+	if (tr->contents & MASK_WATER)
+	{
+		int color;
 
-		tr = gi.trace(start, NULL, NULL, end, self, content_mask);
+		*water = true;
+		VectorCopy(tr->endpos, water_start);
 
-		/* see if we hit water */
-		if (tr.contents & MASK_WATER)
+		if (!VectorCompare(start, tr->endpos))
 		{
-			int color;
-
-			water = true;
-			VectorCopy(tr.endpos, water_start);
-
-			if (!VectorCompare(start, tr.endpos))
+			if (tr->contents & CONTENTS_WATER)
 			{
-				if (tr.contents & CONTENTS_WATER)
-				{
-					if (strcmp(tr.surface->name, "*brwater") == 0)
-					{
-						color = SPLASH_BROWN_WATER;
-					}
-					else
-					{
-						color = SPLASH_BLUE_WATER;
-					}
-				}
-				else if (tr.contents & CONTENTS_SLIME)
+				if (strcmp(tr->surface->name, "*brwater") == 0)
 				{
-					color = SPLASH_SLIME;
-				}
-				else if (tr.contents & CONTENTS_LAVA)
-				{
-					color = SPLASH_LAVA;
+					color = SPLASH_BROWN_WATER;
 				}
 				else
 				{
-					color = SPLASH_UNKNOWN;
-				}
-
-				if (color != SPLASH_UNKNOWN)
-				{
-					gi.WriteByte(svc_temp_entity);
-					gi.WriteByte(TE_SPLASH);
-					gi.WriteByte(8);
-					gi.WritePosition(tr.endpos);
-					gi.WriteDir(tr.plane.normal);
-					gi.WriteByte(color);
-					gi.multicast(tr.endpos, MULTICAST_PVS);
+					color = SPLASH_BLUE_WATER;
 				}
+			}
+			else if (tr->contents & CONTENTS_SLIME)
+			{
+				color = SPLASH_SLIME;
+			}
+			else if (tr->contents & CONTENTS_LAVA)
+			{
+				color = SPLASH_LAVA;
+			}
+			else
+			{
+				color = SPLASH_UNKNOWN;
+			}
 
-				/* change bullet's course when it enters water */
-				VectorSubtract(end, start, dir);
-				vectoangles(dir, dir);
-				AngleVectors(dir, forward, right, up);
-				r = crandom() * hspread * 2;
-				u = crandom() * vspread * 2;
-				VectorMA(water_start, 8192, forward, end);
-				VectorMA(end, r, right, end);
-				VectorMA(end, u, up, end);
+			if (color != SPLASH_UNKNOWN)
+			{
+				gi.WriteByte(svc_temp_entity);
+				gi.WriteByte(TE_SPLASH);
+				gi.WriteByte(8);
+				gi.WritePosition(tr->endpos);
+				gi.WriteDir(tr->plane.normal);
+				gi.WriteByte(color);
+				gi.multicast(tr->endpos, MULTICAST_PVS);
 			}
 
-			/* re-trace ignoring water this time */
-			tr = gi.trace(water_start, NULL, NULL, end, self, MASK_SHOT);
+			/* change bullet's course when it enters water */
+			VectorSubtract(end, start, dir);
+			vectoangles(dir, dir);
+			AngleVectors(dir, forward, right, up);
+			r = crandom() * hspread * 2;
+			u = crandom() * vspread * 2;
+			VectorMA(water_start, 8192, forward, end);
+			VectorMA(end, r, right, end);
+			VectorMA(end, u, up, end);
 		}
+
+		/* re-trace ignoring water this time */
+		*tr = gi.trace(water_start, NULL, NULL, end, self, MASK_SHOT);
 	}
+}
+
+/*
+ * Damages what a bullet hit or leaves a puff,
+ * and draws its bubble trail through water.
+ */
+static void
+fire_lead_impact(edict_t *self, vec3_t aimdir, trace_t *tr,
+		qboolean water, vec3_t water_start, int damage, int kick,
+		int te_impact, int mod)
+{
+	vec3_t dir;
 
 	/* send gun puff / flash */
-	if (!((tr.surface) && (tr.surface->flags & SURF_SKY)))
+	if (!((tr->surface) && (tr->surface->flags & SURF_SKY)))
 	{
-		if (tr.fraction < 1.0)
+		if (tr->fraction < 1.0)
 		{
-			if (tr.ent->takedamage)
+			if (tr->ent->takedamage)
 			{
-				T_Damage(tr.ent, self, self, aimdir, tr.endpos, tr.plane.normal,
+				T_Damage(tr->ent, self, self, aimdir, tr->endpos, tr->plane.normal,
 						damage, kick, DAMAGE_BULLET, mod);
 			}
 			else
 			{
-				if (strncmp(tr.surface->name, "sky", 3) != 0)
+				if (strncmp(tr->surface->name, "sky", 3) != 0)
 				{
 					gi.WriteByte(svc_temp_entity);
 					gi.WriteByte(te_impact);
-					gi.WritePosition(tr.endpos);
-					gi.WriteDir(tr.plane.normal);
-					gi.multicast(tr.endpos, MULTICAST_PVS);
+					gi.WritePosition(tr->endpos);
+					gi.WriteDir(tr->plane.normal);
+					gi.multicast(tr->endpos, MULTICAST_PVS);
 
 					if (self->client)
 					{
-						PlayerNoise(self, tr.endpos, PNOISE_IMPACT);
+						PlayerNoise(self, tr->endpos, PNOISE_IMPACT);
 					}
 				}
 			}
@@ -307,30 +311,71 @@ fire_lead(edict_t *self, vec3_t start, vec3_t aimdir, int damage, int kick,
 	{
 		vec3_t pos;
 
-		VectorSubtract(tr.endpos, water_start, dir);
+		VectorSubtract(tr->endpos, water_start, dir);
 		VectorNormalize(dir);
-		VectorMA(tr.endpos, -2, dir, pos);
+		VectorMA(tr->endpos, -2, dir, pos);
 
 		if (gi.pointcontents(pos) & MASK_WATER)
 		{
-			VectorCopy(pos, tr.endpos);
+			VectorCopy(pos, tr->endpos);
 		}
 		else
 		{
-			tr = gi.trace(pos, NULL, NULL, water_start, tr.ent, MASK_WATER);
+			*tr = gi.trace(pos, NULL, NULL, water_start, tr->ent, MASK_WATER);
 		}
 
-		VectorAdd(water_start, tr.endpos, pos);
+		VectorAdd(water_start, tr->endpos, pos);
 		VectorScale(pos, 0.5, pos);
 
 		gi.WriteByte(svc_temp_entity);
 		gi.WriteByte(TE_BUBBLETRAIL);
 		gi.WritePosition(water_start);
-		gi.WritePosition(tr.endpos);
+		gi.WritePosition(tr->endpos);
 		gi.multicast(pos, MULTICAST_PVS);
 	}
 }
 
+/*
+ * This is an internal support routine
+ * used for bullet/pellet based weapons.
+ */
+void
+fire_lead(edict_t *self, vec3_t start, vec3_t aimdir, int damage, int kick,
+		int te_impact, int hspread, int vspread, int mod)
+{
+	trace_t tr;
+	vec3_t end;
+	vec3_t water_start;
+	qboolean water = false;
+	int content_mask = MASK_SHOT | MASK_WATER;
+
+	if (!self)
+	{
+		return;
+	}
+
+	tr = gi.trace(self->s.origin, NULL, NULL, start, self, MASK_SHOT);
+
+	if (!(tr.fraction < 1.0))
+	{
+		fire_lead_spread(start, aimdir, hspread, vspread, end);
+
+		if (gi.pointcontents(start) & MASK_WATER)
+		{
+			water = true;
+			VectorCopy(start, water_start);
+			content_mask &= ~MASK_WATER;
+		}
+
+		tr = gi.trace(start, NULL, NULL, end, self, content_mask);
+		fire_lead_water(self, start, end, &tr, &water, water_start,
+				hspread, vspread);
+	}
+
+	fire_lead_impact(self, aimdir, &tr, water, water_start, damage, kick,
+			te_impact, mod);
+}
+
 /*
  * Fires a single round.  Used for machinegun and
  * chaingun.  Would be fine for pistols, rifles, etc....
@@ -356,17 +401,92 @@ void
 fire_shotgun(edict_t *self, vec3_t start, vec3_t aimdir, int damage,
 		int kick, int hspread, int vspread, int count, int mod)
 {
-	int i;
+	vec3_t starts[SHOTGUN_BATCH], ends[SHOTGUN_BATCH];
+	trace_t traces[SHOTGUN_BATCH];
+	trace_t tr;
+	vec3_t water_start;
+	qboolean startwater, water;
+	int content_mask;
+	int i, j, num;
 
 	if (!self)
 	{
 		return;
 	}
 
-	for (i = 0; i < count; i++)
+	if (!sv_tracebatch->value)
 	{
-		fire_lead(self, start, aimdir, damage, kick, TE_SHOTGUN,
-				hspread, vspread, mod);
+		for (i = 0; i < count; i++)
+		{
+			fire_lead(self, start, aimdir, damage, kick, TE_SHOTGUN,
+					hspread, vspread, mod);
+		}
+
+		return;
+	}
+
+	/* the pellets are traced together, the server
+	   walks the map once for all of them */
+	tr = gi.trace(self->s.origin, NULL, NULL, start, self, MASK_SHOT);
+
+	if (tr.fraction < 1.0)
+	{
+		for (i = 0; i < count; i++)
+		{
+			/* an earlier pellet may have removed what this one hit,
+			   the rest trace on their own like without batching */
+			if (!tr.ent->inuse || (tr.ent->solid == SOLID_NOT))
+			{
+				for ( ; i < count; i++)
+				{
+					fire_lead(self, start, aimdir, damage, kick, TE_SHOTGUN,
+							hspread, vspread, mod);
+				}
+
+				return;
+			}
+
+			traces[0] = tr;
+			fire_lead_impact(self, aimdir, &traces[0], false, start,
+					damage, kick, TE_SHOTGUN, mod);
+		}
+
+		return;
+	}
+
+	startwater = (gi.pointcontents(start) & MASK_WATER) ? true : false;
+	content_mask = startwater ? MASK_SHOT : (MASK_SHOT | MASK_WATER);
+
+	for (i = 0; i < count; i += num)
+	{
+		num = (count - i < SHOTGUN_BATCH) ? count - i : SHOTGUN_BATCH;
+
+		for (j = 0; j < num; j++)
+		{
+			VectorCopy(start, starts[j]);
+			fire_lead_spread(start, aimdir, hspread, vspread, ends[j]);
+		}
+
+		gi.tracebatch(num, starts, ends, NULL, NULL, self,
+				content_mask, traces);
+
+		for (j = 0; j < num; j++)
+		{
+			/* an earlier pellet may have removed what this one hit */
+			if (!traces[j].ent->inuse || (traces[j].ent->solid == SOLID_NOT))
+			{
+				traces[j] = gi.trace(start, NULL, NULL, ends[j],
+						self, content_mask);
+			}
+
+			water = startwater;
+			VectorCopy(start, water_start);
+
+			fire_lead_water(self, start, ends[j], &traces[j], &water,
+					water_start, hspread, vspread);
+			fire_lead_impact(self, aimdir, &traces[j], water, water_start,
+					damage, kick, TE_SHOTGUN, mod);
+		}
 	}
 }
 
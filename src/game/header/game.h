@@ -181,6 +181,17 @@ typedef struct
 	void (*AddCommandString)(char *text);
 
 	void (*DebugGraph)(float value, int color);
+
+	/* traces count moves of the same size at once, only
+	   there if the server sets the sv_tracebatch cvar */
+	void (*tracebatch)(int count, vec3_t *starts, vec3_t *ends,
+			vec3_t mins, vec3_t maxs, edict_t *passent, int contentmask,
+			trace_t *traces);
+
+	/* like trace, but moves the upright capsule fitting into mins
+	   and maxs, only there if the server sets sv_capsuletrace */
+	trace_t (*capsuletrace)(vec3_t start, vec3_t mins, vec3_t maxs,
+			vec3_t end, edict_t *passent, int contentmask);
 } game_import_t;
 
 /* functions exported by the game subsystem */
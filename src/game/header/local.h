@@ -74,7 +74,7 @@
 #define FL_POWER_ARMOR 0x00001000 /* power armor (if any) is active */
 #define FL_RESPAWN 0x80000000 /* used for item respawning */
 
-#define FRAMETIME 0.1
+#define FRAMETIME 0.1 /* thinks and animations run in these steps */
 
 /* memory tags to allow dynamic memory to be cleaned up */
 #define TAG_GAME 765 /* clear when unloading the dll */
@@ -441,6 +441,10 @@ extern spawn_temp_t st;
 extern int sm_meat_index;
 extern int snd_fry;
 
+extern int frameticks; /* server ticks per FRAMETIME */
+extern int frametick; /* ticks run of the current frame */
+extern float ticktime; /* seconds of physics per tick */
+
 extern int gibsthisframe;
 extern int lastgibframe;
 
@@ -505,6 +509,9 @@ extern cvar_t *spectator_password;
 extern cvar_t *needpass;
 extern cvar_t *g_select_empty;
 extern cvar_t *dedicated;
+extern cvar_t *sv_tracebatch;
+extern cvar_t *sv_capsuletrace;
+extern cvar_t *g_capsule;
 
 extern cvar_t *filterban;
 
@@ -614,6 +621,13 @@ void G_FreeEdict(edict_t *e);
 void G_TouchTriggers(edict_t *ent);
 void G_TouchSolids(edict_t *ent);
 
+/* g_capsule bits, what moves as a capsule */
+#define CAPSULE_PROJECTILES 1
+#define CAPSULE_PLAYERS 2
+
+trace_t G_MoveTrace(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end,
+		edict_t *passent, int contentmask, int capsule);
+
 char *G_CopyString(char *in);
 
 float *tv(float x, float y, float z);
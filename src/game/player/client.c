@@ -2153,11 +2153,13 @@ PM_trace(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end)
 {
 	if (pm_passent->health > 0)
 	{
-		return gi.trace(start, mins, maxs, end, pm_passent, MASK_PLAYERSOLID);
+		return G_MoveTrace(start, mins, maxs, end, pm_passent,
+				MASK_PLAYERSOLID, CAPSULE_PLAYERS);
 	}
 	else
 	{
-		return gi.trace(start, mins, maxs, end, pm_passent, MASK_DEADSOLID);
+		return G_MoveTrace(start, mins, maxs, end, pm_passent,
+				MASK_DEADSOLID, CAPSULE_PLAYERS);
 	}
 }
 
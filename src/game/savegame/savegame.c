@@ -210,6 +210,8 @@ field_t clientfields[] = {
 void
 InitGame(void)
 {
+	cvar_t *sv_tickrate;
+
 	gi.dprintf("Game is starting up.\n");
 	gi.dprintf("Game is %s built on %s.\n", GAMEVERSION, BUILD_DATE);
 
@@ -223,6 +225,8 @@ InitGame(void)
 
 	/* noset vars */
 	dedicated = gi.cvar("dedicated", "0", CVAR_NOSET);
+	sv_tracebatch = gi.cvar("sv_tracebatch", "0", CVAR_NOSET);
+	sv_capsuletrace = gi.cvar("sv_capsuletrace", "0", CVAR_NOSET);
 
 	/* latched vars */
 	sv_cheats = gi.cvar("cheats", "0", CVAR_SERVERINFO | CVAR_LATCH);
@@ -234,6 +238,7 @@ InitGame(void)
 	coop = gi.cvar("coop", "0", CVAR_LATCH);
 	skill = gi.cvar("skill", "1", CVAR_LATCH);
 	maxentities = gi.cvar("maxentities", "1024", CVAR_LATCH);
+	sv_tickrate = gi.cvar("sv_tickrate", "10", CVAR_SERVERINFO | CVAR_LATCH);
 
 	/* change anytime vars */
 	dmflags = gi.cvar("dmflags", "0", CVAR_SERVERINFO);
@@ -244,6 +249,7 @@ InitGame(void)
 	needpass = gi.cvar("needpass", "0", CVAR_SERVERINFO);
 	filterban = gi.cvar("filterban", "1", 0);
 	g_select_empty = gi.cvar("g_select_empty", "0", CVAR_ARCHIVE);
+	g_capsule = gi.cvar("g_capsule", "0", 0);
 	run_pitch = gi.cvar("run_pitch", "0.002", 0);
 	run_roll = gi.cvar("run_roll", "0.005", 0);
 	bob_up = gi.cvar("bob_up", "0.005", 0);
@@ -258,6 +264,14 @@ InitGame(void)
 	/* dm map list */
 	sv_maplist = gi.cvar("sv_maplist", "", 0);
 
+	/* physics run on every server tick, everything
+	   else still once per FRAMETIME. g_tickrate tells
+	   the server that we can do that. */
+	frameticks = (int)sv_tickrate->value / 10;
+	frameticks = (frameticks < 1) ? 1 : ((frameticks > 6) ? 6 : frameticks);
+	ticktime = FRAMETIME / frameticks;
+	gi.cvar_forceset("g_tickrate", va("%i", frameticks * 10));
+
 	/* items */
 	InitItems();
 
@@ -39,6 +39,16 @@
    out before legitimate users connected */
 #define MAX_CHALLENGES 1024
 
+/* buckets of the client lookup by address and qport,
+   must be a power of two */
+#define CLIENT_HASH_SIZE 256
+
+/* the unreliable multicasts of a frame are stored once,
+   the clients' datagrams hold up to MAX_DATAGRAM_REFS
+   references to them */
+#define MULTICAST_ARENA 0x10000
+#define MAX_DATAGRAM_REFS 128
+
 #define SV_OUTPUTBUF_LENGTH (MAX_MSGLEN - 16)
 #define EDICT_NUM(n) ((edict_t *)((byte *)ge->edicts + ge->edict_size * (n)))
 #define NUM_FOR_EDICT(e) (((byte *)(e) - (byte *)ge->edicts) / ge->edict_size)
@@ -60,8 +70,9 @@ typedef struct
 	qboolean attractloop;           /* running cinematics and demos for the local system only */
 	qboolean loadgame;              /* client begins should reuse existing entity */
 
-	unsigned time;                  /* always sv.framenum * 100 msec */
+	unsigned time;                  /* sv.framenum * 100 msec at the end of a frame */
 	int framenum;
+	int tick;                       /* game ticks run of the current frame */
 
 	char name[MAX_QPATH];           /* map name, or cinematic name */
 	struct cmodel_s *models[MAX_MODELS];
@@ -98,6 +109,12 @@ typedef struct
 	int senttime;                           /* for ping calculations */
 } client_frame_t;
 
+typedef struct
+{
+	int offset;                         /* into svs.multicast_arena */
+	int length;
+} datagramref_t;
+
 typedef struct client_s
 {
 	client_state_t state;
@@ -116,6 +133,9 @@ typedef struct client_s
 	int message_size[RATE_MESSAGES];    /* used to rate drop packets */
 	int rate;
 	int surpressCount;                  /* number of messages rate supressed */
+	int budgetframes, budgetheld;       /* frames cut to the rate, entities held back */
+	byte entstale[MAX_EDICTS];          /* frames the entity was held back */
+	qboolean entsheld;                  /* entstale isn't all zero */
 
 	edict_t *edict;                     /* EDICT_NUM(clientnum+1) */
 	char name[32];                      /* extracted from userinfo, high bits masked */
@@ -126,6 +146,18 @@ typedef struct client_s
 	sizebuf_t datagram;
 	byte datagram_buf[MAX_MSGLEN];
 
+	/* multicasts sent after the datagram, copied
+	   when the message to the client is built */
+	datagramref_t datagramrefs[MAX_DATAGRAM_REFS];
+	int numdatagramrefs;
+	int datagramrefbytes;
+
+	/* the leaf the client is in for SV_Multicast,
+	   looked up again when it moved */
+	vec3_t leaforigin;
+	int leafspawncount;
+	int leafcluster, leafarea;
+
 	client_frame_t frames[UPDATE_BACKUP];     /* updates can be delta'd from here */
 
 	byte *download;                     /* file being downloaded */
@@ -136,10 +168,29 @@ typedef struct client_s
 	int lastconnect;
 
 	int challenge;                      /* challenge of this user, randomly generated */
+	int protocol;                       /* PROTOCOL_VERSION or PROTOCOL_PACKED */
 
 	netchan_t netchan;
+
+	struct client_s *hashnext;          /* next client in the svs.clienthash bucket */
 } client_t;
 
+/* scratch space of a client while its
+   frame is built by the worker threads */
+typedef struct
+{
+	client_t *client;
+	qboolean ingame;
+	vec3_t org;
+	int clientarea;
+	byte fatpvs[65536 / 8];
+	byte phs[65536 / 8];
+	int num_entities;
+	short entities[MAX_EDICTS];         /* visible edict numbers */
+	sizebuf_t msg;
+	byte msg_buf[MAX_MSGLEN];
+} client_snapshot_t;
+
 typedef struct
 {
 	netadr_t adr;
@@ -157,15 +208,25 @@ typedef struct
 	int spawncount;                     /* incremented each server start */
 										/* used to check late spawns */
 
+	int frameticks;                     /* game ticks per 100 msec frame */
+
 	client_t *clients;                  /* [maxclients->value]; */
 	int num_client_entities;            /* maxclients->value*UPDATE_BACKUP*MAX_PACKET_ENTITIES */
 	int next_client_entities;           /* next client_entity to use */
 	entity_state_t *client_entities;    /* [num_client_entities] */
 
+	client_t *clienthash[CLIENT_HASH_SIZE]; /* all non free clients by address and qport */
+
+	client_snapshot_t *snapshots;       /* [maxclients], allocated when sv_threads is set */
+
 	int last_heartbeat;
 
 	challenge_t challenges[MAX_CHALLENGES];    /* to prevent invalid IPs from connecting */
 
+	/* this frame's unreliable multicasts */
+	byte multicast_arena[MULTICAST_ARENA];
+	int multicast_arenasize;
+
 	/* serverrecord values */
 	FILE *demofile;
 	sizebuf_t demo_multicast;
@@ -186,6 +247,15 @@ extern cvar_t *sv_noreload;                 /* don't reload level state when ree
 extern cvar_t *sv_airaccelerate;            /* don't reload level state when reentering */
 											/* development tool */
 extern cvar_t *sv_enforcetime;
+extern cvar_t *sv_threads;
+extern cvar_t *sv_tickrate;
+extern cvar_t *sv_profile;
+extern cvar_t *sv_tracecache;
+extern cvar_t *sv_clipreject;
+extern cvar_t *sv_deltacache;
+extern cvar_t *sv_packedents;
+extern cvar_t *sv_fragments;
+extern cvar_t *sv_entbudget;
 
 extern client_t *sv_client;
 extern edict_t *sv_player;
@@ -193,6 +263,10 @@ extern edict_t *sv_player;
 void SV_FinalMessage(char *message, qboolean reconnect);
 void SV_DropClient(client_t *drop);
 
+void SV_HashClient(client_t *cl);
+void SV_UnhashClient(client_t *cl);
+client_t *SV_FindClient(netadr_t adr, int qport);
+
 int SV_ModelIndex(char *name);
 int SV_SoundIndex(char *name);
 int SV_ImageIndex(char *name);
@@ -223,6 +297,9 @@ void SV_DemoCompleted(void);
 void SV_SendClientMessages(void);
 
 void SV_Multicast(vec3_t origin, multicast_t to);
+int SV_StoreMulticast(void);
+void SV_WriteDatagram(client_t *client, int offset);
+int SV_DatagramSize(client_t *client);
 void SV_StartSound(vec3_t origin, edict_t *entity, int channel,
 		int soundindex, float volume, float attenuation,
 		float timeofs);
@@ -238,7 +315,34 @@ void SV_Status_f(void);
 
 void SV_WriteFrameToClient(client_t *client, sizebuf_t *msg);
 void SV_RecordDemoMessage(void);
+void SV_BuildVisibilityKeys(void);
 void SV_BuildClientFrame(client_t *client);
+void SV_SetupClientSnapshot(client_snapshot_t *snap);
+void SV_CollectClientSnapshot(client_snapshot_t *snap);
+void SV_ReserveClientSnapshot(client_snapshot_t *snap);
+void SV_WriteClientSnapshot(client_snapshot_t *snap);
+void SV_PVSBench_f(void);
+void SV_DeltaCache_f(void);
+void SV_EntBudget_f(void);
+
+/* sv_profile.c */
+typedef enum
+{
+	PROF_PACKETS,                   /* SV_ReadPackets */
+	PROF_GAME,                      /* ge->RunFrame */
+	PROF_TRACE,                     /* gi.trace, part of game */
+	PROF_FRAMES,                    /* building client frames, part of send */
+	PROF_SEND,                      /* SV_SendClientMessages and the flush */
+	PROF_DEMO,                      /* SV_RecordDemoMessage */
+	PROF_TOTAL,                     /* everything but sleeping */
+	PROF_NUM
+} profphase_t;
+
+void SV_InitProfile(void);
+long long SV_ProfileBegin(void);
+void SV_ProfileEnd(profphase_t phase, long long start);
+void SV_ProfileTick(void);
+void SV_Profile_f(void);
 
 void SV_Error(char *error, ...);
 
@@ -272,11 +376,20 @@ void SV_LinkEdict(edict_t *ent);
    the entity is not solid */
 int SV_AreaEdicts(vec3_t mins, vec3_t maxs, edict_t **list,
 		int maxcount, int areatype);
+void SV_AreaBench_f(void);
+void SV_TraceBench_f(void);
+void SV_FlushTraceCache(void);
+void SV_TraceCache_f(void);
+void SV_ClipStats_f(void);
 
 int SV_PointContents(vec3_t p);
 
 trace_t SV_Trace(vec3_t start, vec3_t mins, vec3_t maxs,
 		vec3_t end, edict_t *passedict, int contentmask);
+trace_t SV_CapsuleTrace(vec3_t start, vec3_t mins, vec3_t maxs,
+		vec3_t end, edict_t *passedict, int contentmask);
+void SV_TraceBatch(int count, vec3_t *starts, vec3_t *ends, vec3_t mins,
+		vec3_t maxs, edict_t *passedict, int contentmask, trace_t *traces);
 
 #endif
 
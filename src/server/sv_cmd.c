@@ -631,6 +631,14 @@ SV_InitOperatorCommands(void)
 
 	Cmd_AddCommand("serverrecord", SV_ServerRecord_f);
 	Cmd_AddCommand("serverstop", SV_ServerStop_f);
+	Cmd_AddCommand("pvsbench", SV_PVSBench_f);
+	Cmd_AddCommand("areabench", SV_AreaBench_f);
+	Cmd_AddCommand("tracebench", SV_TraceBench_f);
+	Cmd_AddCommand("tracecache", SV_TraceCache_f);
+	Cmd_AddCommand("clipstats", SV_ClipStats_f);
+	Cmd_AddCommand("deltacache", SV_DeltaCache_f);
+	Cmd_AddCommand("entbudget", SV_EntBudget_f);
+	Cmd_AddCommand("profile", SV_Profile_f);
 
 	Cmd_AddCommand("save", SV_Savegame_f);
 	Cmd_AddCommand("load", SV_Loadgame_f);
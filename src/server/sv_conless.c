@@ -138,9 +138,18 @@ SVC_GetChallenge(void)
 		i = oldest;
 	}
 
-	/* send it back */
-	Netchan_OutOfBandPrint(NS_SERVER, net_from, "challenge %i",
-			svs.challenges[i].challenge);
+	/* send it back, with the protocols we speak.
+	   Old clients only look at the number. */
+	if (sv_packedents->value)
+	{
+		Netchan_OutOfBandPrint(NS_SERVER, net_from, "challenge %i packedents",
+				svs.challenges[i].challenge);
+	}
+	else
+	{
+		Netchan_OutOfBandPrint(NS_SERVER, net_from, "challenge %i",
+				svs.challenges[i].challenge);
+	}
 }
 
 /*
@@ -166,7 +175,8 @@ SVC_DirectConnect(void)
 
 	version = (int)strtol(Cmd_Argv(1), (char **)NULL, 10);
 
-	if (version != PROTOCOL_VERSION)
+	if ((version != PROTOCOL_VERSION) &&
+		((version != PROTOCOL_PACKED) || !sv_packedents->value))
 	{
 		Netchan_OutOfBandPrint(NS_SERVER, adr,
 				"print\nServer is version %s.\n", YQ2VERSION);
@@ -270,6 +280,11 @@ SVC_DirectConnect(void)
 
 gotnewcl:
 
+	/* a reused slot may come back with a different
+	   address, it's hashed again once it's set up */
+	SV_UnhashClient(newcl);
+	Netchan_FreeFragments(&newcl->netchan);
+
 	/* build a new connection  accept the new client this
 	   is the only place a client_t is ever initialized */
 	*newcl = temp;
@@ -278,6 +293,7 @@ gotnewcl:
 	ent = EDICT_NUM(edictnum);
 	newcl->edict = ent;
 	newcl->challenge = challenge; /* save challenge for checksumming */
+	newcl->protocol = version;
 
 	/* get the game a chance to reject this connection or modify the userinfo */
 	if (!(ge->ClientConnect(ent, userinfo)))
@@ -302,12 +318,22 @@ gotnewcl:
 	Q_strlcpy(newcl->userinfo, userinfo, sizeof(newcl->userinfo));
 	SV_UserinfoChanged(newcl);
 
-	/* send the connect packet to the client */
-	Netchan_OutOfBandPrint(NS_SERVER, adr, "client_connect");
-
 	Netchan_Setup(NS_SERVER, &newcl->netchan, adr, qport);
 
+	/* newer clients ask for netchan fragments after the
+	   userinfo, the loopback can't take their bursts */
+	if (sv_fragments->value && !strcmp(Cmd_Argv(5), "fragments") &&
+		(adr.type != NA_LOOPBACK))
+	{
+		Netchan_EnableFragments(&newcl->netchan);
+	}
+
+	/* send the connect packet to the client */
+	Netchan_OutOfBandPrint(NS_SERVER, adr, newcl->netchan.fragments ?
+			"client_connect fragments" : "client_connect");
+
 	newcl->state = cs_connected;
+	SV_HashClient(newcl);
 
 	SZ_Init(&newcl->datagram, newcl->datagram_buf, sizeof(newcl->datagram_buf));
 	newcl->datagram.allowoverflow = true;
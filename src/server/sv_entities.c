@@ -30,11 +30,199 @@
 
 byte fatpvs[65536 / 8];
 
+/* view origins of the client frames since "pvsbench record",
+   replayed by pvsbench */
+#define PVS_CAPTURE 1024
+static vec3_t pvs_origins[PVS_CAPTURE];
+static int pvs_nextorigin, pvs_numorigins;
+static qboolean pvs_capture;
+
+/* visibility key of an entity that may be sent to the
+   clients, built once a frame by SV_BuildVisibilityKeys */
+typedef struct
+{
+	int number;
+	int areanum, areanum2;
+	int num_clusters;                   /* -1: go by headnode */
+	int headnode;
+	int firstcluster;                   /* in sv_visclusters */
+	qboolean beam;                      /* checks clusternums[0] in the PHS */
+	int beamcluster;
+	qboolean attenuated;                /* sounds only, not sent beyond 400 units */
+	vec3_t origin;
+} entvis_t;
+
+#define MAX_VIS_CLUSTERS (MAX_EDICTS * MAX_ENT_CLUSTERS * 2)
+#define MAX_HEADNODE_CLUSTERS 256
+
+static entvis_t sv_entvis[MAX_EDICTS];
+static int sv_numentvis;
+static int sv_visclusters[MAX_VIS_CLUSTERS];
+
+#define DELTACACHE_WAYS 4 /* deltas kept per entity */
+#define MAX_DELTA_BYTES 64 /* the longest entity delta is 48 bytes */
+
+/* an entity delta as MSG_WriteDeltaEntity or MSG_WritePackedDelta
+   encoded it, the clients that send the same states get it copied */
+typedef struct
+{
+	qboolean used;
+	qboolean force, newentity, packed;
+	entity_state_t from, to;
+	int length;                         /* bytes, or bits if packed */
+	byte data[MAX_DELTA_BYTES];
+} deltacache_t;
+
+cvar_t *sv_deltacache;
+
+static deltacache_t delta_cache[MAX_EDICTS][DELTACACHE_WAYS];
+static int delta_next[MAX_EDICTS]; /* way replaced next */
+static int delta_lookups, delta_hits;
+
+static void
+SV_EncodeDelta(deltacache_t *entry, entity_state_t *from,
+		entity_state_t *to, qboolean force, qboolean newentity,
+		qboolean packed)
+{
+	sizebuf_t buf;
+	bitbuf_t bb;
+
+	SZ_Init(&buf, entry->data, sizeof(entry->data));
+
+	if (packed)
+	{
+		MSG_BeginBits(&bb, &buf);
+		MSG_WritePackedDelta(&bb, from, to, force, newentity);
+		MSG_FlushBits(&bb);
+		entry->length = bb.count;
+	}
+	else
+	{
+		MSG_WriteDeltaEntity(from, to, &buf, force, newentity);
+		entry->length = buf.cursize;
+	}
+}
+
 /*
- * Writes a delta update of an entity_state_t list to the message.
+ * Returns the encoded delta, looked up by the entity number and
+ * both states first when cached is set. The encoding only depends
+ * on them and the flags, so entries never go stale. Without the
+ * cache the delta goes to scratch, that must be on the caller's
+ * stack for the worker threads.
+ */
+static deltacache_t *
+SV_Delta(deltacache_t *scratch, entity_state_t *from, entity_state_t *to,
+		qboolean force, qboolean newentity, qboolean packed, qboolean cached)
+{
+	deltacache_t *entry;
+	int i;
+
+	if (!cached || (to->number <= 0) || (to->number >= MAX_EDICTS))
+	{
+		SV_EncodeDelta(scratch, from, to, force, newentity, packed);
+		return scratch;
+	}
+
+	delta_lookups++;
+	entry = delta_cache[to->number];
+
+	for (i = 0; i < DELTACACHE_WAYS; i++, entry++)
+	{
+		if (entry->used && (entry->force == force) &&
+			(entry->newentity == newentity) && (entry->packed == packed) &&
+			!memcmp(&entry->to, to, sizeof(*to)) &&
+			!memcmp(&entry->from, from, sizeof(*from)))
+		{
+			delta_hits++;
+			return entry;
+		}
+	}
+
+	entry = &delta_cache[to->number][delta_next[to->number]];
+	delta_next[to->number] = (delta_next[to->number] + 1) % DELTACACHE_WAYS;
+
+	SV_EncodeDelta(entry, from, to, force, newentity, packed);
+
+	entry->used = true;
+	entry->force = force;
+	entry->newentity = newentity;
+	entry->packed = packed;
+	entry->from = *from;
+	entry->to = *to;
+
+	return entry;
+}
+
+/*
+ * MSG_WriteDeltaEntity through the delta cache
+ */
+static void
+SV_WriteDelta(entity_state_t *from, entity_state_t *to, sizebuf_t *msg,
+		qboolean force, qboolean newentity, qboolean cached)
+{
+	deltacache_t scratch, *entry;
+
+	if (!cached)
+	{
+		MSG_WriteDeltaEntity(from, to, msg, force, newentity);
+		return;
+	}
+
+	entry = SV_Delta(&scratch, from, to, force, newentity, false, true);
+
+	if (entry->length)
+	{
+		SZ_Write(msg, entry->data, entry->length);
+	}
+}
+
+/*
+ * The number and the delta of an entity in a packed
+ * list, if anything changed. Returns the last number.
  */
+static int
+SV_WritePackedEntity(bitbuf_t *bb, int last, entity_state_t *from,
+		entity_state_t *to, qboolean force, qboolean newentity,
+		qboolean cached)
+{
+	deltacache_t scratch, *entry;
+
+	entry = SV_Delta(&scratch, from, to, force, newentity, true, cached);
+
+	if (!entry->length)
+	{
+		return last;
+	}
+
+	MSG_WritePackedNumber(bb, last, to->number);
+	MSG_WriteBits(bb, 0, 1); /* not removed */
+	MSG_CopyBits(bb, entry->data, entry->length);
+
+	return to->number;
+}
+
 void
-SV_EmitPacketEntities(client_frame_t *from, client_frame_t *to, sizebuf_t *msg)
+SV_DeltaCache_f(void)
+{
+	if (!sv_deltacache->value)
+	{
+		Com_Printf("Set sv_deltacache 1 to share entity deltas between clients.\n");
+	}
+
+	Com_Printf("%i lookups, %i hits (%.1f%%)\n", delta_lookups, delta_hits,
+			delta_lookups ? 100.0f * delta_hits / delta_lookups : 0);
+
+	delta_lookups = delta_hits = 0;
+}
+
+/*
+ * Writes a delta update of an entity_state_t list to the message.
+ * With cached set the deltas come from the shared cache, that's
+ * only safe on the main thread.
+ */
+static void
+SV_EmitPacketEntities(client_frame_t *from, client_frame_t *to,
+		sizebuf_t *msg, qboolean cached)
 {
 	entity_state_t *oldent, *newent;
 	int oldindex, newindex;
@@ -94,8 +282,9 @@ SV_EmitPacketEntities(client_frame_t *from, client_frame_t *to, sizebuf_t *msg)
 			   being emited if the entity has not changed at all
 			   note that players are always 'newentities', this
 			   updates their oldorigin always and prevents warping */
-			MSG_WriteDeltaEntity(oldent, newent, msg,
-					false, newent->number <= maxclients->value);
+			SV_WriteDelta(oldent, newent, msg, false,
+					newent->number <= maxclients->value, cached);
+
 			oldindex++;
 			newindex++;
 			continue;
@@ -104,7 +293,9 @@ SV_EmitPacketEntities(client_frame_t *from, client_frame_t *to, sizebuf_t *msg)
 		if (newnum < oldnum)
 		{
 			/* this is a new entity, send it from the baseline */
-			MSG_WriteDeltaEntity(&sv.baselines[newnum], newent, msg, true, true);
+			SV_WriteDelta(&sv.baselines[newnum], newent, msg,
+					true, true, cached);
+
 			newindex++;
 			continue;
 		}
@@ -143,166 +334,546 @@ SV_EmitPacketEntities(client_frame_t *from, client_frame_t *to, sizebuf_t *msg)
 	MSG_WriteShort(msg, 0);
 }
 
-void
-SV_WritePlayerstateToClient(client_frame_t *from, client_frame_t *to,
-		sizebuf_t *msg)
+/*
+ * The PROTOCOL_PACKED variant of SV_EmitPacketEntities. The list
+ * is one bit stream: the gap to the last entity number, a bit set
+ * for removes and the packed delta of the others.
+ */
+static void
+SV_EmitPackedEntities(client_frame_t *from, client_frame_t *to,
+		sizebuf_t *msg, qboolean cached)
 {
-	int i;
-	int pflags;
-	player_state_t *ps, *ops;
-	player_state_t dummy;
-	int statbits;
+	entity_state_t *oldent, *newent;
+	int oldindex, newindex;
+	int oldnum, newnum;
+	int from_num_entities;
+	int last;
+	bitbuf_t bb;
 
-	ps = &to->ps;
+	MSG_WriteByte(msg, svc_packetentities);
+	MSG_BeginBits(&bb, msg);
 
-	if (!from)
-	{
-		memset(&dummy, 0, sizeof(dummy));
-		ops = &dummy;
-	}
-	else
-	{
-		ops = &from->ps;
-	}
+	from_num_entities = from ? from->num_entities : 0;
 
-	/* determine what needs to be sent */
-	pflags = 0;
+	newindex = 0;
+	oldindex = 0;
+	newent = NULL;
+	oldent = NULL;
+	last = 0;
 
-	if (ps->pmove.pm_type != ops->pmove.pm_type)
+	while (newindex < to->num_entities || oldindex < from_num_entities)
 	{
-		pflags |= PS_M_TYPE;
-	}
+		if (msg->cursize > MAX_MSGLEN - 150)
+		{
+			break;
+		}
 
-	if ((ps->pmove.origin[0] != ops->pmove.origin[0]) ||
-		(ps->pmove.origin[1] != ops->pmove.origin[1]) ||
-		(ps->pmove.origin[2] != ops->pmove.origin[2]))
-	{
-		pflags |= PS_M_ORIGIN;
-	}
+		if (newindex >= to->num_entities)
+		{
+			newnum = 9999;
+		}
+		else
+		{
+			newent = &svs.client_entities[(to->first_entity +
+					 newindex) % svs.num_client_entities];
+			newnum = newent->number;
+		}
 
-	if ((ps->pmove.velocity[0] != ops->pmove.velocity[0]) ||
-		(ps->pmove.velocity[1] != ops->pmove.velocity[1]) ||
-		(ps->pmove.velocity[2] != ops->pmove.velocity[2]))
-	{
-		pflags |= PS_M_VELOCITY;
-	}
+		if (oldindex >= from_num_entities)
+		{
+			oldnum = 9999;
+		}
+		else
+		{
+			oldent = &svs.client_entities[(from->first_entity +
+					 oldindex) % svs.num_client_entities];
+			oldnum = oldent->number;
+		}
 
-	if (ps->pmove.pm_time != ops->pmove.pm_time)
-	{
-		pflags |= PS_M_TIME;
+		if (newnum == oldnum)
+		{
+			/* unchanged entities aren't sent */
+			last = SV_WritePackedEntity(&bb, last, oldent, newent, false,
+					newent->number <= maxclients->value, cached);
+			oldindex++;
+			newindex++;
+		}
+		else if (newnum < oldnum)
+		{
+			/* this is a new entity, send it from the baseline */
+			last = SV_WritePackedEntity(&bb, last, &sv.baselines[newnum],
+					newent, true, true, cached);
+			newindex++;
+		}
+		else
+		{
+			/* the old entity isn't present in the new message */
+			MSG_WritePackedNumber(&bb, last, oldnum);
+			MSG_WriteBits(&bb, 1, 1);
+			last = oldnum;
+			oldindex++;
+		}
 	}
 
-	if (ps->pmove.pm_flags != ops->pmove.pm_flags)
-	{
-		pflags |= PS_M_FLAGS;
-	}
+	MSG_WritePackedNumber(&bb, last, 0);
+	MSG_FlushBits(&bb);
+}
 
-	if (ps->pmove.gravity != ops->pmove.gravity)
-	{
-		pflags |= PS_M_GRAVITY;
-	}
+/* an entity that changed since the
+   frame the client acknowledged */
+typedef struct
+{
+	int index;                          /* into the new frame */
+	entity_state_t *old;                /* NULL if new to the client */
+	int size;                           /* bytes of the delta */
+	float priority;
+} entbudget_t;
 
-	if ((ps->pmove.delta_angles[0] != ops->pmove.delta_angles[0]) ||
-		(ps->pmove.delta_angles[1] != ops->pmove.delta_angles[1]) ||
-		(ps->pmove.delta_angles[2] != ops->pmove.delta_angles[2]))
-	{
-		pflags |= PS_M_DELTA_ANGLES;
-	}
+cvar_t *sv_entbudget;
 
-	if ((ps->viewoffset[0] != ops->viewoffset[0]) ||
-		(ps->viewoffset[1] != ops->viewoffset[1]) ||
-		(ps->viewoffset[2] != ops->viewoffset[2]))
-	{
-		pflags |= PS_VIEWOFFSET;
-	}
+/*
+ * Bytes the next message to the client may have, the same
+ * window SV_RateDrop looks at. A message may use the room
+ * the last ones left, but at least its share of the rate.
+ */
+static int
+SV_MessageBudget(client_t *client)
+{
+	int total, budget;
+	int i;
 
-	if ((ps->viewangles[0] != ops->viewangles[0]) ||
-		(ps->viewangles[1] != ops->viewangles[1]) ||
-		(ps->viewangles[2] != ops->viewangles[2]))
+	if (client->netchan.remote_address.type == NA_LOOPBACK)
 	{
-		pflags |= PS_VIEWANGLES;
+		return MAX_MSGLEN - 150;
 	}
 
-	if ((ps->kick_angles[0] != ops->kick_angles[0]) ||
-		(ps->kick_angles[1] != ops->kick_angles[1]) ||
-		(ps->kick_angles[2] != ops->kick_angles[2]))
-	{
-		pflags |= PS_KICKANGLES;
-	}
+	total = 0;
 
-	if ((ps->blend[0] != ops->blend[0]) ||
-		(ps->blend[1] != ops->blend[1]) ||
-		(ps->blend[2] != ops->blend[2]) ||
-		(ps->blend[3] != ops->blend[3]))
+	for (i = 0; i < RATE_MESSAGES; i++)
 	{
-		pflags |= PS_BLEND;
+		/* this slot gets the message */
+		if (i != sv.framenum % RATE_MESSAGES)
+		{
+			total += client->message_size[i];
+		}
 	}
 
-	if (ps->fov != ops->fov)
-	{
-		pflags |= PS_FOV;
-	}
+	budget = client->rate - total;
 
-	if (ps->rdflags != ops->rdflags)
+	if (budget < client->rate / RATE_MESSAGES)
 	{
-		pflags |= PS_RDFLAGS;
+		budget = client->rate / RATE_MESSAGES;
 	}
 
-	if (ps->gunframe != ops->gunframe)
-	{
-		pflags |= PS_WEAPONFRAME;
-	}
+	return (budget < MAX_MSGLEN - 150) ? budget : MAX_MSGLEN - 150;
+}
 
-	pflags |= PS_WEAPONINDEX;
+/*
+ * Close entities, players, entities with an event or a sound
+ * and the ones held back for a while go first.
+ */
+static float
+SV_EntityPriority(entity_state_t *state, vec3_t org, int stale)
+{
+	vec3_t delta;
+	float priority;
 
-	/* write it */
-	MSG_WriteByte(msg, svc_playerinfo);
-	MSG_WriteShort(msg, pflags);
+	VectorSubtract(state->origin, org, delta);
+	priority = (1 + stale) / (1 + VectorLength(delta) / 512);
 
-	/* write the pmove_state_t */
-	if (pflags & PS_M_TYPE)
+	if (state->number <= maxclients->value)
 	{
-		MSG_WriteByte(msg, ps->pmove.pm_type);
+		priority *= 4;
 	}
 
-	if (pflags & PS_M_ORIGIN)
+	if (state->event)
 	{
-		MSG_WriteShort(msg, ps->pmove.origin[0]);
-		MSG_WriteShort(msg, ps->pmove.origin[1]);
-		MSG_WriteShort(msg, ps->pmove.origin[2]);
+		priority *= 4;
 	}
 
-	if (pflags & PS_M_VELOCITY)
+	if (state->sound || state->effects)
 	{
-		MSG_WriteShort(msg, ps->pmove.velocity[0]);
-		MSG_WriteShort(msg, ps->pmove.velocity[1]);
-		MSG_WriteShort(msg, ps->pmove.velocity[2]);
+		priority *= 2;
 	}
 
-	if (pflags & PS_M_TIME)
-	{
-		MSG_WriteByte(msg, ps->pmove.pm_time);
-	}
+	return priority;
+}
 
-	if (pflags & PS_M_FLAGS)
-	{
-		MSG_WriteByte(msg, ps->pmove.pm_flags);
-	}
+static int
+SV_EntityBudgetCompare(const void *a, const void *b)
+{
+	float pa, pb;
 
-	if (pflags & PS_M_GRAVITY)
-	{
-		MSG_WriteShort(msg, ps->pmove.gravity);
-	}
+	pa = ((const entbudget_t *)a)->priority;
+	pb = ((const entbudget_t *)b)->priority;
 
-	if (pflags & PS_M_DELTA_ANGLES)
+	return (pa > pb) ? -1 : (pa < pb);
+}
+
+/*
+ * Holds back the least important entity updates of the frame
+ * until the rest fits into budget bytes. A held back entity
+ * keeps the state the client has in the frame, or leaves it if
+ * the client doesn't know it yet, so the next frames send it
+ * as a delta from there. Returns the number held back.
+ */
+static int
+SV_BudgetFrame(client_t *client, client_frame_t *from, client_frame_t *to,
+		int budget, qboolean packed, qboolean cached)
+{
+	entbudget_t list[MAX_EDICTS];
+	byte held[MAX_EDICTS];
+	deltacache_t scratch, *entry;
+	entity_state_t *oldent, *newent, *state;
+	int oldindex, newindex, from_num_entities;
+	int oldnum, newnum;
+	int count, numheld, own;
+	int i, j;
+	vec3_t org;
+
+	for (i = 0; i < 3; i++)
 	{
-		MSG_WriteShort(msg, ps->pmove.delta_angles[0]);
-		MSG_WriteShort(msg, ps->pmove.delta_angles[1]);
-		MSG_WriteShort(msg, ps->pmove.delta_angles[2]);
+		org[i] = to->ps.pmove.origin[i] * 0.125f + to->ps.viewoffset[i];
 	}
 
-	/* write the rest of the player_state_t */
-	if (pflags & PS_VIEWOFFSET)
+	from_num_entities = from ? from->num_entities : 0;
+	own = NUM_FOR_EDICT(client->edict);
+
+	newindex = 0;
+	oldindex = 0;
+	newent = NULL;
+	oldent = NULL;
+	count = 0;
+
+	/* what every entity would cost */
+	while (newindex < to->num_entities || oldindex < from_num_entities)
+	{
+		if (newindex >= to->num_entities)
+		{
+			newnum = 9999;
+		}
+		else
+		{
+			newent = &svs.client_entities[(to->first_entity +
+					 newindex) % svs.num_client_entities];
+			newnum = newent->number;
+		}
+
+		if (oldindex >= from_num_entities)
+		{
+			oldnum = 9999;
+		}
+		else
+		{
+			oldent = &svs.client_entities[(from->first_entity +
+					 oldindex) % svs.num_client_entities];
+			oldnum = oldent->number;
+		}
+
+		if (newnum > oldnum)
+		{
+			/* removes are always sent */
+			budget -= 3;
+			oldindex++;
+			continue;
+		}
+
+		if (newnum == oldnum)
+		{
+			entry = SV_Delta(&scratch, oldent, newent, false,
+					newent->number <= maxclients->value, packed, cached);
+			list[count].old = oldent;
+			oldindex++;
+		}
+		else
+		{
+			entry = SV_Delta(&scratch, &sv.baselines[newnum], newent,
+					true, true, packed, cached);
+			list[count].old = NULL;
+		}
+
+		list[count].index = newindex++;
+		list[count].size = entry->length;
+
+		if (!list[count].size)
+		{
+			continue; /* unchanged */
+		}
+
+		if (packed)
+		{
+			/* with the number and the remove bit */
+			list[count].size = (list[count].size + 20) / 8;
+		}
+
+		/* the client's own entity always goes */
+		list[count].priority = (newnum == own) ? 1e30f :
+			SV_EntityPriority(newent, org, client->entstale[newnum]);
+		count++;
+	}
+
+	qsort(list, count, sizeof(list[0]), SV_EntityBudgetCompare);
+
+	memset(held, 0, to->num_entities);
+	numheld = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		state = &svs.client_entities[(to->first_entity +
+				 list[i].index) % svs.num_client_entities];
+
+		/* the first one goes even if nothing fits,
+		   the held back ones get to the top that way */
+		if ((list[i].size <= budget) || (state->number == own) || !i)
+		{
+			budget -= list[i].size;
+			client->entstale[state->number] = 0;
+			continue;
+		}
+
+		/* 1 keeps the old state, 2 drops it */
+		held[list[i].index] = list[i].old ? 1 : 2;
+		numheld++;
+
+		if (client->entstale[state->number] < 255)
+		{
+			client->entstale[state->number]++;
+		}
+
+		if (list[i].old)
+		{
+			/* what the client has after copying the old state */
+			*state = *list[i].old;
+			VectorCopy(state->origin, state->old_origin);
+			state->event = 0;
+		}
+	}
+
+	if (!numheld)
+	{
+		return 0;
+	}
+
+	/* drop the held back entities the client doesn't
+	   know yet, they are new again in the next frame */
+	for (i = 0, j = 0; i < to->num_entities; i++)
+	{
+		state = &svs.client_entities[(to->first_entity + i) %
+				svs.num_client_entities];
+
+		if (held[i] == 2)
+		{
+			continue;
+		}
+
+		if (i != j)
+		{
+			svs.client_entities[(to->first_entity + j) %
+				svs.num_client_entities] = *state;
+		}
+
+		j++;
+	}
+
+	to->num_entities = j;
+
+	return numheld;
+}
+
+void
+SV_EntBudget_f(void)
+{
+	client_t *cl;
+	int frames, held, stale;
+	int i, j;
+
+	if (!sv_entbudget->value)
+	{
+		Com_Printf("Set sv_entbudget 1 to fit the frames into the client rates.\n");
+	}
+
+	frames = held = stale = 0;
+
+	for (i = 0, cl = svs.clients; i < maxclients->value; i++, cl++)
+	{
+		frames += cl->budgetframes;
+		held += cl->budgetheld;
+		cl->budgetframes = cl->budgetheld = 0;
+
+		for (j = 0; j < MAX_EDICTS; j++)
+		{
+			if (cl->entstale[j] > stale)
+			{
+				stale = cl->entstale[j];
+			}
+		}
+	}
+
+	Com_Printf("%i frames cut, %i entities held back, longest for %i frames\n",
+			frames, held, stale);
+}
+
+
+void
+SV_WritePlayerstateToClient(client_frame_t *from, client_frame_t *to,
+		sizebuf_t *msg)
+{
+	int i;
+	int pflags;
+	player_state_t *ps, *ops;
+	player_state_t dummy;
+	int statbits;
+
+	ps = &to->ps;
+
+	if (!from)
+	{
+		memset(&dummy, 0, sizeof(dummy));
+		ops = &dummy;
+	}
+	else
+	{
+		ops = &from->ps;
+	}
+
+	/* determine what needs to be sent */
+	pflags = 0;
+
+	if (ps->pmove.pm_type != ops->pmove.pm_type)
+	{
+		pflags |= PS_M_TYPE;
+	}
+
+	if ((ps->pmove.origin[0] != ops->pmove.origin[0]) ||
+		(ps->pmove.origin[1] != ops->pmove.origin[1]) ||
+		(ps->pmove.origin[2] != ops->pmove.origin[2]))
+	{
+		pflags |= PS_M_ORIGIN;
+	}
+
+	if ((ps->pmove.velocity[0] != ops->pmove.velocity[0]) ||
+		(ps->pmove.velocity[1] != ops->pmove.velocity[1]) ||
+		(ps->pmove.velocity[2] != ops->pmove.velocity[2]))
+	{
+		pflags |= PS_M_VELOCITY;
+	}
+
+	if (ps->pmove.pm_time != ops->pmove.pm_time)
+	{
+		pflags |= PS_M_TIME;
+	}
+
+	if (ps->pmove.pm_flags != ops->pmove.pm_flags)
+	{
+		pflags |= PS_M_FLAGS;
+	}
+
+	if (ps->pmove.gravity != ops->pmove.gravity)
+	{
+		pflags |= PS_M_GRAVITY;
+	}
+
+	if ((ps->pmove.delta_angles[0] != ops->pmove.delta_angles[0]) ||
+		(ps->pmove.delta_angles[1] != ops->pmove.delta_angles[1]) ||
+		(ps->pmove.delta_angles[2] != ops->pmove.delta_angles[2]))
+	{
+		pflags |= PS_M_DELTA_ANGLES;
+	}
+
+	if ((ps->viewoffset[0] != ops->viewoffset[0]) ||
+		(ps->viewoffset[1] != ops->viewoffset[1]) ||
+		(ps->viewoffset[2] != ops->viewoffset[2]))
+	{
+		pflags |= PS_VIEWOFFSET;
+	}
+
+	if ((ps->viewangles[0] != ops->viewangles[0]) ||
+		(ps->viewangles[1] != ops->viewangles[1]) ||
+		(ps->viewangles[2] != ops->viewangles[2]))
+	{
+		pflags |= PS_VIEWANGLES;
+	}
+
+	if ((ps->kick_angles[0] != ops->kick_angles[0]) ||
+		(ps->kick_angles[1] != ops->kick_angles[1]) ||
+		(ps->kick_angles[2] != ops->kick_angles[2]))
+	{
+		pflags |= PS_KICKANGLES;
+	}
+
+	if ((ps->blend[0] != ops->blend[0]) ||
+		(ps->blend[1] != ops->blend[1]) ||
+		(ps->blend[2] != ops->blend[2]) ||
+		(ps->blend[3] != ops->blend[3]))
+	{
+		pflags |= PS_BLEND;
+	}
+
+	if (ps->fov != ops->fov)
+	{
+		pflags |= PS_FOV;
+	}
+
+	if (ps->rdflags != ops->rdflags)
+	{
+		pflags |= PS_RDFLAGS;
+	}
+
+	if (ps->gunframe != ops->gunframe)
+	{
+		pflags |= PS_WEAPONFRAME;
+	}
+
+	pflags |= PS_WEAPONINDEX;
+
+	/* write it */
+	MSG_WriteByte(msg, svc_playerinfo);
+	MSG_WriteShort(msg, pflags);
+
+	/* write the pmove_state_t */
+	if (pflags & PS_M_TYPE)
+	{
+		MSG_WriteByte(msg, ps->pmove.pm_type);
+	}
+
+	if (pflags & PS_M_ORIGIN)
+	{
+		MSG_WriteShort(msg, ps->pmove.origin[0]);
+		MSG_WriteShort(msg, ps->pmove.origin[1]);
+		MSG_WriteShort(msg, ps->pmove.origin[2]);
+	}
+
+	if (pflags & PS_M_VELOCITY)
+	{
+		MSG_WriteShort(msg, ps->pmove.velocity[0]);
+		MSG_WriteShort(msg, ps->pmove.velocity[1]);
+		MSG_WriteShort(msg, ps->pmove.velocity[2]);
+	}
+
+	if (pflags & PS_M_TIME)
+	{
+		MSG_WriteByte(msg, ps->pmove.pm_time);
+	}
+
+	if (pflags & PS_M_FLAGS)
+	{
+		MSG_WriteByte(msg, ps->pmove.pm_flags);
+	}
+
+	if (pflags & PS_M_GRAVITY)
+	{
+		MSG_WriteShort(msg, ps->pmove.gravity);
+	}
+
+	if (pflags & PS_M_DELTA_ANGLES)
+	{
+		MSG_WriteShort(msg, ps->pmove.delta_angles[0]);
+		MSG_WriteShort(msg, ps->pmove.delta_angles[1]);
+		MSG_WriteShort(msg, ps->pmove.delta_angles[2]);
+	}
+
+	/* write the rest of the player_state_t */
+	if (pflags & PS_VIEWOFFSET)
 	{
 		MSG_WriteChar(msg, ps->viewoffset[0] * 4);
 		MSG_WriteChar(msg, ps->viewoffset[1] * 4);
@@ -364,125 +935,388 @@ SV_WritePlayerstateToClient(client_frame_t *from, client_frame_t *to,
 	{
 		if (ps->stats[i] != ops->stats[i])
 		{
-			statbits |= 1 << i;
+			statbits |= 1 << i;
+		}
+	}
+
+	MSG_WriteLong(msg, statbits);
+
+	for (i = 0; i < MAX_STATS; i++)
+	{
+		if (statbits & (1 << i))
+		{
+			MSG_WriteShort(msg, ps->stats[i]);
+		}
+	}
+}
+
+static void
+SV_EmitEntities(client_t *client, client_frame_t *from, client_frame_t *to,
+		sizebuf_t *msg, qboolean cached)
+{
+	if (client->protocol == PROTOCOL_PACKED)
+	{
+		SV_EmitPackedEntities(from, to, msg, cached);
+	}
+	else
+	{
+		SV_EmitPacketEntities(from, to, msg, cached);
+	}
+}
+
+/*
+ * Frames that don't fit into the client's rate go out with the
+ * less important entities held back, see SV_BudgetFrame.
+ */
+static void
+SV_WriteFrame(client_t *client, sizebuf_t *msg, qboolean cached)
+{
+	client_frame_t *frame, *oldframe;
+	int lastframe;
+	int start, budget, held;
+
+	/* this is the frame we are creating */
+	frame = &client->frames[sv.framenum & UPDATE_MASK];
+
+	if (client->lastframe <= 0)
+	{
+		/* client is asking for a retransmit */
+		oldframe = NULL;
+		lastframe = -1;
+	}
+	else if (sv.framenum - client->lastframe >= (UPDATE_BACKUP - 3))
+	{
+		/* client hasn't gotten a good message through in a long time */
+		oldframe = NULL;
+		lastframe = -1;
+	}
+	else
+	{
+		/* we have a valid message to delta from */
+		oldframe = &client->frames[client->lastframe & UPDATE_MASK];
+		lastframe = client->lastframe;
+	}
+
+	MSG_WriteByte(msg, svc_frame);
+	MSG_WriteLong(msg, sv.framenum);
+	MSG_WriteLong(msg, lastframe); /* what we are delta'ing from */
+	MSG_WriteByte(msg, client->surpressCount); /* rate dropped packets */
+	client->surpressCount = 0;
+
+	/* send over the areabits */
+	MSG_WriteByte(msg, frame->areabytes);
+	SZ_Write(msg, frame->areabits, frame->areabytes);
+
+	/* delta encode the playerstate */
+	SV_WritePlayerstateToClient(oldframe, frame, msg);
+
+	/* delta encode the entities */
+	start = msg->cursize;
+	SV_EmitEntities(client, oldframe, frame, msg, cached);
+
+	if (!sv_entbudget->value || msg->overflowed)
+	{
+		return;
+	}
+
+	/* the datagram goes into the message as well */
+	budget = SV_MessageBudget(client) - SV_DatagramSize(client);
+
+	if (msg->cursize <= budget)
+	{
+		/* everything went out */
+		if (client->entsheld)
+		{
+			memset(client->entstale, 0, sizeof(client->entstale));
+			client->entsheld = false;
+		}
+
+		return;
+	}
+
+	held = SV_BudgetFrame(client, oldframe, frame, budget - start,
+			client->protocol == PROTOCOL_PACKED, cached);
+
+	if (held)
+	{
+		client->budgetframes++;
+		client->budgetheld += held;
+		client->entsheld = true;
+
+		msg->cursize = start;
+		SV_EmitEntities(client, oldframe, frame, msg, cached);
+	}
+}
+
+void
+SV_WriteFrameToClient(client_t *client, sizebuf_t *msg)
+{
+	SV_WriteFrame(client, msg, sv_deltacache->value != 0);
+}
+
+/*
+ * The client will interpolate the view position,
+ * so we can't use a single PVS point
+ */
+void
+SV_FatPVS(vec3_t org, byte *pvs)
+{
+	int leafs[64];
+	int i, j, count;
+	int bytes;
+	int cluster;
+	vec3_t mins, maxs;
+
+	for (i = 0; i < 3; i++)
+	{
+		mins[i] = org[i] - 8;
+		maxs[i] = org[i] + 8;
+	}
+
+	count = CM_BoxLeafnums(mins, maxs, leafs, 64, NULL);
+
+	if (count < 1)
+	{
+		Com_Error(ERR_FATAL, "SV_FatPVS: count < 1");
+	}
+
+	bytes = ((CM_NumClusters() + 31) >> 5) << 2;
+
+	/* convert leafs to clusters, sorted so
+	   that duplicates are next to each other */
+	for (i = 0; i < count; i++)
+	{
+		cluster = CM_LeafCluster(leafs[i]);
+
+		for (j = i; (j > 0) && (leafs[j - 1] > cluster); j--)
+		{
+			leafs[j] = leafs[j - 1];
+		}
+
+		leafs[j] = cluster;
+	}
+
+	memcpy(pvs, CM_ClusterPVS(leafs[0]), bytes);
+
+	/* or in all the other leaf bits */
+	for (i = 1; i < count; i++)
+	{
+		if (leafs[i] == leafs[i - 1])
+		{
+			continue; /* already have the cluster we want */
+		}
+
+		Bits_Or(pvs, CM_ClusterPVS(leafs[i]), bytes);
+	}
+}
+
+/*
+ * Returns true if the entity has something to send at all
+ */
+static qboolean
+SV_EntityRelevant(edict_t *ent)
+{
+	/* ignore ents without visible models */
+	if (ent->svflags & SVF_NOCLIENT)
+	{
+		return false;
+	}
+
+	/* ignore ents without visible models unless they have an effect */
+	if (!ent->s.modelindex && !ent->s.effects &&
+		!ent->s.sound && !ent->s.event)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Packs everything the clients need to decide whether an
+ * entity is visible into the dense sv_entvis array, so the
+ * per client loops don't have to chase edicts. Entities that
+ * touch too many leafs get their headnode's clusters listed
+ * once here, instead of every client walking the headnode.
+ */
+void
+SV_BuildVisibilityKeys(void)
+{
+	int e;
+	int numclusters;
+	int maxclusters;
+	edict_t *ent;
+	entvis_t *vis;
+
+	sv_numentvis = 0;
+	numclusters = 0;
+
+	for (e = 1; e < ge->num_edicts; e++)
+	{
+		ent = EDICT_NUM(e);
+
+		if (!SV_EntityRelevant(ent))
+		{
+			continue;
+		}
+
+		if (ent->s.number != e)
+		{
+			Com_DPrintf("FIXING ENT->S.NUMBER!!!\n");
+			ent->s.number = e;
+		}
+
+		vis = &sv_entvis[sv_numentvis++];
+
+		vis->number = e;
+		vis->areanum = ent->areanum;
+		vis->areanum2 = ent->areanum2;
+		vis->headnode = ent->headnode;
+		vis->beam = (ent->s.renderfx & RF_BEAM) != 0;
+		vis->beamcluster = ent->clusternums[0];
+		vis->attenuated = !ent->s.modelindex;
+		VectorCopy(ent->s.origin, vis->origin);
+		vis->firstcluster = numclusters;
+
+		if (ent->num_clusters == -1)
+		{
+			maxclusters = MAX_VIS_CLUSTERS - numclusters;
+
+			if (maxclusters > MAX_HEADNODE_CLUSTERS)
+			{
+				maxclusters = MAX_HEADNODE_CLUSTERS;
+			}
+
+			/* stays -1 if there are too many */
+			vis->num_clusters = CM_HeadnodeClusters(ent->headnode,
+					sv_visclusters + numclusters, maxclusters);
+		}
+		else if (numclusters + ent->num_clusters <= MAX_VIS_CLUSTERS)
+		{
+			memcpy(sv_visclusters + numclusters, ent->clusternums,
+					ent->num_clusters * sizeof(int));
+			vis->num_clusters = ent->num_clusters;
+		}
+		else
+		{
+			/* no room left, walk the headnode instead */
+			vis->num_clusters = -1;
 		}
-	}
-
-	MSG_WriteLong(msg, statbits);
 
-	for (i = 0; i < MAX_STATS; i++)
-	{
-		if (statbits & (1 << i))
+		if (vis->num_clusters > 0)
 		{
-			MSG_WriteShort(msg, ps->stats[i]);
+			numclusters += vis->num_clusters;
 		}
 	}
 }
 
-void
-SV_WriteFrameToClient(client_t *client, sizebuf_t *msg)
+/*
+ * Decides if an entity is going to be visible to the client
+ * at org. Only reads the world, so it's safe to call from
+ * the workers.
+ */
+static qboolean
+SV_EntityVisible(entvis_t *vis, int clientnum, vec3_t org,
+		int clientarea, byte *pvs, byte *phs)
 {
-	client_frame_t *frame, *oldframe;
-	int lastframe;
+	int l;
 
-	/* this is the frame we are creating */
-	frame = &client->frames[sv.framenum & UPDATE_MASK];
+	if (vis->number == clientnum)
+	{
+		return true;
+	}
 
-	if (client->lastframe <= 0)
+	/* check area */
+	if (!CM_AreasConnected(clientarea, vis->areanum))
 	{
-		/* client is asking for a retransmit */
-		oldframe = NULL;
-		lastframe = -1;
+		/* doors can legally straddle two areas,
+		   so we may need to check another one */
+		if (!vis->areanum2 ||
+			!CM_AreasConnected(clientarea, vis->areanum2))
+		{
+			return false; /* blocked by a door */
+		}
 	}
-	else if (sv.framenum - client->lastframe >= (UPDATE_BACKUP - 3))
+
+	/* beams just check one point for PHS */
+	if (vis->beam)
 	{
-		/* client hasn't gotten a good message through in a long time */
-		oldframe = NULL;
-		lastframe = -1;
+		l = vis->beamcluster;
+
+		return (phs[l >> 3] & (1 << (l & 7))) != 0;
+	}
+
+	if (vis->num_clusters == -1)
+	{
+		/* too many leafs for individual check, go by headnode */
+		if (!CM_HeadnodeVisible(vis->headnode, pvs))
+		{
+			return false;
+		}
 	}
 	else
 	{
-		/* we have a valid message to delta from */
-		oldframe = &client->frames[client->lastframe & UPDATE_MASK];
-		lastframe = client->lastframe;
+		/* check individual leafs */
+		if (!Bits_TestAny(pvs, sv_visclusters + vis->firstcluster,
+					vis->num_clusters))
+		{
+			return false; /* not visible */
+		}
 	}
 
-	MSG_WriteByte(msg, svc_frame);
-	MSG_WriteLong(msg, sv.framenum);
-	MSG_WriteLong(msg, lastframe); /* what we are delta'ing from */
-	MSG_WriteByte(msg, client->surpressCount); /* rate dropped packets */
-	client->surpressCount = 0;
+	if (vis->attenuated)
+	{
+		/* don't send sounds if they
+		   will be attenuated away */
+		vec3_t delta;
+		float len;
 
-	/* send over the areabits */
-	MSG_WriteByte(msg, frame->areabytes);
-	SZ_Write(msg, frame->areabits, frame->areabytes);
+		VectorSubtract(org, vis->origin, delta);
+		len = VectorLength(delta);
 
-	/* delta encode the playerstate */
-	SV_WritePlayerstateToClient(oldframe, frame, msg);
+		if (len > 400)
+		{
+			return false;
+		}
+	}
 
-	/* delta encode the entities */
-	SV_EmitPacketEntities(oldframe, frame, msg);
+	/* the game may have run since the keys were built,
+	   when an overflowed client was dropped */
+	return SV_EntityRelevant(EDICT_NUM(vis->number));
 }
 
 /*
- * The client will interpolate the view position,
- * so we can't use a single PVS point
+ * Finds the client's view origin and area.
+ * Returns the leaf the view origin is in.
  */
-void
-SV_FatPVS(vec3_t org)
+static int
+SV_ClientViewpoint(edict_t *clent, vec3_t org, int *clientarea)
 {
-	int leafs[64];
-	int i, j, count;
-	int longs;
-	byte *src;
-	vec3_t mins, maxs;
+	int i;
+	int leafnum;
 
 	for (i = 0; i < 3; i++)
 	{
-		mins[i] = org[i] - 8;
-		maxs[i] = org[i] + 8;
-	}
-
-	count = CM_BoxLeafnums(mins, maxs, leafs, 64, NULL);
-
-	if (count < 1)
-	{
-		Com_Error(ERR_FATAL, "SV_FatPVS: count < 1");
-	}
-
-	longs = (CM_NumClusters() + 31) >> 5;
-
-	/* convert leafs to clusters */
-	for (i = 0; i < count; i++)
-	{
-		leafs[i] = CM_LeafCluster(leafs[i]);
+		org[i] = clent->client->ps.pmove.origin[i] * 0.125 +
+				 clent->client->ps.viewoffset[i];
 	}
 
-	memcpy(fatpvs, CM_ClusterPVS(leafs[0]), longs << 2);
-
-	/* or in all the other leaf bits */
-	for (i = 1; i < count; i++)
+	/* only called from the main thread */
+	if (pvs_capture)
 	{
-		for (j = 0; j < i; j++)
-		{
-			if (leafs[i] == leafs[j])
-			{
-				break;
-			}
-		}
+		VectorCopy(org, pvs_origins[pvs_nextorigin]);
+		pvs_nextorigin = (pvs_nextorigin + 1) % PVS_CAPTURE;
 
-		if (j != i)
+		if (pvs_numorigins < PVS_CAPTURE)
 		{
-			continue; /* already have the cluster we want */
+			pvs_numorigins++;
 		}
+	}
 
-		src = CM_ClusterPVS(leafs[i]);
+	leafnum = CM_PointLeafnum(org);
+	*clientarea = CM_LeafArea(leafnum);
 
-		for (j = 0; j < longs; j++)
-		{
-			((long *)fatpvs)[j] |= ((long *)src)[j];
-		}
-	}
+	return leafnum;
 }
 
 /*
@@ -492,18 +1326,16 @@ SV_FatPVS(vec3_t org)
 void
 SV_BuildClientFrame(client_t *client)
 {
-	int e, i;
+	int k;
 	vec3_t org;
 	edict_t *ent;
 	edict_t *clent;
 	client_frame_t *frame;
 	entity_state_t *state;
-	int l;
+	int clientnum;
 	int clientarea, clientcluster;
 	int leafnum;
-	int c_fullsend;
 	byte *clientphs;
-	byte *bitvector;
 
 	clent = client->edict;
 
@@ -518,14 +1350,7 @@ SV_BuildClientFrame(client_t *client)
 	frame->senttime = svs.realtime; /* save it for ping calc later */
 
 	/* find the client's PVS */
-	for (i = 0; i < 3; i++)
-	{
-		org[i] = clent->client->ps.pmove.origin[i] * 0.125 +
-				 clent->client->ps.viewoffset[i];
-	}
-
-	leafnum = CM_PointLeafnum(org);
-	clientarea = CM_LeafArea(leafnum);
+	leafnum = SV_ClientViewpoint(clent, org, &clientarea);
 	clientcluster = CM_LeafCluster(leafnum);
 
 	/* calculate the visible areas */
@@ -534,129 +1359,250 @@ SV_BuildClientFrame(client_t *client)
 	/* grab the current player_state_t */
 	frame->ps = clent->client->ps;
 
-	SV_FatPVS(org);
+	SV_FatPVS(org, fatpvs);
 	clientphs = CM_ClusterPHS(clientcluster);
 
 	/* build up the list of visible entities */
 	frame->num_entities = 0;
 	frame->first_entity = svs.next_client_entities;
 
-	c_fullsend = 0;
+	clientnum = NUM_FOR_EDICT(clent);
 
-	for (e = 1; e < ge->num_edicts; e++)
+	for (k = 0; k < sv_numentvis; k++)
 	{
-		ent = EDICT_NUM(e);
-
-		/* ignore ents without visible models */
-		if (ent->svflags & SVF_NOCLIENT)
+		if (!SV_EntityVisible(&sv_entvis[k], clientnum, org, clientarea,
+					fatpvs, clientphs))
 		{
 			continue;
 		}
 
-		/* ignore ents without visible models unless they have an effect */
-		if (!ent->s.modelindex && !ent->s.effects && 
-			!ent->s.sound && !ent->s.event)
+		ent = EDICT_NUM(sv_entvis[k].number);
+
+		/* add it to the circular client_entities array */
+		state = &svs.client_entities[svs.next_client_entities %
+				svs.num_client_entities];
+
+		*state = ent->s;
+
+		/* don't mark players missiles as solid */
+		if (ent->owner == client->edict)
 		{
-			continue;
+			state->solid = 0;
 		}
 
-		/* ignore if not touching a PV leaf */
-		if (ent != clent)
-		{
-			/* check area */
-			if (!CM_AreasConnected(clientarea, ent->areanum))
-			{
-				/* doors can legally straddle two areas,
-				   so we may need to check another one */
-				if (!ent->areanum2 ||
-					!CM_AreasConnected(clientarea, ent->areanum2))
-				{
-					continue; /* blocked by a door */
-				}
-			}
+		svs.next_client_entities++;
+		frame->num_entities++;
+	}
+}
 
-			/* beams just check one point for PHS */
-			if (ent->s.renderfx & RF_BEAM)
-			{
-				l = ent->clusternums[0];
+/*
+ * The threaded variant of SV_BuildClientFrame and SV_WriteFrameToClient
+ * is split into steps. SV_SetupClientSnapshot and SV_ReserveClientSnapshot
+ * use the collision model and svs, they must run in the main thread.
+ * SV_CollectClientSnapshot and SV_WriteClientSnapshot only touch the
+ * snapshot, the client and the slice of svs.client_entities reserved
+ * for it, so all clients can run them in parallel.
+ */
+void
+SV_SetupClientSnapshot(client_snapshot_t *snap)
+{
+	client_t *client;
+	edict_t *clent;
+	client_frame_t *frame;
+	int leafnum;
 
-				if (!(clientphs[l >> 3] & (1 << (l & 7))))
-				{
-					continue;
-				}
-			}
-			else
-			{
-				bitvector = fatpvs;
+	client = snap->client;
+	clent = client->edict;
 
-				if (ent->num_clusters == -1)
-				{
-					/* too many leafs for individual check, go by headnode */
-					if (!CM_HeadnodeVisible(ent->headnode, bitvector))
-					{
-						continue;
-					}
+	snap->num_entities = 0;
+	snap->ingame = (clent->client != NULL);
 
-					c_fullsend++;
-				}
-				else
-				{
-					/* check individual leafs */
-					for (i = 0; i < ent->num_clusters; i++)
-					{
-						l = ent->clusternums[i];
+	if (!snap->ingame)
+	{
+		return; /* not in game yet */
+	}
 
-						if (bitvector[l >> 3] & (1 << (l & 7)))
-						{
-							break;
-						}
-					}
+	frame = &client->frames[sv.framenum & UPDATE_MASK];
+	frame->senttime = svs.realtime;
 
-					if (i == ent->num_clusters)
-					{
-						continue; /* not visible */
-					}
-				}
+	leafnum = SV_ClientViewpoint(clent, snap->org, &snap->clientarea);
 
-				if (!ent->s.modelindex)
-				{
-					/* don't send sounds if they 
-					   will be attenuated away */
-					vec3_t delta;
-					float len;
+	frame->areabytes = CM_WriteAreaBits(frame->areabits, snap->clientarea);
+	frame->ps = clent->client->ps;
 
-					VectorSubtract(org, ent->s.origin, delta);
-					len = VectorLength(delta);
+	/* both rows are copied, the collision
+	   model returns them in static buffers */
+	SV_FatPVS(snap->org, snap->fatpvs);
+	memcpy(snap->phs, CM_ClusterPHS(CM_LeafCluster(leafnum)),
+			(CM_NumClusters() + 7) >> 3);
+}
 
-					if (len > 400)
-					{
-						continue;
-					}
-				}
-			}
+void
+SV_CollectClientSnapshot(client_snapshot_t *snap)
+{
+	int k;
+	int clientnum;
+
+	if (!snap->ingame)
+	{
+		return;
+	}
+
+	clientnum = NUM_FOR_EDICT(snap->client->edict);
+
+	for (k = 0; k < sv_numentvis; k++)
+	{
+		if (SV_EntityVisible(&sv_entvis[k], clientnum, snap->org,
+					snap->clientarea, snap->fatpvs, snap->phs))
+		{
+			snap->entities[snap->num_entities++] = sv_entvis[k].number;
 		}
+	}
+}
 
-		/* add it to the circular client_entities array */
-		state = &svs.client_entities[svs.next_client_entities %
-				svs.num_client_entities];
+/*
+ * Hands out the client's slice of svs.client_entities. The
+ * clients must be reserved in the same order as the serial
+ * SV_BuildClientFrame would have filled them.
+ */
+void
+SV_ReserveClientSnapshot(client_snapshot_t *snap)
+{
+	client_frame_t *frame;
 
-		if (ent->s.number != e)
+	if (!snap->ingame)
+	{
+		return;
+	}
+
+	frame = &snap->client->frames[sv.framenum & UPDATE_MASK];
+	frame->first_entity = svs.next_client_entities;
+	frame->num_entities = snap->num_entities;
+
+	svs.next_client_entities += snap->num_entities;
+}
+
+void
+SV_WriteClientSnapshot(client_snapshot_t *snap)
+{
+	client_t *client;
+	client_frame_t *frame;
+	entity_state_t *state;
+	edict_t *ent;
+	int i;
+
+	client = snap->client;
+
+	if (snap->ingame)
+	{
+		frame = &client->frames[sv.framenum & UPDATE_MASK];
+
+		for (i = 0; i < snap->num_entities; i++)
 		{
-			Com_DPrintf("FIXING ENT->S.NUMBER!!!\n");
-			ent->s.number = e;
+			ent = EDICT_NUM(snap->entities[i]);
+			state = &svs.client_entities[(frame->first_entity + i) %
+					svs.num_client_entities];
+
+			*state = ent->s;
+
+			/* don't mark players missiles as solid */
+			if (ent->owner == client->edict)
+			{
+				state->solid = 0;
+			}
 		}
+	}
 
-		*state = ent->s;
+	SZ_Init(&snap->msg, snap->msg_buf, sizeof(snap->msg_buf));
+	snap->msg.allowoverflow = true;
 
-		/* don't mark players missiles as solid */
-		if (ent->owner == client->edict)
+	/* the workers don't share the delta cache */
+	SV_WriteFrame(client, &snap->msg, false);
+}
+
+/*
+ * pvsbench record
+ * pvsbench [rounds]
+ *
+ * The first form starts capturing the client view origins.
+ * The second one stops that and replays them against the
+ * current map, building the fat PVS and testing every
+ * edict's clusters, once with the scalar bit vector
+ * code and once with the vector one.
+ */
+void
+SV_PVSBench_f(void)
+{
+	int rounds;
+	int simd;
+	int r, i, e;
+	int visible;
+	int start, msec;
+	edict_t *ent;
+
+	if (sv.state != ss_game)
+	{
+		Com_Printf("No map loaded.\n");
+		return;
+	}
+
+	if ((Cmd_Argc() > 1) && !strcmp(Cmd_Argv(1), "record"))
+	{
+		pvs_nextorigin = pvs_numorigins = 0;
+		pvs_capture = true;
+		Com_Printf("Capturing client origins, run pvsbench to replay them.\n");
+		return;
+	}
+
+	pvs_capture = false;
+
+	if (!pvs_numorigins)
+	{
+		Com_Printf("No client origins captured, run pvsbench record first.\n");
+		return;
+	}
+
+	rounds = (Cmd_Argc() > 1) ? (int)strtol(Cmd_Argv(1), NULL, 10) : 100;
+
+	if (rounds < 1)
+	{
+		rounds = 1;
+	}
+
+	for (simd = 0; simd < 2; simd++)
+	{
+		Bits_UseSIMD(simd);
+
+		visible = 0;
+		start = Sys_Milliseconds();
+
+		for (r = 0; r < rounds; r++)
 		{
-			state->solid = 0;
+			for (i = 0; i < pvs_numorigins; i++)
+			{
+				SV_FatPVS(pvs_origins[i], fatpvs);
+
+				for (e = 1; e < ge->num_edicts; e++)
+				{
+					ent = EDICT_NUM(e);
+
+					if ((ent->num_clusters > 0) &&
+						Bits_TestAny(fatpvs, ent->clusternums, ent->num_clusters))
+					{
+						visible++;
+					}
+				}
+			}
 		}
 
-		svs.next_client_entities++;
-		frame->num_entities++;
+		msec = Sys_Milliseconds() - start;
+
+		Com_Printf("%-6s: %i origins x %i rounds, %i ms, %.2f usec per origin, %i visible\n",
+				Bits_Implementation(), pvs_numorigins, rounds, msec,
+				msec * 1000.0f / ((float)pvs_numorigins * rounds), visible);
 	}
+
+	Bits_UseSIMD(true);
 }
 
 /*
@@ -62,7 +62,7 @@ PF_Unicast(edict_t *ent, qboolean reliable)
 	}
 	else
 	{
-		SZ_Write(&client->datagram, sv.multicast.data, sv.multicast.cursize);
+		SV_WriteDatagram(client, SV_StoreMulticast());
 	}
 
 	SZ_Clear(&sv.multicast);
@@ -442,6 +442,15 @@ SV_InitGameProgs(void)
 	import.SetAreaPortalState = CM_SetAreaPortalState;
 	import.AreasConnected = CM_AreasConnected;
 
+	/* older servers don't have the batch trace,
+	   the game only uses it if sv_tracebatch is set */
+	import.tracebatch = SV_TraceBatch;
+	Cvar_Get("sv_tracebatch", "1", CVAR_NOSET);
+
+	/* the same for the capsule trace and sv_capsuletrace */
+	import.capsuletrace = SV_CapsuleTrace;
+	Cvar_Get("sv_capsuletrace", "1", CVAR_NOSET);
+
 	ge = (game_export_t *)Sys_GetGameAPI(&import);
 
 	if (!ge)
@@ -164,7 +164,7 @@ SV_CheckForSavegame(void)
 		previousState = sv.state;
 		sv.state = ss_loading;
 
-		for (i = 0; i < 100; i++)
+		for (i = 0; i < 100 * svs.frameticks; i++)
 		{
 			ge->RunFrame();
 		}
@@ -277,8 +277,10 @@ SV_SpawnServer(char *server, char *spawnpoint, server_state_t serverstate,
 	ge->SpawnEntities(sv.name, CM_EntityString(), spawnpoint);
 
 	/* run two frames to allow everything to settle */
-	ge->RunFrame();
-	ge->RunFrame();
+	for (i = 0; i < 2 * svs.frameticks; i++)
+	{
+		ge->RunFrame();
+	}
 
 	/* verify game didn't clobber important stuff */
 	if ((int)checksum !=
@@ -388,9 +390,26 @@ SV_InitGame(void)
 	Com_sprintf(idmaster, sizeof(idmaster), "192.246.40.37:%i", PORT_MASTER);
 	NET_StringToAdr(idmaster, &master_adr[0]);
 
-	/* init game */
+	/* init game, it sets g_tickrate if it
+	   can run its physics at sv_tickrate */
+	Cvar_ForceSet("g_tickrate", "10");
 	SV_InitGameProgs();
 
+	svs.frameticks = (int)Cvar_VariableValue("g_tickrate") / 10;
+	svs.frameticks = (svs.frameticks < 1) ? 1 : ((svs.frameticks > 6) ? 6 : svs.frameticks);
+
+	if (svs.frameticks * 10 != (int)sv_tickrate->value)
+	{
+		Com_Printf("sv_tickrate %i not supported, running at %i Hz.\n",
+				(int)sv_tickrate->value, svs.frameticks * 10);
+	}
+
+	if (svs.frameticks > 1)
+	{
+		Com_Printf("Game runs at %i Hz, clients still get 10 snapshots per second.\n",
+				svs.frameticks * 10);
+	}
+
 	for (i = 0; i < maxclients->value; i++)
 	{
 		ent = EDICT_NUM(i + 1);
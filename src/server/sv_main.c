@@ -35,6 +35,16 @@ client_t *sv_client; /* current client */
 cvar_t *sv_paused;
 cvar_t *sv_timedemo;
 cvar_t *sv_enforcetime;
+cvar_t *sv_threads; /* worker threads building client frames */
+/* game ticks per second. Only the physics get finer, the
+   clients still get 10 snapshots per second, so the latency
+   they see doesn't change. */
+cvar_t *sv_tickrate;
+cvar_t *sv_showlateness; /* print how late the frames run */
+cvar_t *sv_packedents; /* offer PROTOCOL_PACKED to the clients */
+cvar_t *sv_fragments; /* allow reliable messages in several packets */
+
+static int sv_latecount, sv_latesum, sv_latemax, sv_lateticks;
 cvar_t *timeout; /* seconds without any message */
 cvar_t *zombietime; /* seconds to sink messages after disconnect */
 cvar_t *rcon_password; /* password for remote server commands */
@@ -50,6 +60,11 @@ cvar_t *sv_showclamp;
 cvar_t *hostname;
 cvar_t *public_server; /* should heartbeats be sent */
 
+/* receive ring for SV_ReadPackets */
+static netadr_t sv_batch_from[MAX_NET_BATCH];
+static sizebuf_t sv_batch_msg[MAX_NET_BATCH];
+static byte sv_batch_buf[MAX_NET_BATCH][MAX_MSGLEN];
+
 void Master_Shutdown(void);
 void SV_ConnectionlessPacket(void);
 
@@ -81,6 +96,123 @@ SV_DropClient(client_t *drop)
 	drop->name[0] = 0;
 }
 
+/*
+ * Hashes the base address (the address without
+ * the port) and the qport of a client connection
+ */
+static unsigned
+SV_ClientHashKey(netadr_t *adr, int qport)
+{
+	unsigned hash;
+	int i;
+
+	hash = adr->type * 31 + (qport & 0xffff);
+
+	switch (adr->type)
+	{
+		case NA_IP:
+			for (i = 0; i < 4; i++)
+			{
+				hash = hash * 31 + adr->ip[i];
+			}
+
+			break;
+
+		case NA_IP6:
+			for (i = 0; i < 16; i++)
+			{
+				hash = hash * 31 + adr->ip[i];
+			}
+
+			break;
+
+		case NA_IPX:
+			for (i = 0; i < 10; i++)
+			{
+				hash = hash * 31 + adr->ipx[i];
+			}
+
+			break;
+
+		default:
+			break;
+	}
+
+	hash ^= hash >> 16;
+
+	return hash & (CLIENT_HASH_SIZE - 1);
+}
+
+/*
+ * Adds a client to the address lookup. Must be called
+ * after the netchan was set up, every client that's not
+ * cs_free is hashed.
+ */
+void
+SV_HashClient(client_t *cl)
+{
+	unsigned key;
+
+	key = SV_ClientHashKey(&cl->netchan.remote_address, cl->netchan.qport);
+
+	cl->hashnext = svs.clienthash[key];
+	svs.clienthash[key] = cl;
+}
+
+/*
+ * Removes a client from the address lookup,
+ * does nothing if the client isn't hashed.
+ */
+void
+SV_UnhashClient(client_t *cl)
+{
+	client_t **prev;
+	unsigned key;
+
+	key = SV_ClientHashKey(&cl->netchan.remote_address, cl->netchan.qport);
+
+	for (prev = &svs.clienthash[key]; *prev; prev = &(*prev)->hashnext)
+	{
+		if (*prev == cl)
+		{
+			*prev = cl->hashnext;
+			cl->hashnext = NULL;
+			return;
+		}
+	}
+}
+
+/*
+ * Returns the client connected from adr with the given qport,
+ * or NULL. The port is ignored to cope with address translating
+ * routers. A reconnecting client may share its address and qport
+ * with its own zombie, the lower slot wins like it always did.
+ */
+client_t *
+SV_FindClient(netadr_t adr, int qport)
+{
+	client_t *cl;
+	client_t *found;
+
+	found = NULL;
+
+	for (cl = svs.clienthash[SV_ClientHashKey(&adr, qport)]; cl; cl = cl->hashnext)
+	{
+		if ((cl->netchan.qport != qport) ||
+			!NET_CompareBaseAdr(adr, cl->netchan.remote_address))
+		{
+			continue;
+		}
+
+		if (!found || (cl < found))
+		{
+			found = cl;
+		}
+	}
+
+	return found;
+}
+
 /*
  * Builds the string that is sent as heartbeats and status replies
  */
@@ -194,75 +326,88 @@ SV_GiveMsec(void)
 	}
 }
 
-void
-SV_ReadPackets(void)
+/*
+ * Dispatches the datagram in net_message
+ * (received from net_from) to its client.
+ */
+static void
+SV_ProcessPacket(void)
 {
-	int i;
 	client_t *cl;
 	int qport;
 
-	while (NET_GetPacket(NS_SERVER, &net_from, &net_message))
+	/* check for connectionless packet (0xffffffff) first */
+	if (*(int *)net_message.data == -1)
 	{
-		/* check for connectionless packet (0xffffffff) first */
-		if (*(int *)net_message.data == -1)
-		{
-			SV_ConnectionlessPacket();
-			continue;
-		}
+		SV_ConnectionlessPacket();
+		return;
+	}
 
-		/* read the qport out of the message so we can fix up
-		   stupid address translating routers */
-		MSG_BeginReading(&net_message);
-		MSG_ReadLong(&net_message); /* sequence number */
-		MSG_ReadLong(&net_message); /* sequence number */
-		qport = MSG_ReadShort(&net_message) & 0xffff;
+	/* read the qport out of the message so we can fix up
+	   stupid address translating routers */
+	MSG_BeginReading(&net_message);
+	MSG_ReadLong(&net_message); /* sequence number */
+	MSG_ReadLong(&net_message); /* sequence number */
+	qport = MSG_ReadShort(&net_message) & 0xffff;
 
-		/* check for packets from connected clients */
-		for (i = 0, cl = svs.clients; i < maxclients->value; i++, cl++)
-		{
-			if (cl->state == cs_free)
-			{
-				continue;
-			}
+	/* check for packets from connected clients */
+	cl = SV_FindClient(net_from, qport);
 
-			if (!NET_CompareBaseAdr(net_from, cl->netchan.remote_address))
-			{
-				continue;
-			}
+	if (!cl)
+	{
+		return;
+	}
 
-			if (cl->netchan.qport != qport)
-			{
-				continue;
-			}
+	if (cl->netchan.remote_address.port != net_from.port)
+	{
+		/* the port isn't part of the hash key,
+		   so the client stays in its bucket */
+		Com_Printf("SV_ReadPackets: fixing up a translated port\n");
+		cl->netchan.remote_address.port = net_from.port;
+	}
 
-			if (cl->netchan.remote_address.port != net_from.port)
-			{
-				Com_Printf("SV_ReadPackets: fixing up a translated port\n");
-				cl->netchan.remote_address.port = net_from.port;
-			}
+	if (Netchan_Process(&cl->netchan, &net_message))
+	{
+		/* this is a valid, sequenced packet, so process it */
+		if (cl->state != cs_zombie)
+		{
+			cl->lastmessage = svs.realtime; /* don't timeout */
 
-			if (Netchan_Process(&cl->netchan, &net_message))
+			if (!(sv.demofile && (sv.state == ss_demo)))
 			{
-				/* this is a valid, sequenced packet, so process it */
-				if (cl->state != cs_zombie)
-				{
-					cl->lastmessage = svs.realtime; /* don't timeout */
-
-					if (!(sv.demofile && (sv.state == ss_demo)))
-					{
-						SV_ExecuteClientMessage(cl);
-					}
-				}
+				SV_ExecuteClientMessage(cl);
 			}
-
-			break;
 		}
+	}
+}
 
-		if (i != maxclients->value)
+/*
+ * Reads all pending packets in batches of up to
+ * MAX_NET_BATCH datagrams and processes them in
+ * order of arrival.
+ */
+void
+SV_ReadPackets(void)
+{
+	int i;
+	int count;
+
+	do
+	{
+		count = NET_GetPackets(NS_SERVER, sv_batch_from, sv_batch_msg,
+				MAX_NET_BATCH);
+
+		for (i = 0; i < count; i++)
 		{
-			continue;
+			net_from = sv_batch_from[i];
+			memcpy(net_message.data, sv_batch_msg[i].data,
+					sv_batch_msg[i].cursize);
+			net_message.cursize = sv_batch_msg[i].cursize;
+
+			SV_ProcessPacket();
 		}
 	}
+	while (count == MAX_NET_BATCH);
 }
 
 /*
@@ -296,6 +441,8 @@ SV_CheckTimeouts(void)
 		if ((cl->state == cs_zombie) &&
 			(cl->lastmessage < zombiepoint))
 		{
+			SV_UnhashClient(cl);
+			Netchan_FreeFragments(&cl->netchan);
 			cl->state = cs_free; /* can now be reused */
 			continue;
 		}
@@ -305,6 +452,8 @@ SV_CheckTimeouts(void)
 		{
 			SV_BroadcastPrintf(PRINT_HIGH, "%s timed out\n", cl->name);
 			SV_DropClient(cl);
+			SV_UnhashClient(cl);
+			Netchan_FreeFragments(&cl->netchan);
 			cl->state = cs_free; /* don't bother with zombie state */
 		}
 	}
@@ -332,6 +481,9 @@ SV_PrepWorldFrame(void)
 void
 SV_RunGameFrame(void)
 {
+	long long gametime;
+	qboolean paused;
+
 #ifndef DEDICATED_ONLY
 
 	if (host_speeds->value)
@@ -341,17 +493,31 @@ SV_RunGameFrame(void)
 
 #endif
 
+	/* a pause only starts at a snapshot boundary, whole
+	   snapshots then go by without game frames, so the
+	   game's frames stay lined up with the snapshots */
+	paused = sv_paused->value && (maxclients->value <= 1) && !sv.tick;
+
 	/* we always need to bump framenum, even if we
 	   don't run the world, otherwise the delta
 	   compression can get confused when a client
 	   has the "current" frame */
-	sv.framenum++;
-	sv.time = sv.framenum * 100;
+	if (!sv.tick)
+	{
+		sv.framenum++;
+	}
+
+	sv.tick = paused ? svs.frameticks : sv.tick + 1;
+	sv.time = (sv.framenum - 1) * 100 + sv.tick * 100 / svs.frameticks;
 
 	/* don't run if paused */
-	if (!sv_paused->value || (maxclients->value > 1))
+	if (!paused)
 	{
+		SV_FlushTraceCache();
+
+		gametime = SV_ProfileBegin();
 		ge->RunFrame();
+		SV_ProfileEnd(PROF_GAME, gametime);
 
 		/* never get more than one tic behind */
 		if (sv.time < svs.realtime)
@@ -375,9 +541,50 @@ SV_RunGameFrame(void)
 #endif
 }
 
+/*
+ * Keeps track of how many milliseconds the game frames
+ * started after they were due, printed every 100 frames
+ */
+static void
+SV_TickLateness(int lateness)
+{
+	if (!sv_showlateness->value)
+	{
+		sv_lateticks = 0;
+		return;
+	}
+
+	if (!sv_lateticks)
+	{
+		sv_latecount = sv_latesum = sv_latemax = 0;
+	}
+
+	sv_lateticks++;
+	sv_latesum += lateness;
+
+	if (lateness > 0)
+	{
+		sv_latecount++;
+	}
+
+	if (lateness > sv_latemax)
+	{
+		sv_latemax = lateness;
+	}
+
+	if (sv_lateticks == 100)
+	{
+		Com_Printf("frame lateness: %i of 100 late, avg %.2f ms, max %i ms\n",
+				sv_latecount, sv_latesum / 100.0f, sv_latemax);
+		sv_lateticks = 0;
+	}
+}
+
 void
 SV_Frame(int msec)
 {
+	long long frametime, phasetime;
+
 #ifndef DEDICATED_ONLY
 	time_before_game = time_after_game = 0;
 #endif
@@ -385,9 +592,13 @@ SV_Frame(int msec)
 	/* if server is not active, do nothing */
 	if (!svs.initialized)
 	{
+		/* a dedicated server without a
+		   map only waits for the console */
+		NET_Sleep(100);
 		return;
 	}
 
+	frametime = SV_ProfileBegin();
 	svs.realtime += msec;
 
 	/* keep the random time dependent */
@@ -397,7 +608,9 @@ SV_Frame(int msec)
 	SV_CheckTimeouts();
 
 	/* get packets from clients */
+	phasetime = SV_ProfileBegin();
 	SV_ReadPackets();
+	SV_ProfileEnd(PROF_PACKETS, phasetime);
 
 	/* move autonomous things around if enough time has passed */
 	if (!sv_timedemo->value && (svs.realtime < sv.time))
@@ -413,30 +626,64 @@ SV_Frame(int msec)
 			svs.realtime = sv.time - 100;
 		}
 
+		SV_ProfileEnd(PROF_TOTAL, frametime);
 		NET_Sleep(sv.time - svs.realtime);
 		return;
 	}
 
-	/* update ping based on the last known frame from all clients */
-	SV_CalcPings();
+	if (!sv_timedemo->value)
+	{
+		SV_TickLateness(svs.realtime - sv.time);
+	}
+
+	if (!sv.tick)
+	{
+		/* update ping based on the last known frame from all clients */
+		SV_CalcPings();
 
-	/* give the clients some timeslices */
-	SV_GiveMsec();
+		/* give the clients some timeslices */
+		SV_GiveMsec();
+	}
 
 	/* let everything in the world think and move */
 	SV_RunGameFrame();
 
+	/* the clients only get whole frames */
+	if (sv.tick < svs.frameticks)
+	{
+		SV_ProfileEnd(PROF_TOTAL, frametime);
+		SV_ProfileTick();
+		return;
+	}
+
+	sv.tick = 0;
+
+	/* collect this frame's datagrams, they're
+	   sent together by Netchan_FlushQueue */
+	Netchan_BeginQueue();
+
 	/* send messages back to the clients that had packets read this frame */
+	phasetime = SV_ProfileBegin();
 	SV_SendClientMessages();
+	SV_ProfileEnd(PROF_SEND, phasetime);
 
 	/* save the entire world state if recording a serverdemo */
+	phasetime = SV_ProfileBegin();
 	SV_RecordDemoMessage();
+	SV_ProfileEnd(PROF_DEMO, phasetime);
 
 	/* send a heartbeat to the master if needed */
 	Master_Heartbeat();
 
+	phasetime = SV_ProfileBegin();
+	Netchan_FlushQueue();
+	SV_ProfileEnd(PROF_SEND, phasetime);
+
 	/* clear teleport flags, etc for next frame */
 	SV_PrepWorldFrame();
+
+	SV_ProfileEnd(PROF_TOTAL, frametime);
+	SV_ProfileTick();
 }
 
 /*
@@ -582,6 +829,8 @@ SV_UserinfoChanged(client_t *cl)
 void
 SV_Init(void)
 {
+	int i;
+
 	SV_InitOperatorCommands();
 
 	rcon_password = Cvar_Get("rcon_password", "", 0);
@@ -601,6 +850,17 @@ SV_Init(void)
 	sv_paused = Cvar_Get("paused", "0", 0);
 	sv_timedemo = Cvar_Get("timedemo", "0", 0);
 	sv_enforcetime = Cvar_Get("sv_enforcetime", "0", 0);
+	sv_threads = Cvar_Get("sv_threads", "0", CVAR_ARCHIVE);
+	sv_tickrate = Cvar_Get("sv_tickrate", "10", CVAR_SERVERINFO | CVAR_LATCH);
+
+	SV_InitProfile();
+	sv_showlateness = Cvar_Get("sv_showlateness", "0", 0);
+	sv_tracecache = Cvar_Get("sv_tracecache", "0", 0);
+	sv_clipreject = Cvar_Get("sv_clipreject", "1", 0);
+	sv_deltacache = Cvar_Get("sv_deltacache", "1", 0);
+	sv_packedents = Cvar_Get("sv_packedents", "0", 0);
+	sv_fragments = Cvar_Get("sv_fragments", "1", 0);
+	sv_entbudget = Cvar_Get("sv_entbudget", "1", 0);
 	allow_download = Cvar_Get("allow_download", "1", CVAR_ARCHIVE);
 	allow_download_players = Cvar_Get("allow_download_players", "0", CVAR_ARCHIVE);
 	allow_download_models = Cvar_Get("allow_download_models", "1", CVAR_ARCHIVE);
@@ -613,7 +873,12 @@ SV_Init(void)
 
 	public_server = Cvar_Get("public", "0", 0);
 
-	SZ_Init(&net_message, net_message_buffer, sizeof(net_message_buffer));
+	SZ_Init(&net_message, net_message_buffer, MAX_MSGLEN);
+
+	for (i = 0; i < MAX_NET_BATCH; i++)
+	{
+		SZ_Init(&sv_batch_msg[i], sv_batch_buf[i], sizeof(sv_batch_buf[i]));
+	}
 }
 
 /*
@@ -670,6 +935,11 @@ SV_FinalMessage(char *message, qboolean reconnect)
 void
 SV_Shutdown(char *finalmsg, qboolean reconnect)
 {
+	int i;
+
+	/* an error may have aborted the frame while queueing */
+	Netchan_FlushQueue();
+
 	if (svs.clients)
 	{
 		SV_FinalMessage(finalmsg, reconnect);
@@ -690,6 +960,11 @@ SV_Shutdown(char *finalmsg, qboolean reconnect)
 	/* free server static data */
 	if (svs.clients)
 	{
+		for (i = 0; i < maxclients->value; i++)
+		{
+			Netchan_FreeFragments(&svs.clients[i].netchan);
+		}
+
 		Z_Free(svs.clients);
 	}
 
@@ -698,6 +973,11 @@ SV_Shutdown(char *finalmsg, qboolean reconnect)
 		Z_Free(svs.client_entities);
 	}
 
+	if (svs.snapshots)
+	{
+		Z_Free(svs.snapshots);
+	}
+
 	if (svs.demofile)
 	{
 		fclose(svs.demofile);
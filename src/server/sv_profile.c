@@ -0,0 +1,286 @@
+/*
+ * Copyright (C) 1997-2001 Id Software, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ *
+ * =======================================================================
+ *
+ * Server frame profiler. While sv_profile is set the phases of
+ * SV_Frame are timed in microseconds and every game tick adds
+ * them to a histogram per phase. "profile" prints the 50th and
+ * 99th percentile and the maximum, sv_profilecsv names a file
+ * in the game dir that gets them every 100 ticks.
+ *
+ * =======================================================================
+ */
+
+#include <limits.h>
+
+#include "header/server.h"
+
+/* 4 buckets per power of two, the last
+   one starts at about 16 seconds */
+#define PROF_BUCKETS 96
+#define PROF_CSVTICKS 100
+
+typedef struct
+{
+	int count;
+	int max;
+	long long total;
+	int buckets[PROF_BUCKETS];
+} profhist_t;
+
+cvar_t *sv_profile;
+cvar_t *sv_profilecsv;
+
+static const char *prof_names[PROF_NUM] = {
+	"packets", "game", "trace", "frames", "send", "demo", "total"
+};
+
+static profhist_t prof_hist[PROF_NUM];
+static long long prof_sample[PROF_NUM]; /* usec spent in the current tick */
+static qboolean prof_hit[PROF_NUM];
+static int prof_ticks;
+
+void
+SV_InitProfile(void)
+{
+	sv_profile = Cvar_Get("sv_profile", "0", 0);
+	sv_profilecsv = Cvar_Get("sv_profilecsv", "", 0);
+}
+
+static int
+SV_ProfileBucket(int usec)
+{
+	int e;
+
+	if (usec < 4)
+	{
+		return usec;
+	}
+
+	for (e = 2; (usec >> (e + 1)) && (e < 31); e++)
+	{
+	}
+
+	e = 4 * (e - 1) + ((usec >> (e - 2)) & 3);
+
+	return (e < PROF_BUCKETS) ? e : PROF_BUCKETS - 1;
+}
+
+/*
+ * Largest value that goes into the bucket
+ */
+static int
+SV_ProfileBucketMax(int bucket)
+{
+	int e;
+
+	if (bucket < 4)
+	{
+		return bucket;
+	}
+
+	e = bucket / 4 + 1;
+
+	return ((5 + (bucket & 3)) << (e - 2)) - 1;
+}
+
+static int
+SV_ProfilePercentile(const profhist_t *h, float p)
+{
+	int i, need, seen;
+
+	need = (int)ceil(h->count * p);
+	seen = 0;
+
+	for (i = 0; i < PROF_BUCKETS; i++)
+	{
+		seen += h->buckets[i];
+
+		if (seen >= need)
+		{
+			break;
+		}
+	}
+
+	i = SV_ProfileBucketMax(i);
+
+	return (i < h->max) ? i : h->max;
+}
+
+/*
+ * Returns the start time, or 0
+ * if the profiler is off
+ */
+long long
+SV_ProfileBegin(void)
+{
+	if (!sv_profile || !sv_profile->value)
+	{
+		return 0;
+	}
+
+	return Sys_Microseconds();
+}
+
+void
+SV_ProfileEnd(profphase_t phase, long long start)
+{
+	if (!start)
+	{
+		return;
+	}
+
+	prof_sample[phase] += Sys_Microseconds() - start;
+	prof_hit[phase] = true;
+}
+
+static void
+SV_ProfileReset(void)
+{
+	memset(prof_hist, 0, sizeof(prof_hist));
+	prof_ticks = 0;
+}
+
+static void
+SV_ProfileWriteCSV(void)
+{
+	char name[MAX_OSPATH];
+	const profhist_t *h;
+	FILE *f;
+	int i;
+
+	Com_sprintf(name, sizeof(name), "%s/%s", FS_Gamedir(), sv_profilecsv->string);
+
+	if ((f = fopen(name, "a")) == NULL)
+	{
+		Com_Printf("Couldn't open %s, profile not written.\n", name);
+		Cvar_Set("sv_profilecsv", "");
+		return;
+	}
+
+	fseek(f, 0, SEEK_END);
+
+	if (!ftell(f))
+	{
+		fprintf(f, "time,phase,count,avg,p50,p99,max\n");
+	}
+
+	for (i = 0; i < PROF_NUM; i++)
+	{
+		h = &prof_hist[i];
+
+		if (!h->count)
+		{
+			continue;
+		}
+
+		fprintf(f, "%i,%s,%i,%i,%i,%i,%i\n", svs.realtime, prof_names[i],
+				h->count, (int)(h->total / h->count),
+				SV_ProfilePercentile(h, 0.5f), SV_ProfilePercentile(h, 0.99f),
+				h->max);
+	}
+
+	fclose(f);
+}
+
+/*
+ * Adds the phases timed since the last call to
+ * the histograms, called once per game tick.
+ */
+void
+SV_ProfileTick(void)
+{
+	profhist_t *h;
+	int i, usec;
+
+	if (!sv_profile->value)
+	{
+		return;
+	}
+
+	for (i = 0; i < PROF_NUM; i++)
+	{
+		if (!prof_hit[i])
+		{
+			continue;
+		}
+
+		usec = (prof_sample[i] < INT_MAX) ? (int)prof_sample[i] : INT_MAX;
+		h = &prof_hist[i];
+
+		h->count++;
+		h->total += usec;
+		h->buckets[SV_ProfileBucket(usec)]++;
+
+		if (usec > h->max)
+		{
+			h->max = usec;
+		}
+
+		prof_sample[i] = 0;
+		prof_hit[i] = false;
+	}
+
+	/* the file gets the last 100 ticks each time */
+	if ((++prof_ticks >= PROF_CSVTICKS) && sv_profilecsv->string[0])
+	{
+		SV_ProfileWriteCSV();
+		SV_ProfileReset();
+	}
+}
+
+/*
+ * profile [reset]
+ */
+void
+SV_Profile_f(void)
+{
+	const profhist_t *h;
+	int i;
+
+	if ((Cmd_Argc() > 1) && !strcmp(Cmd_Argv(1), "reset"))
+	{
+		SV_ProfileReset();
+		return;
+	}
+
+	if (!sv_profile->value && !prof_ticks)
+	{
+		Com_Printf("Set sv_profile 1 to profile the server frames.\n");
+		return;
+	}
+
+	Com_Printf("%i ticks, times in usec\n", prof_ticks);
+	Com_Printf("phase       count      avg      p50      p99      max\n");
+
+	for (i = 0; i < PROF_NUM; i++)
+	{
+		h = &prof_hist[i];
+
+		if (!h->count)
+		{
+			continue;
+		}
+
+		Com_Printf("%-8s %8i %8i %8i %8i %8i\n", prof_names[i], h->count,
+				(int)(h->total / h->count), SV_ProfilePercentile(h, 0.5f),
+				SV_ProfilePercentile(h, 0.99f), h->max);
+	}
+}
@@ -138,6 +138,139 @@ SV_BroadcastCommand(char *fmt, ...)
 	SV_Multicast(NULL, MULTICAST_ALL_R);
 }
 
+/*
+ * Stores sv.multicast in the arena of this frame, returns
+ * its offset or -1 if the arena is full
+ */
+int
+SV_StoreMulticast(void)
+{
+	int offset;
+
+	offset = svs.multicast_arenasize;
+
+	if (offset + sv.multicast.cursize > MULTICAST_ARENA)
+	{
+		return -1;
+	}
+
+	memcpy(svs.multicast_arena + offset, sv.multicast.data,
+			sv.multicast.cursize);
+	svs.multicast_arenasize += sv.multicast.cursize;
+
+	return offset;
+}
+
+/*
+ * Copies the referenced multicasts into the client's datagram
+ */
+static void
+SV_FlattenDatagram(client_t *client)
+{
+	datagramref_t *ref;
+	int i;
+
+	for (i = 0, ref = client->datagramrefs; i < client->numdatagramrefs;
+		 i++, ref++)
+	{
+		SZ_Write(&client->datagram, svs.multicast_arena + ref->offset,
+				ref->length);
+	}
+
+	client->numdatagramrefs = 0;
+	client->datagramrefbytes = 0;
+}
+
+static void
+SV_ClearDatagram(client_t *client)
+{
+	SZ_Clear(&client->datagram);
+	client->numdatagramrefs = 0;
+	client->datagramrefbytes = 0;
+}
+
+/*
+ * Appends sv.multicast to the client's datagram. offset is where
+ * SV_StoreMulticast put it, the client just references it there.
+ * Without an offset, room for another reference or on overflow
+ * it is copied like before.
+ */
+void
+SV_WriteDatagram(client_t *client, int offset)
+{
+	datagramref_t *ref;
+
+	if ((offset < 0) || (client->numdatagramrefs == MAX_DATAGRAM_REFS) ||
+		(SV_DatagramSize(client) + sv.multicast.cursize >
+		 client->datagram.maxsize))
+	{
+		SV_FlattenDatagram(client);
+		SZ_Write(&client->datagram, sv.multicast.data, sv.multicast.cursize);
+		return;
+	}
+
+	ref = &client->datagramrefs[client->numdatagramrefs++];
+	ref->offset = offset;
+	ref->length = sv.multicast.cursize;
+
+	client->datagramrefbytes += ref->length;
+}
+
+/*
+ * Bytes waiting in the client's datagram
+ */
+int
+SV_DatagramSize(client_t *client)
+{
+	return client->datagram.cursize + client->datagramrefbytes;
+}
+
+/*
+ * Moves the references still waiting into the datagrams
+ * of their clients, so the arena can start over.
+ */
+static void
+SV_FlushMulticasts(void)
+{
+	client_t *client;
+	int i;
+
+	for (i = 0, client = svs.clients; i < maxclients->value; i++, client++)
+	{
+		if (client->numdatagramrefs)
+		{
+			SV_FlattenDatagram(client);
+		}
+	}
+
+	svs.multicast_arenasize = 0;
+}
+
+/*
+ * The cluster and area of the client's origin
+ */
+static void
+SV_ClientLeaf(client_t *client, int *cluster, int *area)
+{
+	vec_t *origin;
+	int leafnum;
+
+	origin = client->edict->s.origin;
+
+	if ((client->leafspawncount != svs.spawncount) ||
+		!VectorCompare(origin, client->leaforigin))
+	{
+		leafnum = CM_PointLeafnum(origin);
+		client->leafcluster = CM_LeafCluster(leafnum);
+		client->leafarea = CM_LeafArea(leafnum);
+		client->leafspawncount = svs.spawncount;
+		VectorCopy(origin, client->leaforigin);
+	}
+
+	*cluster = client->leafcluster;
+	*area = client->leafarea;
+}
+
 /*
  * Sends the contents of sv.multicast to a subset of the clients,
  * then clears sv.multicast.
@@ -155,6 +288,7 @@ SV_Multicast(vec3_t origin, multicast_t to)
 	int j;
 	qboolean reliable;
 	int area1, area2;
+	int offset;
 
 	reliable = false;
 
@@ -203,6 +337,9 @@ SV_Multicast(vec3_t origin, multicast_t to)
 			Com_Error(ERR_FATAL, "SV_Multicast: bad to:%i", to);
 	}
 
+	/* unreliable data is stored only once */
+	offset = reliable ? -1 : SV_StoreMulticast();
+
 	/* send the data to all relevent clients */
 	for (j = 0, client = svs.clients; j < maxclients->value; j++, client++)
 	{
@@ -218,9 +355,7 @@ SV_Multicast(vec3_t origin, multicast_t to)
 
 		if (mask)
 		{
-			leafnum = CM_PointLeafnum(client->edict->s.origin);
-			cluster = CM_LeafCluster(leafnum);
-			area2 = CM_LeafArea(leafnum);
+			SV_ClientLeaf(client, &cluster, &area2);
 
 			if (!CM_AreasConnected(area1, area2))
 			{
@@ -240,7 +375,7 @@ SV_Multicast(vec3_t origin, multicast_t to)
 		}
 		else
 		{
-			SZ_Write(&client->datagram, sv.multicast.data, sv.multicast.cursize);
+			SV_WriteDatagram(client, offset);
 		}
 	}
 
@@ -415,20 +550,15 @@ SV_StartSound(vec3_t origin, edict_t *entity, int channel, int soundindex,
 	}
 }
 
-qboolean
-SV_SendClientDatagram(client_t *client)
+/*
+ * Appends the accumulated multicast datagram to a
+ * frame message and sends it to the client.
+ */
+static void
+SV_TransmitClientDatagram(client_t *client, sizebuf_t *msg)
 {
-	byte msg_buf[MAX_MSGLEN];
-	sizebuf_t msg;
-
-	SV_BuildClientFrame(client);
-
-	SZ_Init(&msg, msg_buf, sizeof(msg_buf));
-	msg.allowoverflow = true;
-
-	/* send over all the relevant entity_state_t
-	   and the player_state_t */
-	SV_WriteFrameToClient(client, &msg);
+	datagramref_t *ref;
+	int i;
 
 	/* copy the accumulated multicast datagram
 	   for this client out to the message
@@ -440,27 +570,103 @@ SV_SendClientDatagram(client_t *client)
 	}
 	else
 	{
-		SZ_Write(&msg, client->datagram.data, client->datagram.cursize);
+		SZ_Write(msg, client->datagram.data, client->datagram.cursize);
+
+		for (i = 0, ref = client->datagramrefs; i < client->numdatagramrefs;
+			 i++, ref++)
+		{
+			SZ_Write(msg, svs.multicast_arena + ref->offset, ref->length);
+		}
 	}
 
-	SZ_Clear(&client->datagram);
+	SV_ClearDatagram(client);
 
-	if (msg.overflowed)
+	if (msg->overflowed)
 	{
 		/* must have room left for the packet header */
 		Com_Printf("WARNING: msg overflowed for %s\n", client->name);
-		SZ_Clear(&msg);
+		SZ_Clear(msg);
 	}
 
 	/* send the datagram */
-	Netchan_Transmit(&client->netchan, msg.cursize, msg.data);
+	Netchan_Transmit(&client->netchan, msg->cursize, msg->data);
 
 	/* record the size for rate estimation */
-	client->message_size[sv.framenum % RATE_MESSAGES] = msg.cursize;
+	client->message_size[sv.framenum % RATE_MESSAGES] = msg->cursize;
+}
+
+qboolean
+SV_SendClientDatagram(client_t *client)
+{
+	byte msg_buf[MAX_MSGLEN];
+	sizebuf_t msg;
+	long long start;
+
+	start = SV_ProfileBegin();
+
+	SV_BuildClientFrame(client);
+
+	SZ_Init(&msg, msg_buf, sizeof(msg_buf));
+	msg.allowoverflow = true;
+
+	/* send over all the relevant entity_state_t
+	   and the player_state_t */
+	SV_WriteFrameToClient(client, &msg);
+
+	SV_ProfileEnd(PROF_FRAMES, start);
+
+	SV_TransmitClientDatagram(client, &msg);
 
 	return true;
 }
 
+static void
+SV_CollectSnapshotJob(int job)
+{
+	SV_CollectClientSnapshot(&svs.snapshots[job]);
+}
+
+static void
+SV_WriteSnapshotJob(int job)
+{
+	SV_WriteClientSnapshot(&svs.snapshots[job]);
+}
+
+/*
+ * Builds and delta encodes the frames of the first count
+ * snapshots on the worker threads, then sends them.
+ */
+static void
+SV_SendClientSnapshots(int count)
+{
+	long long start;
+	int i;
+
+	start = SV_ProfileBegin();
+
+	for (i = 0; i < count; i++)
+	{
+		SV_SetupClientSnapshot(&svs.snapshots[i]);
+	}
+
+	Sys_RunWorkers(SV_CollectSnapshotJob, count);
+
+	for (i = 0; i < count; i++)
+	{
+		SV_ReserveClientSnapshot(&svs.snapshots[i]);
+	}
+
+	Sys_RunWorkers(SV_WriteSnapshotJob, count);
+
+	SV_ProfileEnd(PROF_FRAMES, start);
+
+	for (i = 0; i < count; i++)
+	{
+		SV_TransmitClientDatagram(svs.snapshots[i].client,
+				&svs.snapshots[i].msg);
+	}
+}
+
 void
 SV_DemoCompleted(void)
 {
@@ -514,8 +720,31 @@ SV_SendClientMessages(void)
 	int msglen;
 	byte msgbuf[MAX_MSGLEN];
 	size_t r;
+	int numsnapshots;
+	long long start;
 
 	msglen = 0;
+	numsnapshots = 0;
+
+	if (sv_threads->modified)
+	{
+		sv_threads->modified = false;
+
+		if (sv_threads->value > 0)
+		{
+			i = Sys_StartWorkers((int)sv_threads->value);
+			Com_Printf("Building client frames with %i worker threads.\n", i);
+		}
+		else
+		{
+			Sys_StopWorkers();
+		}
+	}
+
+	if ((sv_threads->value > 0) && !svs.snapshots)
+	{
+		svs.snapshots = Z_Malloc(sizeof(client_snapshot_t) * maxclients->value);
+	}
 
 	/* read the next demo message if needed */
 	if (sv.demofile && (sv.state == ss_demo))
@@ -559,6 +788,13 @@ SV_SendClientMessages(void)
 		}
 	}
 
+	if (sv.state == ss_game)
+	{
+		start = SV_ProfileBegin();
+		SV_BuildVisibilityKeys();
+		SV_ProfileEnd(PROF_FRAMES, start);
+	}
+
 	/* send a message to each connected client */
 	for (i = 0, c = svs.clients; i < maxclients->value; i++, c++)
 	{
@@ -573,7 +809,7 @@ SV_SendClientMessages(void)
 		if (c->netchan.message.overflowed)
 		{
 			SZ_Clear(&c->netchan.message);
-			SZ_Clear(&c->datagram);
+			SV_ClearDatagram(c);
 			SV_BroadcastPrintf(PRINT_HIGH, "%s overflowed\n", c->name);
 			SV_DropClient(c);
 		}
@@ -592,6 +828,13 @@ SV_SendClientMessages(void)
 				continue;
 			}
 
+			if (svs.snapshots && (sv_threads->value > 0))
+			{
+				/* built and sent after the loop */
+				svs.snapshots[numsnapshots++].client = c;
+				continue;
+			}
+
 			SV_SendClientDatagram(c);
 		}
 		else
@@ -604,5 +847,12 @@ SV_SendClientMessages(void)
 			}
 		}
 	}
+
+	if (numsnapshots)
+	{
+		SV_SendClientSnapshots(numsnapshots);
+	}
+
+	SV_FlushMulticasts();
 }
 
@@ -44,6 +44,105 @@ SV_BeginDemoserver(void)
 	}
 }
 
+/*
+ * How full the reliable message may get before the rest of
+ * the gamestate waits for the client to ask for it. With
+ * netchan fragments it usually goes out in one message.
+ */
+static int
+SV_GamestateLimit(void)
+{
+	if (sv_client->netchan.fragments)
+	{
+		return sv_client->netchan.message.maxsize - MAX_MSGLEN / 2;
+	}
+
+	return MAX_MSGLEN / 2;
+}
+
+static void
+SV_WriteBaselines(int start)
+{
+	entity_state_t nullstate;
+	entity_state_t *base;
+	int limit;
+
+	memset(&nullstate, 0, sizeof(nullstate));
+	limit = SV_GamestateLimit();
+
+	/* write a packet full of data */
+	while (sv_client->netchan.message.cursize < limit &&
+		   start < MAX_EDICTS)
+	{
+		base = &sv.baselines[start];
+
+		if (base->modelindex || base->sound || base->effects)
+		{
+			MSG_WriteByte(&sv_client->netchan.message, svc_spawnbaseline);
+			MSG_WriteDeltaEntity(&nullstate, base,
+					&sv_client->netchan.message,
+					true, true);
+		}
+
+		start++;
+	}
+
+	/* send next command */
+	if (start == MAX_EDICTS)
+	{
+		MSG_WriteByte(&sv_client->netchan.message, svc_stufftext);
+		MSG_WriteString(&sv_client->netchan.message,
+				va("precache %i\n", svs.spawncount));
+	}
+	else
+	{
+		MSG_WriteByte(&sv_client->netchan.message, svc_stufftext);
+		MSG_WriteString(&sv_client->netchan.message,
+				va("cmd baselines %i %i\n", svs.spawncount, start));
+	}
+}
+
+static void
+SV_WriteConfigstrings(int start)
+{
+	int limit;
+
+	limit = SV_GamestateLimit();
+
+	/* write a packet full of data */
+	while (sv_client->netchan.message.cursize < limit &&
+		   start < MAX_CONFIGSTRINGS)
+	{
+		if (sv.configstrings[start][0])
+		{
+			MSG_WriteByte(&sv_client->netchan.message, svc_configstring);
+			MSG_WriteShort(&sv_client->netchan.message, start);
+			MSG_WriteString(&sv_client->netchan.message,
+					sv.configstrings[start]);
+		}
+
+		start++;
+	}
+
+	/* send next command */
+	if (start < MAX_CONFIGSTRINGS)
+	{
+		MSG_WriteByte(&sv_client->netchan.message, svc_stufftext);
+		MSG_WriteString(&sv_client->netchan.message,
+				va("cmd configstrings %i %i\n", svs.spawncount, start));
+	}
+	else if (sv_client->netchan.fragments)
+	{
+		SV_WriteBaselines(0);
+	}
+	else
+	{
+		MSG_WriteByte(&sv_client->netchan.message, svc_stufftext);
+		MSG_WriteString(&sv_client->netchan.message,
+				va("cmd baselines %i 0\n", svs.spawncount));
+	}
+}
+
 /*
  * Sends the first message from the server to a connected client.
  * This will be sent on the initial connection and upon each server load.
@@ -76,7 +175,7 @@ SV_New_f(void)
 
 	/* send the serverdata */
 	MSG_WriteByte(&sv_client->netchan.message, svc_serverdata);
-	MSG_WriteLong(&sv_client->netchan.message, PROTOCOL_VERSION);
+	MSG_WriteLong(&sv_client->netchan.message, sv_client->protocol);
 	MSG_WriteLong(&sv_client->netchan.message, svs.spawncount);
 	MSG_WriteByte(&sv_client->netchan.message, sv.attractloop);
 	MSG_WriteString(&sv_client->netchan.message, gamedir);
@@ -104,18 +203,24 @@ SV_New_f(void)
 		sv_client->edict = ent;
 		memset(&sv_client->lastcmd, 0, sizeof(sv_client->lastcmd));
 
-		/* begin fetching configstrings */
-		MSG_WriteByte(&sv_client->netchan.message, svc_stufftext);
-		MSG_WriteString(&sv_client->netchan.message,
-				va("cmd configstrings %i 0\n", svs.spawncount));
+		if (sv_client->netchan.fragments)
+		{
+			/* the gamestate follows right away */
+			SV_WriteConfigstrings(0);
+		}
+		else
+		{
+			/* begin fetching configstrings */
+			MSG_WriteByte(&sv_client->netchan.message, svc_stufftext);
+			MSG_WriteString(&sv_client->netchan.message,
+					va("cmd configstrings %i 0\n", svs.spawncount));
+		}
 	}
 }
 
 void
 SV_Configstrings_f(void)
 {
-	int start;
-
 	Com_DPrintf("Configstrings() from %s\n", sv_client->name);
 
 	if (sv_client->state != cs_connected)
@@ -132,45 +237,12 @@ SV_Configstrings_f(void)
 		return;
 	}
 
-	start = (int)strtol(Cmd_Argv(2), (char **)NULL, 10);
-
-	/* write a packet full of data */
-	while (sv_client->netchan.message.cursize < MAX_MSGLEN / 2 &&
-		   start < MAX_CONFIGSTRINGS)
-	{
-		if (sv.configstrings[start][0])
-		{
-			MSG_WriteByte(&sv_client->netchan.message, svc_configstring);
-			MSG_WriteShort(&sv_client->netchan.message, start);
-			MSG_WriteString(&sv_client->netchan.message,
-					sv.configstrings[start]);
-		}
-
-		start++;
-	}
-
-	/* send next command */
-	if (start == MAX_CONFIGSTRINGS)
-	{
-		MSG_WriteByte(&sv_client->netchan.message, svc_stufftext);
-		MSG_WriteString(&sv_client->netchan.message,
-				va("cmd baselines %i 0\n", svs.spawncount));
-	}
-	else
-	{
-		MSG_WriteByte(&sv_client->netchan.message, svc_stufftext);
-		MSG_WriteString(&sv_client->netchan.message,
-				va("cmd configstrings %i %i\n", svs.spawncount, start));
-	}
+	SV_WriteConfigstrings((int)strtol(Cmd_Argv(2), (char **)NULL, 10));
 }
 
 void
 SV_Baselines_f(void)
 {
-	int start;
-	entity_state_t nullstate;
-	entity_state_t *base;
-
 	Com_DPrintf("Baselines() from %s\n", sv_client->name);
 
 	if (sv_client->state != cs_connected)
@@ -187,39 +259,7 @@ SV_Baselines_f(void)
 		return;
 	}
 
-	start = (int)strtol(Cmd_Argv(2), (char **)NULL, 10);
-	memset(&nullstate, 0, sizeof(nullstate));
-
-	/* write a packet full of data */
-	while (sv_client->netchan.message.cursize < MAX_MSGLEN / 2 &&
-		   start < MAX_EDICTS)
-	{
-		base = &sv.baselines[start];
-
-		if (base->modelindex || base->sound || base->effects)
-		{
-			MSG_WriteByte(&sv_client->netchan.message, svc_spawnbaseline);
-			MSG_WriteDeltaEntity(&nullstate, base,
-					&sv_client->netchan.message,
-					true, true);
-		}
-
-		start++;
-	}
-
-	/* send next command */
-	if (start == MAX_EDICTS)
-	{
-		MSG_WriteByte(&sv_client->netchan.message, svc_stufftext);
-		MSG_WriteString(&sv_client->netchan.message,
-				va("precache %i\n", svs.spawncount));
-	}
-	else
-	{
-		MSG_WriteByte(&sv_client->netchan.message, svc_stufftext);
-		MSG_WriteString(&sv_client->netchan.message,
-				va("cmd baselines %i %i\n", svs.spawncount, start));
-	}
+	SV_WriteBaselines((int)strtol(Cmd_Argv(2), (char **)NULL, 10));
 }
 
 void
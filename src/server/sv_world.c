@@ -26,29 +26,91 @@
 
 #include "header/server.h"
 
-#define AREA_DEPTH 4
-#define AREA_NODES 32
 #define MAX_TOTAL_ENT_LEAFS 128
 
+/* the world is split into a loose quadtree on x and y, its
+   depth is chosen so the smallest cells are at least
+   AREA_MINCELL units wide */
+#define AREA_MAXDEPTH 7
+#define AREA_MINCELL 128
+#define AREA_NODES 21845 /* (4^(AREA_MAXDEPTH+1)-1)/3 */
+
+/* queries captured for areabench */
+#define AREA_CAPTURE 4096
+
 #define STRUCT_FROM_LINK(l, t, m) ((t *)((byte *)l - (byte *)&(((t *)NULL)->m)))
 #define EDICT_FROM_AREA(l) STRUCT_FROM_LINK(l, edict_t, area)
 
-typedef struct areanode_s
+/*
+ * An entity is linked into the deepest node whose cells are
+ * at least as large as the entity, the one holding its center.
+ * The loose bounds of a node reach half a cell past its cell,
+ * so they always enclose the entities linked into it.
+ */
+typedef struct
 {
-	int axis; /* -1 = leaf node */
-	float dist;
-	struct areanode_s *children[2];
 	link_t trigger_edicts;
 	link_t solid_edicts;
 } areanode_t;
 
-areanode_t sv_areanodes[AREA_NODES];
-int sv_numareanodes;
+static areanode_t sv_areanodes[AREA_NODES];
+static int sv_areabase[AREA_MAXDEPTH + 1]; /* first node of each level */
+static int sv_arealinks[AREA_MAXDEPTH + 1][2]; /* solids and triggers per level */
+static float sv_areacell[AREA_MAXDEPTH + 1][2];
+static int sv_areadepth;
+static float sv_areamins[2], sv_areasize[2];
+
+/* node * 2 + 1 if linked as a trigger, by entity number */
+static int sv_entareas[MAX_EDICTS];
+
+static float *area_mins, *area_maxs;
+static edict_t **area_list;
+static int area_count, area_maxcount;
+static int area_type;
+static int area_checks; /* entities looked at, while area_bench is set */
+static qboolean area_bench;
+
+typedef struct
+{
+	vec3_t mins, maxs;
+	int type;
+} areaquery_t;
+
+static areaquery_t area_queries[AREA_CAPTURE];
+static int area_nextquery, area_numqueries;
+static qboolean area_capture; /* set by "areabench record" */
+
+#define TRACECACHE_SIZE 1024 /* power of two */
+
+typedef struct
+{
+	vec3_t start, end;
+	vec3_t mins, maxs;
+	edict_t *passedict;
+	int contentmask;
+	qboolean capsule;
+} tracekey_t;
+
+typedef struct
+{
+	tracekey_t key;
+	unsigned generation;
+	trace_t trace;
+} tracecache_t;
+
+cvar_t *sv_tracecache;
 
-float *area_mins, *area_maxs;
-edict_t **area_list;
-int area_count, area_maxcount;
-int area_type;
+/* entries of older generations are stale, a new one
+   starts with every tick and every solid that moves */
+static tracecache_t trace_cache[TRACECACHE_SIZE];
+static unsigned trace_generation = 1;
+static int trace_lookups, trace_hits, trace_flushes;
+
+cvar_t *sv_clipreject;
+
+/* entities a move was clipped against and how many of
+   them were rejected before the transformed trace */
+static int clip_tests, clip_rejects;
 
 int SV_HullForEntity(edict_t *ent);
 
@@ -75,65 +137,109 @@ InsertLinkBefore(link_t *l, link_t *before)
 	l->next->prev = l;
 }
 
-/*
- * Builds a uniformly subdivided tree for the given world size
- */
-areanode_t *
-SV_CreateAreaNode(int depth, vec3_t mins, vec3_t maxs)
+void
+SV_ClearWorld(void)
 {
-	areanode_t *anode;
-	vec3_t size;
-	vec3_t mins1, maxs1, mins2, maxs2;
+	float size;
+	int i;
 
-	anode = &sv_areanodes[sv_numareanodes];
-	sv_numareanodes++;
+	sv_areamins[0] = sv.models[1]->mins[0];
+	sv_areamins[1] = sv.models[1]->mins[1];
+	sv_areasize[0] = sv.models[1]->maxs[0] - sv_areamins[0];
+	sv_areasize[1] = sv.models[1]->maxs[1] - sv_areamins[1];
 
-	ClearLink(&anode->trigger_edicts);
-	ClearLink(&anode->solid_edicts);
+	/* a map without world size still gets a valid tree */
+	sv_areasize[0] = (sv_areasize[0] < 1) ? 1 : sv_areasize[0];
+	sv_areasize[1] = (sv_areasize[1] < 1) ? 1 : sv_areasize[1];
 
-	if (depth == AREA_DEPTH)
+	size = (sv_areasize[0] > sv_areasize[1]) ? sv_areasize[0] : sv_areasize[1];
+
+	for (sv_areadepth = 0; sv_areadepth < AREA_MAXDEPTH; sv_areadepth++)
 	{
-		anode->axis = -1;
-		anode->children[0] = anode->children[1] = NULL;
-		return anode;
+		if (size / (2 << sv_areadepth) < AREA_MINCELL)
+		{
+			break;
+		}
 	}
 
-	VectorSubtract(maxs, mins, size);
-
-	if (size[0] > size[1])
+	for (i = 0; i <= AREA_MAXDEPTH; i++)
 	{
-		anode->axis = 0;
+		sv_areabase[i] = ((1 << (2 * i)) - 1) / 3;
+		sv_areacell[i][0] = sv_areasize[0] / (1 << i);
+		sv_areacell[i][1] = sv_areasize[1] / (1 << i);
+		sv_arealinks[i][0] = sv_arealinks[i][1] = 0;
 	}
-	else
+
+	for (i = 0; i < sv_areabase[sv_areadepth] + (1 << (2 * sv_areadepth)); i++)
 	{
-		anode->axis = 1;
+		ClearLink(&sv_areanodes[i].trigger_edicts);
+		ClearLink(&sv_areanodes[i].solid_edicts);
 	}
 
-	anode->dist = 0.5f * (maxs[anode->axis] + mins[anode->axis]);
-	VectorCopy(mins, mins1);
-	VectorCopy(mins, mins2);
-	VectorCopy(maxs, maxs1);
-	VectorCopy(maxs, maxs2);
+	SV_FlushTraceCache();
+}
 
-	maxs1[anode->axis] = mins2[anode->axis] = anode->dist;
+/*
+ * Keeps count of the entities linked into each level,
+ * so that empty levels are skipped by SV_AreaEdicts
+ */
+static void
+SV_CountAreaNode(int node, qboolean trigger, int change)
+{
+	int level;
 
-	anode->children[0] = SV_CreateAreaNode(depth + 1, mins2, maxs2);
-	anode->children[1] = SV_CreateAreaNode(depth + 1, mins1, maxs1);
+	for (level = sv_areadepth; sv_areabase[level] > node; level--)
+	{
+	}
 
-	return anode;
+	sv_arealinks[level][trigger] += change;
 }
 
-void
-SV_ClearWorld(void)
+/*
+ * Finds the node for an entity with the given
+ * absmin / absmax, the root takes what is left
+ */
+static int
+SV_AreaNodeForBox(const vec3_t absmin, const vec3_t absmax)
 {
-	memset(sv_areanodes, 0, sizeof(sv_areanodes));
-	sv_numareanodes = 0;
-	SV_CreateAreaNode(0, sv.models[1]->mins, sv.models[1]->maxs);
+	int level, x, y;
+	float cellx, celly;
+
+	for (level = sv_areadepth; level > 0; level--)
+	{
+		cellx = sv_areacell[level][0];
+		celly = sv_areacell[level][1];
+
+		if ((absmax[0] - absmin[0] > cellx) || (absmax[1] - absmin[1] > celly))
+		{
+			continue;
+		}
+
+		x = (int)floor(((absmin[0] + absmax[0]) * 0.5f - sv_areamins[0]) / cellx);
+		y = (int)floor(((absmin[1] + absmax[1]) * 0.5f - sv_areamins[1]) / celly);
+		x = (x < 0) ? 0 : ((x >= (1 << level)) ? (1 << level) - 1 : x);
+		y = (y < 0) ? 0 : ((y >= (1 << level)) ? (1 << level) - 1 : y);
+
+		/* off the world the clamped cell may be too far away */
+		if ((absmin[0] < sv_areamins[0] + (x - 0.5f) * cellx) ||
+			(absmax[0] > sv_areamins[0] + (x + 1.5f) * cellx) ||
+			(absmin[1] < sv_areamins[1] + (y - 0.5f) * celly) ||
+			(absmax[1] > sv_areamins[1] + (y + 1.5f) * celly))
+		{
+			continue;
+		}
+
+		return sv_areabase[level] + (y << level) + x;
+	}
+
+	return 0;
 }
 
 void
 SV_UnlinkEdict(edict_t *ent)
 {
+	int e;
+
 	if (!ent->area.prev)
 	{
 		return; /* not linked in anywhere */
@@ -141,12 +247,21 @@ SV_UnlinkEdict(edict_t *ent)
 
 	RemoveLink(&ent->area);
 	ent->area.prev = ent->area.next = NULL;
+
+	e = NUM_FOR_EDICT(ent);
+	SV_CountAreaNode(sv_entareas[e] >> 1, sv_entareas[e] & 1, -1);
+
+	if (!(sv_entareas[e] & 1))
+	{
+		SV_FlushTraceCache();
+	}
 }
 
 void
 SV_LinkEdict(edict_t *ent)
 {
-	areanode_t *node;
+	int node;
+	qboolean trigger;
 	int leafs[MAX_TOTAL_ENT_LEAFS];
 	int clusters[MAX_TOTAL_ENT_LEAFS];
 	int num_leafs;
@@ -284,6 +399,17 @@ SV_LinkEdict(edict_t *ent)
 	num_leafs = CM_BoxLeafnums(ent->absmin, ent->absmax,
 			leafs, MAX_TOTAL_ENT_LEAFS, &topnode);
 
+	/* kept even if the clusters fit, the frame
+	   visibility keys may run out of room for them.
+	   A box inside a single leaf has no top node,
+	   then it's that leaf in node numbering. */
+	if ((topnode == -1) && num_leafs)
+	{
+		topnode = -1 - leafs[0];
+	}
+
+	ent->headnode = topnode;
+
 	/* set areas */
 	for (i = 0; i < num_leafs; i++)
 	{
@@ -316,7 +442,6 @@ SV_LinkEdict(edict_t *ent)
 	{
 		/* assume we missed some leafs, and mark by headnode */
 		ent->num_clusters = -1;
-		ent->headnode = topnode;
 	}
 	else
 	{
@@ -343,7 +468,6 @@ SV_LinkEdict(edict_t *ent)
 				{
 					/* assume we missed some leafs, and mark by headnode */
 					ent->num_clusters = -1;
-					ent->headnode = topnode;
 					break;
 				}
 
@@ -365,43 +489,30 @@ SV_LinkEdict(edict_t *ent)
 		return;
 	}
 
-	/* find the first node that the ent's box crosses */
-	node = sv_areanodes;
+	/* link it in */
+	node = SV_AreaNodeForBox(ent->absmin, ent->absmax);
+	trigger = (ent->solid == SOLID_TRIGGER);
 
-	while (1)
+	if (trigger)
 	{
-		if (node->axis == -1)
-		{
-			break;
-		}
-
-		if (ent->absmin[node->axis] > node->dist)
-		{
-			node = node->children[0];
-		}
-		else if (ent->absmax[node->axis] < node->dist)
-		{
-			node = node->children[1];
-		}
-		else
-		{
-			break; /* crosses the node */
-		}
+		InsertLinkBefore(&ent->area, &sv_areanodes[node].trigger_edicts);
 	}
-
-	/* link it in */
-	if (ent->solid == SOLID_TRIGGER)
+	else
 	{
-		InsertLinkBefore(&ent->area, &node->trigger_edicts);
+		InsertLinkBefore(&ent->area, &sv_areanodes[node].solid_edicts);
 	}
-	else
+
+	sv_entareas[NUM_FOR_EDICT(ent)] = (node << 1) | trigger;
+	SV_CountAreaNode(node, trigger, 1);
+
+	if (!trigger)
 	{
-		InsertLinkBefore(&ent->area, &node->solid_edicts);
+		SV_FlushTraceCache();
 	}
 }
 
-void
-SV_AreaEdicts_r(areanode_t *node)
+static void
+SV_AreaEdictsNode(areanode_t *node)
 {
 	link_t *l, *next, *start;
 	edict_t *check;
@@ -420,6 +531,10 @@ SV_AreaEdicts_r(areanode_t *node)
 	{
 		next = l->next;
 		check = (EDICT_FROM_AREA(l));
+		if (area_bench)
+		{
+			area_checks++;
+		}
 
 		if (check->solid == SOLID_NOT)
 		{
@@ -445,21 +560,47 @@ SV_AreaEdicts_r(areanode_t *node)
 		area_list[area_count] = check;
 		area_count++;
 	}
+}
 
-	if (node->axis == -1)
-	{
-		return; /* terminal node */
-	}
+/*
+ * Walks the cells of each level whose loose
+ * bounds touch the area_mins / area_maxs box
+ */
+static void
+SV_AreaEdictsCells(void)
+{
+	int level, x, y, x0, x1, y0, y1, last;
+	areanode_t *row;
 
-	/* recurse down both sides */
-	if (area_maxs[node->axis] > node->dist)
+	for (level = 0; level <= sv_areadepth; level++)
 	{
-		SV_AreaEdicts_r(node->children[0]);
-	}
+		if (!sv_arealinks[level][area_type == AREA_TRIGGERS])
+		{
+			continue;
+		}
 
-	if (area_mins[node->axis] < node->dist)
-	{
-		SV_AreaEdicts_r(node->children[1]);
+		last = (1 << level) - 1;
+
+		x0 = (int)ceil((area_mins[0] - sv_areamins[0]) / sv_areacell[level][0] - 1.5f);
+		x1 = (int)floor((area_maxs[0] - sv_areamins[0]) / sv_areacell[level][0] + 0.5f);
+		y0 = (int)ceil((area_mins[1] - sv_areamins[1]) / sv_areacell[level][1] - 1.5f);
+		y1 = (int)floor((area_maxs[1] - sv_areamins[1]) / sv_areacell[level][1] + 0.5f);
+
+		/* the border cells also hold what is off the world */
+		x0 = (x0 < 0) ? 0 : ((x0 > last) ? last : x0);
+		x1 = (x1 < 0) ? 0 : ((x1 > last) ? last : x1);
+		y0 = (y0 < 0) ? 0 : ((y0 > last) ? last : y0);
+		y1 = (y1 < 0) ? 0 : ((y1 > last) ? last : y1);
+
+		for (y = y0; y <= y1; y++)
+		{
+			row = &sv_areanodes[sv_areabase[level] + (y << level)];
+
+			for (x = x0; x <= x1; x++)
+			{
+				SV_AreaEdictsNode(&row[x]);
+			}
+		}
 	}
 }
 
@@ -467,6 +608,19 @@ int
 SV_AreaEdicts(vec3_t mins, vec3_t maxs, edict_t **list,
 		int maxcount, int areatype)
 {
+	if (area_capture)
+	{
+		VectorCopy(mins, area_queries[area_nextquery].mins);
+		VectorCopy(maxs, area_queries[area_nextquery].maxs);
+		area_queries[area_nextquery].type = areatype;
+		area_nextquery = (area_nextquery + 1) % AREA_CAPTURE;
+
+		if (area_numqueries < AREA_CAPTURE)
+		{
+			area_numqueries++;
+		}
+	}
+
 	area_mins = mins;
 	area_maxs = maxs;
 	area_list = list;
@@ -474,7 +628,7 @@ SV_AreaEdicts(vec3_t mins, vec3_t maxs, edict_t **list,
 	area_type = areatype;
 	area_count = 0;
 
-	SV_AreaEdicts_r(sv_areanodes);
+	SV_AreaEdictsCells();
 
 	area_mins = 0;
 	area_maxs = 0;
@@ -485,147 +639,540 @@ SV_AreaEdicts(vec3_t mins, vec3_t maxs, edict_t **list,
 	return area_count;
 }
 
-int
-SV_PointContents(vec3_t p)
+/*
+ * The fixed depth 4 tree the quadtree replaced, only
+ * built from the linked entities by areabench.
+ */
+#define BENCH_DEPTH 4
+#define BENCH_NODES 31
+
+typedef struct
 {
-	edict_t *touch[MAX_EDICTS], *hit;
-	int i, num;
-	int contents, c2;
-	int headnode;
+	int axis; /* -1 = leaf node */
+	float dist;
+	int children[2];
+	int first[2], num[2]; /* into bench_ents, solid and trigger */
+} benchnode_t;
 
-	/* get base contents from world */
-	contents = CM_PointContents(p, sv.models[1]->headnode);
+static benchnode_t bench_nodes[BENCH_NODES];
+static int bench_numnodes;
+static edict_t *bench_ents[MAX_EDICTS];
 
-	/* or in contents from all the other entities */
-	num = SV_AreaEdicts(p, p, touch, MAX_EDICTS, AREA_SOLID);
+static int
+SV_BenchCreateNode(int depth, vec3_t mins, vec3_t maxs)
+{
+	benchnode_t *anode;
+	vec3_t mins1, maxs1, mins2, maxs2;
+	int n;
 
-	for (i = 0; i < num; i++)
+	n = bench_numnodes++;
+	anode = &bench_nodes[n];
+	memset(anode, 0, sizeof(*anode));
+
+	if (depth == BENCH_DEPTH)
 	{
-		hit = touch[i];
+		anode->axis = -1;
+		return n;
+	}
 
-		/* might intersect, so do an exact clip */
-		headnode = SV_HullForEntity(hit);
-		c2 = CM_TransformedPointContents(p, headnode,
-				hit->s.origin, hit->s.angles);
+	anode->axis = ((maxs[0] - mins[0]) > (maxs[1] - mins[1])) ? 0 : 1;
+	anode->dist = 0.5f * (maxs[anode->axis] + mins[anode->axis]);
+	VectorCopy(mins, mins1);
+	VectorCopy(mins, mins2);
+	VectorCopy(maxs, maxs1);
+	VectorCopy(maxs, maxs2);
 
-		contents |= c2;
-	}
+	maxs1[anode->axis] = mins2[anode->axis] = anode->dist;
 
-	return contents;
+	anode->children[0] = SV_BenchCreateNode(depth + 1, mins2, maxs2);
+	anode->children[1] = SV_BenchCreateNode(depth + 1, mins1, maxs1);
+
+	return n;
 }
 
-typedef struct
+static int
+SV_BenchNodeForEdict(edict_t *ent)
 {
-	vec3_t boxmins, boxmaxs; /* enclose the test object along entire move */
-	float *mins, *maxs; /* size of the moving object */
-	vec3_t mins2, maxs2; /* size when clipping against mosnters */
-	float *start, *end;
-	trace_t trace;
-	edict_t *passedict;
-	int contentmask;
-} moveclip_t;
+	benchnode_t *node;
 
-/*
- * Returns a headnode that can be used for testing or clipping an
- * object of mins/maxs size. Offset is filled in to contain the 
- * adjustment that must be added to the testing object's origin
- * to get a point to use with the returned hull.
- */
-int
-SV_HullForEntity(edict_t *ent)
-{
-	cmodel_t *model;
+	node = bench_nodes;
 
-	/* decide which clipping hull to use, based on the size */
-	if (ent->solid == SOLID_BSP)
+	while (node->axis != -1)
 	{
-		/* explicit hulls in the BSP model */
-		model = sv.models[ent->s.modelindex];
-
-		if (!model)
+		if (ent->absmin[node->axis] > node->dist)
 		{
-			Com_Error(ERR_FATAL, "MOVETYPE_PUSH with a non bsp model");
+			node = &bench_nodes[node->children[0]];
+		}
+		else if (ent->absmax[node->axis] < node->dist)
+		{
+			node = &bench_nodes[node->children[1]];
+		}
+		else
+		{
+			break;
 		}
-
-		return model->headnode;
 	}
 
-	/* create a temp hull from bounding box sizes */
-	return CM_HeadnodeForBox(ent->mins, ent->maxs);
+	return node - bench_nodes;
 }
 
-void
-SV_ClipMoveToEntities(moveclip_t *clip)
+static void
+SV_BenchBuild(void)
 {
-	int i, num;
-	edict_t *touchlist[MAX_EDICTS], *touch;
-	trace_t trace;
-	int headnode;
-	float *angles;
+	int nodes[MAX_EDICTS];
+	int e, n, t, count;
+	edict_t *ent;
 
-	num = SV_AreaEdicts(clip->boxmins, clip->boxmaxs, touchlist,
-			MAX_EDICTS, AREA_SOLID);
+	bench_numnodes = 0;
+	SV_BenchCreateNode(0, sv.models[1]->mins, sv.models[1]->maxs);
 
-	/* be careful, it is possible to have an entity in this
-	   list removed before we get to it (killtriggered) */
-	for (i = 0; i < num; i++)
+	for (e = 1; e < ge->num_edicts; e++)
 	{
-		touch = touchlist[i];
+		ent = EDICT_NUM(e);
+		nodes[e] = -1;
 
-		if (touch->solid == SOLID_NOT)
+		if (ent->inuse && ent->area.prev)
 		{
-			continue;
+			nodes[e] = SV_BenchNodeForEdict(ent);
+			bench_nodes[nodes[e]].num[sv_entareas[e] & 1]++;
 		}
+	}
 
-		if (touch == clip->passedict)
+	for (n = 0, count = 0; n < bench_numnodes; n++)
+	{
+		for (t = 0; t < 2; t++)
 		{
-			continue;
+			bench_nodes[n].first[t] = count;
+			count += bench_nodes[n].num[t];
+			bench_nodes[n].num[t] = 0;
 		}
+	}
 
-		if (clip->trace.allsolid)
+	for (e = 1; e < ge->num_edicts; e++)
+	{
+		if (nodes[e] != -1)
 		{
-			return;
+			t = sv_entareas[e] & 1;
+			n = nodes[e];
+			bench_ents[bench_nodes[n].first[t] + bench_nodes[n].num[t]++] = EDICT_NUM(e);
 		}
+	}
+}
 
-		if (clip->passedict)
-		{
-			if (touch->owner == clip->passedict)
-			{
-				continue; /* don't clip against own missiles */
-			}
+static void
+SV_BenchAreaEdicts_r(const benchnode_t *node, int trigger)
+{
+	edict_t *check;
+	int i;
 
-			if (clip->passedict->owner == touch)
-			{
-				continue; /* don't clip against owner */
-			}
+	for (i = 0; i < node->num[trigger]; i++)
+	{
+		check = bench_ents[node->first[trigger] + i];
+		if (area_bench)
+		{
+			area_checks++;
 		}
 
-		if (!(clip->contentmask & CONTENTS_DEADMONSTER) &&
-			(touch->svflags & SVF_DEADMONSTER))
+		if ((check->solid == SOLID_NOT) ||
+			(check->absmin[0] > area_maxs[0]) ||
+			(check->absmin[1] > area_maxs[1]) ||
+			(check->absmin[2] > area_maxs[2]) ||
+			(check->absmax[0] < area_mins[0]) ||
+			(check->absmax[1] < area_mins[1]) ||
+			(check->absmax[2] < area_mins[2]))
 		{
 			continue;
 		}
 
-		/* might intersect, so do an exact clip */
-		headnode = SV_HullForEntity(touch);
-		angles = touch->s.angles;
+		area_count++;
+	}
+
+	if (node->axis == -1)
+	{
+		return;
+	}
+
+	if (area_maxs[node->axis] > node->dist)
+	{
+		SV_BenchAreaEdicts_r(&bench_nodes[node->children[0]], trigger);
+	}
+
+	if (area_mins[node->axis] < node->dist)
+	{
+		SV_BenchAreaEdicts_r(&bench_nodes[node->children[1]], trigger);
+	}
+}
+
+/*
+ * areabench record
+ * areabench [rounds]
+ *
+ * The first form starts capturing the SV_AreaEdicts queries,
+ * the second one stops that and replays the last of them
+ * against the quadtree and the old fixed tree, then prints
+ * how many entities each looked at and how long it took.
+ */
+void
+SV_AreaBench_f(void)
+{
+	edict_t *list[MAX_EDICTS];
+	int rounds, r, i, tree, checks, found, linked;
+	long long start, usec;
+	areaquery_t *q;
+
+	if (sv.state != ss_game)
+	{
+		Com_Printf("No map running.\n");
+		return;
+	}
+
+	if ((Cmd_Argc() > 1) && !strcmp(Cmd_Argv(1), "record"))
+	{
+		area_nextquery = area_numqueries = 0;
+		area_capture = true;
+		Com_Printf("Capturing queries, run areabench to replay them.\n");
+		return;
+	}
+
+	area_capture = false;
+
+	if (!area_numqueries)
+	{
+		Com_Printf("No queries captured, run areabench record first.\n");
+		return;
+	}
+
+	rounds = (Cmd_Argc() > 1) ? (int)strtol(Cmd_Argv(1), NULL, 10) : 10;
+
+	if (rounds < 1)
+	{
+		rounds = 1;
+	}
+
+	SV_BenchBuild();
+
+	for (i = 0, linked = 0; i < bench_numnodes; i++)
+	{
+		linked += bench_nodes[i].num[0] + bench_nodes[i].num[1];
+	}
+
+	area_bench = true;
+
+	for (tree = 0; tree < 2; tree++)
+	{
+		checks = found = 0;
+		start = Sys_Microseconds();
+
+		for (r = 0; r < rounds; r++)
+		{
+			for (i = 0; i < area_numqueries; i++)
+			{
+				q = &area_queries[i];
+				area_checks = 0;
+
+				if (tree)
+				{
+					found += SV_AreaEdicts(q->mins, q->maxs, list,
+							MAX_EDICTS, q->type);
+				}
+				else
+				{
+					area_mins = q->mins;
+					area_maxs = q->maxs;
+					area_count = 0;
+					SV_BenchAreaEdicts_r(bench_nodes, q->type == AREA_TRIGGERS);
+					area_mins = area_maxs = 0;
+					found += area_count;
+				}
+
+				checks += area_checks;
+			}
+		}
+
+		usec = Sys_Microseconds() - start;
+
+		Com_Printf("%-9s: %i queries x %i rounds, %i checks, %i found, %.2f usec per query\n",
+				tree ? "quadtree" : "old tree", area_numqueries, rounds, checks,
+				found, usec / ((float)area_numqueries * rounds));
+	}
+
+	Com_Printf("%i entities linked, quadtree depth %i\n", linked, sv_areadepth);
+
+	area_bench = false;
+}
+
+int
+SV_PointContents(vec3_t p)
+{
+	edict_t *touch[MAX_EDICTS], *hit;
+	int i, num;
+	int contents, c2;
+	int headnode;
+
+	/* get base contents from world */
+	contents = CM_PointContents(p, sv.models[1]->headnode);
+
+	/* or in contents from all the other entities */
+	num = SV_AreaEdicts(p, p, touch, MAX_EDICTS, AREA_SOLID);
+
+	for (i = 0; i < num; i++)
+	{
+		hit = touch[i];
+
+		/* might intersect, so do an exact clip */
+		headnode = SV_HullForEntity(hit);
+		c2 = CM_TransformedPointContents(p, headnode,
+				hit->s.origin, hit->s.angles);
+
+		contents |= c2;
+	}
+
+	return contents;
+}
+
+typedef struct
+{
+	vec3_t boxmins, boxmaxs; /* enclose the test object along entire move */
+	float *mins, *maxs; /* size of the moving object */
+	vec3_t mins2, maxs2; /* size when clipping against mosnters */
+	float *start, *end;
+	trace_t trace;
+	edict_t *passedict;
+	int contentmask;
+	qboolean capsule; /* sweep a capsule instead of the box */
+} moveclip_t;
+
+/*
+ * Returns a headnode that can be used for testing or clipping an
+ * object of mins/maxs size. Offset is filled in to contain the 
+ * adjustment that must be added to the testing object's origin
+ * to get a point to use with the returned hull.
+ */
+int
+SV_HullForEntity(edict_t *ent)
+{
+	cmodel_t *model;
+
+	/* decide which clipping hull to use, based on the size */
+	if (ent->solid == SOLID_BSP)
+	{
+		/* explicit hulls in the BSP model */
+		model = sv.models[ent->s.modelindex];
+
+		if (!model)
+		{
+			Com_Error(ERR_FATAL, "MOVETYPE_PUSH with a non bsp model");
+		}
+
+		return model->headnode;
+	}
+
+	/* create a temp hull from bounding box sizes */
+	return CM_HeadnodeForBox(ent->mins, ent->maxs);
+}
+
+/*
+ * Returns false if the move can't touch the entity. The move is
+ * tested as a segment against the bounds of the entity's brushes
+ * grown by the moving box, in the frame of the entity as
+ * CM_TransformedBoxTrace uses it. Entities without any of the
+ * contents looked for are rejected too.
+ */
+static qboolean
+SV_ClipMayTouch(const moveclip_t *clip, edict_t *touch,
+		const float *mins, const float *maxs)
+{
+	cmodel_t *model;
+	vec3_t start, end, temp;
+	vec3_t forward, right, up;
+	vec3_t boxmins, boxmaxs;
+	float enter, leave, d, t1, t2;
+	float *angles;
+	int i;
+
+	VectorSubtract(clip->start, touch->s.origin, start);
+	VectorSubtract(clip->end, touch->s.origin, end);
+
+	if (touch->solid == SOLID_BSP)
+	{
+		model = sv.models[touch->s.modelindex];
+
+		if (!model)
+		{
+			return true; /* SV_HullForEntity complains */
+		}
+
+		if (!(model->contents & clip->contentmask))
+		{
+			return false;
+		}
+
+		VectorCopy(model->brushmins, boxmins);
+		VectorCopy(model->brushmaxs, boxmaxs);
+		angles = touch->s.angles;
+
+		if (angles[0] || angles[1] || angles[2])
+		{
+			AngleVectors(angles, forward, right, up);
+
+			VectorCopy(start, temp);
+			start[0] = DotProduct(temp, forward);
+			start[1] = -DotProduct(temp, right);
+			start[2] = DotProduct(temp, up);
+
+			VectorCopy(end, temp);
+			end[0] = DotProduct(temp, forward);
+			end[1] = -DotProduct(temp, right);
+			end[2] = DotProduct(temp, up);
+		}
+	}
+	else
+	{
+		/* the box hull is a monster */
+		if (!(clip->contentmask & CONTENTS_MONSTER))
+		{
+			return false;
+		}
+
+		VectorCopy(touch->mins, boxmins);
+		VectorCopy(touch->maxs, boxmaxs);
+	}
+
+	enter = 0;
+	leave = 1;
+
+	for (i = 0; i < 3; i++)
+	{
+		/* a unit more than the traces' epsilon */
+		boxmins[i] -= maxs[i] + 1;
+		boxmaxs[i] -= mins[i] - 1;
+
+		d = end[i] - start[i];
+
+		if ((d > -0.001f) && (d < 0.001f))
+		{
+			if ((start[i] < boxmins[i]) || (start[i] > boxmaxs[i]))
+			{
+				return false;
+			}
+
+			continue;
+		}
+
+		t1 = (boxmins[i] - start[i]) / d;
+		t2 = (boxmaxs[i] - start[i]) / d;
+
+		if (t1 > t2)
+		{
+			d = t1;
+			t1 = t2;
+			t2 = d;
+		}
+
+		enter = (t1 > enter) ? t1 : enter;
+		leave = (t2 < leave) ? t2 : leave;
+
+		if (enter > leave)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * clipstats
+ */
+void
+SV_ClipStats_f(void)
+{
+	Com_Printf("%i entity clips, %i rejected (%.1f%%)\n", clip_tests,
+			clip_rejects, clip_tests ? 100.0f * clip_rejects / clip_tests : 0);
+
+	clip_tests = clip_rejects = 0;
+}
+
+static void
+SV_ClipMoveToTouchList(moveclip_t *clip, edict_t **touchlist, int num)
+{
+	int i;
+	edict_t *touch;
+	trace_t trace;
+	int headnode;
+	float *angles;
+	float *mins, *maxs;
+
+	/* be careful, it is possible to have an entity in this
+	   list removed before we get to it (killtriggered) */
+	for (i = 0; i < num; i++)
+	{
+		touch = touchlist[i];
+
+		if (touch->solid == SOLID_NOT)
+		{
+			continue;
+		}
+
+		if (touch == clip->passedict)
+		{
+			continue;
+		}
+
+		if (clip->trace.allsolid)
+		{
+			return;
+		}
+
+		if (clip->passedict)
+		{
+			if (touch->owner == clip->passedict)
+			{
+				continue; /* don't clip against own missiles */
+			}
+
+			if (clip->passedict->owner == touch)
+			{
+				continue; /* don't clip against owner */
+			}
+		}
+
+		if (!(clip->contentmask & CONTENTS_DEADMONSTER) &&
+			(touch->svflags & SVF_DEADMONSTER))
+		{
+			continue;
+		}
+
+		mins = (touch->svflags & SVF_MONSTER) ? clip->mins2 : clip->mins;
+		maxs = (touch->svflags & SVF_MONSTER) ? clip->maxs2 : clip->maxs;
+
+		clip_tests++;
+
+		if (sv_clipreject->value && !SV_ClipMayTouch(clip, touch, mins, maxs))
+		{
+			clip_rejects++;
+			continue;
+		}
+
+		/* might intersect, so do an exact clip */
+		headnode = SV_HullForEntity(touch);
+		angles = touch->s.angles;
 
 		if (touch->solid != SOLID_BSP)
 		{
 			angles = vec3_origin; /* boxes don't rotate */
 		}
 
-		if (touch->svflags & SVF_MONSTER)
+		if (clip->capsule)
 		{
-			trace = CM_TransformedBoxTrace(clip->start, clip->end,
-					clip->mins2, clip->maxs2, headnode, clip->contentmask,
+			trace = CM_TransformedCapsuleTrace(clip->start, clip->end,
+					mins, maxs, headnode, clip->contentmask,
 					touch->s.origin, angles);
 		}
 		else
 		{
-			trace = CM_TransformedBoxTrace(clip->start, clip->end,
-					clip->mins, clip->maxs, headnode, clip->contentmask,
-					touch->s.origin, angles);
+			trace = CM_TransformedBoxTrace(clip->start, clip->end, mins, maxs,
+					headnode, clip->contentmask, touch->s.origin, angles);
 		}
 
 		if (trace.allsolid || trace.startsolid ||
@@ -650,6 +1197,18 @@ SV_ClipMoveToEntities(moveclip_t *clip)
 	}
 }
 
+void
+SV_ClipMoveToEntities(moveclip_t *clip)
+{
+	int num;
+	edict_t *touchlist[MAX_EDICTS];
+
+	num = SV_AreaEdicts(clip->boxmins, clip->boxmaxs, touchlist,
+			MAX_EDICTS, AREA_SOLID);
+
+	SV_ClipMoveToTouchList(clip, touchlist, num);
+}
+
 void
 SV_TraceBounds(vec3_t start, vec3_t mins, vec3_t maxs,
 		vec3_t end, vec3_t boxmins, vec3_t boxmaxs)
@@ -672,29 +1231,77 @@ SV_TraceBounds(vec3_t start, vec3_t mins, vec3_t maxs,
 }
 
 /*
- * Moves the given mins/maxs volume through the world from start to end.
- * Passedict and edicts owned by passedict are explicitly not checked.
+ * Forgets all cached traces. Called when a solid
+ * entity is linked or unlinked and every tick,
+ * since the game may change anything in between.
  */
-trace_t
-SV_Trace(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end,
-		edict_t *passedict, int contentmask)
+void
+SV_FlushTraceCache(void)
 {
-	moveclip_t clip;
+	trace_flushes++;
 
-	if (!mins)
+	/* on wrap around old entries could match again,
+	   0 is left to the empty ones */
+	if (++trace_generation == 0)
 	{
-		mins = vec3_origin;
+		memset(trace_cache, 0, sizeof(trace_cache));
+		trace_generation = 1;
 	}
+}
 
-	if (!maxs)
+static unsigned
+SV_HashTraceKey(const tracekey_t *key)
+{
+	const unsigned *w;
+	unsigned hash;
+	int i;
+
+	w = (const unsigned *)key;
+	hash = 2166136261u;
+
+	for (i = 0; i < sizeof(tracekey_t) / sizeof(unsigned); i++)
 	{
-		maxs = vec3_origin;
+		hash = (hash ^ w[i]) * 16777619u;
 	}
 
+	return (hash ^ (hash >> 15)) & (TRACECACHE_SIZE - 1);
+}
+
+/*
+ * tracecache
+ */
+void
+SV_TraceCache_f(void)
+{
+	if (!sv_tracecache->value)
+	{
+		Com_Printf("Set sv_tracecache 1 to cache the traces of a frame.\n");
+	}
+
+	Com_Printf("%i lookups, %i hits (%.1f%%), %i flushes\n", trace_lookups,
+			trace_hits, trace_lookups ? 100.0f * trace_hits / trace_lookups : 0,
+			trace_flushes);
+
+	trace_lookups = trace_hits = trace_flushes = 0;
+}
+
+static trace_t
+SV_ClipMove(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end,
+		edict_t *passedict, int contentmask, qboolean capsule)
+{
+	moveclip_t clip;
+
 	memset(&clip, 0, sizeof(moveclip_t));
 
 	/* clip to world */
-	clip.trace = CM_BoxTrace(start, end, mins, maxs, 0, contentmask);
+	if (capsule)
+	{
+		clip.trace = CM_CapsuleTrace(start, end, mins, maxs, 0, contentmask);
+	}
+	else
+	{
+		clip.trace = CM_BoxTrace(start, end, mins, maxs, 0, contentmask);
+	}
 	clip.trace.ent = ge->edicts;
 
 	if (clip.trace.fraction == 0)
@@ -703,6 +1310,7 @@ SV_Trace(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end,
 	}
 
 	clip.contentmask = contentmask;
+	clip.capsule = capsule;
 	clip.start = start;
 	clip.end = end;
 	clip.mins = mins;
@@ -722,3 +1330,352 @@ SV_Trace(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end,
 	return clip.trace;
 }
 
+/*
+ * With sv_tracecache set, a trace asked for again before
+ * anything solid moved is answered from the cache.
+ */
+static trace_t
+SV_CachedClipMove(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end,
+		edict_t *passedict, int contentmask, qboolean capsule)
+{
+	tracekey_t key;
+	tracecache_t *entry;
+	trace_t trace;
+	long long tracetime;
+
+	tracetime = SV_ProfileBegin();
+
+	if (!mins)
+	{
+		mins = vec3_origin;
+	}
+
+	if (!maxs)
+	{
+		maxs = vec3_origin;
+	}
+
+	if (!sv_tracecache->value)
+	{
+		trace = SV_ClipMove(start, mins, maxs, end, passedict,
+				contentmask, capsule);
+		SV_ProfileEnd(PROF_TRACE, tracetime);
+		return trace;
+	}
+
+	/* the padding is hashed and compared too */
+	memset(&key, 0, sizeof(key));
+	VectorCopy(start, key.start);
+	VectorCopy(end, key.end);
+	VectorCopy(mins, key.mins);
+	VectorCopy(maxs, key.maxs);
+	key.passedict = passedict;
+	key.contentmask = contentmask;
+	key.capsule = capsule;
+
+	entry = &trace_cache[SV_HashTraceKey(&key)];
+	trace_lookups++;
+
+	if ((entry->generation == trace_generation) &&
+		!memcmp(&entry->key, &key, sizeof(key)))
+	{
+		trace_hits++;
+		SV_ProfileEnd(PROF_TRACE, tracetime);
+		return entry->trace;
+	}
+
+	trace = SV_ClipMove(start, mins, maxs, end, passedict,
+			contentmask, capsule);
+
+	entry->key = key;
+	entry->generation = trace_generation;
+	entry->trace = trace;
+
+	SV_ProfileEnd(PROF_TRACE, tracetime);
+	return trace;
+}
+
+/*
+ * Moves the given mins/maxs volume through the world from start to end.
+ * Passedict and edicts owned by passedict are explicitly not checked.
+ */
+trace_t
+SV_Trace(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end,
+		edict_t *passedict, int contentmask)
+{
+	return SV_CachedClipMove(start, mins, maxs, end, passedict,
+			contentmask, false);
+}
+
+/*
+ * Like SV_Trace, but moves the upright capsule
+ * that fits into mins/maxs instead of the box.
+ */
+trace_t
+SV_CapsuleTrace(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end,
+		edict_t *passedict, int contentmask)
+{
+	return SV_CachedClipMove(start, mins, maxs, end, passedict,
+			contentmask, true);
+}
+
+/*
+ * Traces count moves of the same mins/maxs at once. The world is
+ * walked once for a batch of them and the solid entities are
+ * looked up once for all, so fans of traces like the pellets of
+ * a shotgun are cheaper than the same number of SV_Trace calls.
+ */
+void
+SV_TraceBatch(int count, vec3_t *starts, vec3_t *ends, vec3_t mins,
+		vec3_t maxs, edict_t *passedict, int contentmask, trace_t *traces)
+{
+	moveclip_t clip;
+	edict_t *touchlist[MAX_EDICTS], *raylist[MAX_EDICTS];
+	edict_t *touch;
+	vec3_t boxmins, boxmaxs;
+	int i, j, num, numray;
+	qboolean moving;
+	long long tracetime;
+
+	if (count <= 0)
+	{
+		return;
+	}
+
+	tracetime = SV_ProfileBegin();
+
+	if (!mins)
+	{
+		mins = vec3_origin;
+	}
+
+	if (!maxs)
+	{
+		maxs = vec3_origin;
+	}
+
+	/* clip to world */
+	CM_BoxTraceBatch(count, starts, ends, mins, maxs, 0, contentmask, traces);
+
+	memset(&clip, 0, sizeof(moveclip_t));
+
+	clip.contentmask = contentmask;
+	clip.mins = mins;
+	clip.maxs = maxs;
+	clip.passedict = passedict;
+
+	VectorCopy(mins, clip.mins2);
+	VectorCopy(maxs, clip.maxs2);
+
+	/* the bounding box of all moves not blocked by the world */
+	ClearBounds(boxmins, boxmaxs);
+	moving = false;
+
+	for (i = 0; i < count; i++)
+	{
+		traces[i].ent = ge->edicts;
+
+		if (traces[i].fraction == 0)
+		{
+			continue;
+		}
+
+		SV_TraceBounds(starts[i], clip.mins2, clip.maxs2,
+				ends[i], clip.boxmins, clip.boxmaxs);
+		AddPointToBounds(clip.boxmins, boxmins, boxmaxs);
+		AddPointToBounds(clip.boxmaxs, boxmins, boxmaxs);
+		moving = true;
+	}
+
+	if (!moving)
+	{
+		SV_ProfileEnd(PROF_TRACE, tracetime);
+		return; /* all blocked by the world */
+	}
+
+	num = SV_AreaEdicts(boxmins, boxmaxs, touchlist, MAX_EDICTS, AREA_SOLID);
+
+	/* clip each move to the entities its own box touches */
+	for (i = 0; i < count; i++)
+	{
+		if (traces[i].fraction == 0)
+		{
+			continue;
+		}
+
+		clip.start = starts[i];
+		clip.end = ends[i];
+		clip.trace = traces[i];
+
+		SV_TraceBounds(starts[i], clip.mins2, clip.maxs2,
+				ends[i], clip.boxmins, clip.boxmaxs);
+
+		for (j = numray = 0; j < num; j++)
+		{
+			touch = touchlist[j];
+
+			if ((touch->absmin[0] > clip.boxmaxs[0]) ||
+				(touch->absmin[1] > clip.boxmaxs[1]) ||
+				(touch->absmin[2] > clip.boxmaxs[2]) ||
+				(touch->absmax[0] < clip.boxmins[0]) ||
+				(touch->absmax[1] < clip.boxmins[1]) ||
+				(touch->absmax[2] < clip.boxmins[2]))
+			{
+				continue; /* not touching */
+			}
+
+			raylist[numray++] = touch;
+		}
+
+		SV_ClipMoveToTouchList(&clip, raylist, numray);
+		traces[i] = clip.trace;
+	}
+
+	SV_ProfileEnd(PROF_TRACE, tracetime);
+}
+
+static unsigned bench_seed;
+
+static float
+SV_BenchRandom(void)
+{
+	bench_seed = bench_seed * 1103515245 + 12345;
+
+	return (bench_seed >> 8) * (1.0f / 16777216.0f);
+}
+
+/*
+ * tracebench [rays]
+ *
+ * Traces the same random rays through the world and against a
+ * box hull, once with the scalar brush clipping and once with
+ * the vector one. Prints the time of each and how many traces
+ * are not exactly the same, which must be none.
+ */
+void
+SV_TraceBench_f(void)
+{
+	static const vec3_t hulls[3][2] = {
+		{{0, 0, 0}, {0, 0, 0}},
+		{{-4, -4, -4}, {4, 4, 4}},
+		{{-16, -16, -24}, {16, 16, 32}}
+	};
+	vec3_t *starts, *ends;
+	vec3_t boxmins, boxmaxs, size;
+	trace_t *results, tr;
+	cmodel_t *world;
+	float *mins, *maxs;
+	int count, simd, i, j, diff, headnode;
+	long long start, usec;
+
+	if (sv.state != ss_game)
+	{
+		Com_Printf("No map running.\n");
+		return;
+	}
+
+	count = (Cmd_Argc() > 1) ? (int)strtol(Cmd_Argv(1), NULL, 10) : 100000;
+
+	if (count < 1)
+	{
+		count = 1;
+	}
+
+	world = sv.models[1];
+	VectorSubtract(world->maxs, world->mins, size);
+
+	starts = Z_Malloc(count * sizeof(vec3_t));
+	ends = Z_Malloc(count * sizeof(vec3_t));
+	results = Z_Malloc(count * sizeof(trace_t));
+
+	/* some rays are position tests, some short and some
+	   cross the map, every eighth one hits a box hull */
+	bench_seed = 1;
+
+	for (i = 0; i < count; i++)
+	{
+		for (j = 0; j < 3; j++)
+		{
+			starts[i][j] = world->mins[j] + SV_BenchRandom() * size[j];
+
+			if ((i & 7) == 1)
+			{
+				ends[i][j] = starts[i][j];
+			}
+			else if (i & 2)
+			{
+				ends[i][j] = starts[i][j] + (SV_BenchRandom() - 0.5f) * 256;
+			}
+			else
+			{
+				ends[i][j] = world->mins[j] + SV_BenchRandom() * size[j];
+			}
+		}
+	}
+
+	for (simd = 0; simd < 2; simd++)
+	{
+		CM_UseSIMD(simd);
+
+		diff = 0;
+		start = Sys_Microseconds();
+
+		for (i = 0; i < count; i++)
+		{
+			mins = (float *)hulls[i % 3][0];
+			maxs = (float *)hulls[i % 3][1];
+
+			if ((i & 7) == 7)
+			{
+				for (j = 0; j < 3; j++)
+				{
+					boxmins[j] = starts[i][j] - 32;
+					boxmaxs[j] = starts[i][j] + 32;
+				}
+
+				headnode = CM_HeadnodeForBox(boxmins, boxmaxs);
+				tr = CM_TransformedBoxTrace(ends[i], starts[i], mins, maxs,
+						headnode, MASK_ALL, vec3_origin, vec3_origin);
+			}
+			else
+			{
+				tr = CM_BoxTrace(starts[i], ends[i], mins, maxs, 0, MASK_ALL);
+			}
+
+			if (!simd)
+			{
+				results[i] = tr;
+			}
+			else if ((tr.fraction != results[i].fraction) ||
+					 (tr.allsolid != results[i].allsolid) ||
+					 (tr.startsolid != results[i].startsolid) ||
+					 !VectorCompare(tr.endpos, results[i].endpos) ||
+					 !VectorCompare(tr.plane.normal, results[i].plane.normal) ||
+					 (tr.plane.dist != results[i].plane.dist) ||
+					 (tr.surface != results[i].surface) ||
+					 (tr.contents != results[i].contents))
+			{
+				diff++;
+			}
+		}
+
+		usec = Sys_Microseconds() - start;
+
+		Com_Printf("%-6s: %i traces, %i ms, %.3f usec per trace",
+				CM_SIMDImplementation(), count, (int)(usec / 1000),
+				(float)usec / count);
+
+		if (simd)
+		{
+			Com_Printf(", %i differ", diff);
+		}
+
+		Com_Printf("\n");
+	}
+
+	CM_UseSIMD(true);
+
+	Z_Free(results);
+	Z_Free(ends);
+	Z_Free(starts);
+}